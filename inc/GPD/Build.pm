@@ -10,19 +10,25 @@ use Getopt::Long qw( :config pass_through );
 
 # yes, doing this in a module is ugly; OTOH it's a private module
 GetOptions(
-    'g'         => \my $DEBUG,
+    'g'                 => \my $DEBUG,
+    # counts heap allocations, for t/155_encode_allocations.t
+    'count-allocations' => \my $COUNT_ALLOCATIONS,
 );
 
 sub new {
     my $class = shift;
     my $debug_flag = $DEBUG ? ' -g' : '';
+    # native worker threads, used by the decode_threads option
+    my @thread_flags = $^O eq 'MSWin32' ? () : ('-pthread');
+    my @thread_defines = @thread_flags ? ('-DGPD_WORKER_THREADS') : ();
+    my @test_defines = $COUNT_ALLOCATIONS ? ('-DGPD_COUNT_ALLOCATIONS') : ();
     my $self = $class->SUPER::new(
         @_,
         extra_typemap_modules => {
             'ExtUtils::Typemaps::STL::String' => '0',
         },
-        extra_linker_flags => [Alien::uPB->libs, Alien::ProtoBuf->libs],
-        extra_compiler_flags => [$debug_flag, Alien::uPB->cflags, Alien::ProtoBuf->cflags, Alien::ProtoBuf->cxxflags, "-DPERL_NO_GET_CONTEXT"],
+        extra_linker_flags => [Alien::uPB->libs, Alien::ProtoBuf->libs, @thread_flags],
+        extra_compiler_flags => [$debug_flag, Alien::uPB->cflags, Alien::ProtoBuf->cflags, Alien::ProtoBuf->cxxflags, "-DPERL_NO_GET_CONTEXT", @thread_flags, @thread_defines, @test_defines],
         script_files => [qw(scripts/protoc-gen-perl-gpd)],
     );
 
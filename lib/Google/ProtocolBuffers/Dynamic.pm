@@ -73,6 +73,13 @@ sub _dump {
     Data::Dumper::Dumper(@_)
 }
 
+# neither the registry nor stream/async decoders are cloned into new
+# threads, mapped classes are (see L</THREADS>)
+sub CLONE_SKIP { 1 }
+
+sub Google::ProtocolBuffers::Dynamic::StreamDecoder::CLONE_SKIP { 1 }
+sub Google::ProtocolBuffers::Dynamic::AsyncDecode::CLONE_SKIP { 1 }
+
 1;
 
 __END__
@@ -627,13 +634,114 @@ of a non-message field.
 
 Not available for Perl 5.12 or older.
 
+=head2 zero_copy_bytes
+
+When decoding, the value of C<bytes> fields is not copied out of the
+serialized data: instead the decoded value points inside (a
+copy-on-write copy of) the input string.
+
+This is mostly useful to avoid copying large binary payloads, and is
+only effective on Perls with copy-on-write strings (5.20 and newer);
+on older Perls the input is copied once per decode call. Decoded
+C<bytes> values are read-only, but they can be replaced using the
+accessor methods.
+
+=head2 native_encoder
+
+When encoding to protocol buffer format, write the serialized data
+directly instead of going through the uPB encoder. The output is the
+same, but encoding is faster, especially for nested messages.
+
+JSON encoding always uses uPB.
+
+=head2 deterministic
+
+Serialize fields sorted by field number and map entries sorted by key
+(numerically for integer keys, by UTF-8 bytes for string keys), so the
+same message content always produces the same serialized data, which
+can then be used as a cache key or to compare messages.
+
+When one of the members of a oneof is set multiple times, the one with
+the lowest field number is used.
+
+=head2 lazy_fields
+
+    lazy_fields => 1
+    lazy_fields => ['package.Message.field', ...]
+
+Defer decoding of message fields (all of them, or only the listed
+ones) until they are accessed. When decoding protocol buffer data, the
+serialized value of the field is stored in place of the decoded
+message, and it is decoded the first time it is read through the
+getter, item and list accessors.
+
+Accessing the hash directly returns the serialized value, so only use
+this option with accessors. Values that are never accessed are copied
+back verbatim by L</native_encoder>, and decoded and encoded again by
+the uPB encoder.
+
+JSON decoding and group fields are not affected.
+
+=head2 preserve_unknown_fields
+
+When decoding protocol buffer data, keep fields not present in the
+message definition (for example, fields added by a newer version of
+the schema) and write them back unchanged when encoding the message,
+after the known fields.
+
+Unknown fields are stored in serialized form, attached to the message
+hash, so they are lost when the data is copied to a different hash.
+Enables L</native_encoder>, because uPB can't encode unknown fields;
+they are never written to JSON.
+
+=head2 decode_threads
+
+Number of threads (including the calling thread) used to decode
+protocol buffer inputs of at least 64KB; the default (C<0>) decodes on
+the calling thread only.
+
+The sub-messages of the top-level message (for example the items of a
+large repeated message field) are parsed in parallel by native threads
+shared by all message classes; the Perl values are then created by the
+calling thread. The decoded value is the same as without this option;
+inputs the parallel decoder can't handle (including malformed ones)
+are decoded again by the normal decoder, which reports the error.
+
+Worker threads use POSIX threads and do not need a C<perl> built with
+C<ithreads>; on Windows decoding is always done on the calling thread.
+
+=head2 warning_context
+
+Defaults to true: when encoding, Perl warnings (for example about
+undefined values) are prefixed with the path of the field being
+encoded, as in C<While encoding field 'persons.[1].name': ...>.
+
+Setting it to false skips installing the warning handler and tracking
+the field path for each encode call, which makes encoding slightly
+faster; warnings are then emitted without the field path.
+
+=head1 THREADS
+
+Message classes mapped before a thread is created can be used in the
+new thread without mapping them again: the compiled encoders and
+decoders are shared between threads, while each thread gets its own
+copy of the Perl-side state. Decoded values (including lazy fields and
+zero-copy bytes values) are cloned into the new thread as usual.
+
+The C<Google::ProtocolBuffers::Dynamic> object, stream decoders and
+pending L<decode_async|Google::ProtocolBuffers::Dynamic::Message/decode_async>
+results are not cloned, so they are C<undef> in the new thread; to map more classes
+in a thread, create a new C<Google::ProtocolBuffers::Dynamic> instance
+there.
+
 =head1 KNOWN BUGS
 
 When a field has the incorrect value, sometimes serialization performs
 a coercion, sometimes it throws an error, but it should always be an
 error.
 
-Unknown fields are discarded on deserialization.
+Unknown fields are discarded on deserialization, unless
+L</preserve_unknown_fields> is set.
 
 Proto3 support is only partial (support for well-known types, such as Any and Duration is missing).
 
@@ -18,6 +18,41 @@ my $d;
     $d->map_message("test.PersonArray", "DynamicPersonArray");
     $d->resolve_references();
 }
+my $d_nocheck;
+{
+    $d_nocheck = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $d_nocheck->load_file("person.proto");
+    $d_nocheck->map_message("test.Person", "DynamicPersonNoCheck", { check_required_fields => 0 });
+    $d_nocheck->map_message("test.PersonArray", "DynamicPersonArrayNoCheck", { check_required_fields => 0 });
+    $d_nocheck->resolve_references();
+}
+
+my $d_wide;
+{
+    $d_wide = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $d_wide->load_file("scalar.proto");
+    $d_wide->map({ package => 'test', prefix => 'DynamicWide' });
+    $d_wide->map({ package => 'test', prefix => 'DynamicWideNative', options => { native_encoder => 1 } });
+}
+
+my $d_presize;
+{
+    $d_presize = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $d_presize->load_file("person.proto");
+    $d_presize->map({ package => 'test', prefix => 'DynamicPresize' });
+}
+
+my ($d_maps, $d_deterministic);
+{
+    $d_maps = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $d_maps->load_file("map.proto");
+    $d_maps->map({ package => 'test', prefix => 'DynamicDefault' });
+
+    $d_deterministic = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $d_deterministic->load_file("person.proto");
+    $d_deterministic->load_file("map.proto");
+    $d_deterministic->map({ package => 'test', prefix => 'DynamicDeterministic', options => { deterministic => 1 } });
+}
 
 my $sereal_encoder = Sereal::Encoder->new;
 my $sereal_decoder = Sereal::Decoder->new;
@@ -104,3 +139,85 @@ cmpthese(-1, {
     sereal      => \&decode_sereal_arr,
     json        => \&decode_json_arr,
 });
+
+sub decode_protobuf_arr_nocheck { DynamicPersonArrayNoCheck->decode($pbd_persons); }
+
+print "\nDecoder (required fields check)\n";
+cmpthese(-1, {
+    check       => \&decode_protobuf_arr,
+    no_check    => \&decode_protobuf_arr_nocheck,
+});
+
+my $wide = {
+    double_f    => 1.5,
+    float_f     => 2.5,
+    int32_f     => -3,
+    int64_f     => 4,
+    uint32_f    => 5,
+    uint64_f    => 6,
+    bool_f      => 1,
+    string_f    => chars(10, 20),
+    bytes_f     => chars(10, 20),
+    enum_f      => 2,
+    sint32_f    => -7,
+    sint64_f    => -8,
+    fixed32_f   => 9,
+    sfixed32_f  => -10,
+    fixed64_f   => 11,
+    sfixed64_f  => -12,
+};
+
+# a message with many scalar fields, where the per-field overhead of the
+# encoder dominates
+sub encode_protobuf_wide { DynamicWide::Basic->encode($wide); }
+sub encode_protobuf_wide_native { DynamicWideNative::Basic->encode($wide); }
+sub encode_sereal_wide { $sereal_encoder->encode($wide); }
+sub encode_json_wide { JSON::encode_json($wide); }
+
+print "\nEncoder (wide messages)\n";
+cmpthese(-1, {
+    protobuf        => \&encode_protobuf_wide,
+    protobuf_native => \&encode_protobuf_wide_native,
+    sereal          => \&encode_sereal_wide,
+    json            => \&encode_json_wide,
+});
+
+my $pbd_one_person = DynamicPersonArray->encode({ persons => [$person] });
+
+# arrays are pre-sized using the element count of the last decoded
+# value of the same field: decoding a one-element array in between
+# resets it, both subs decode the same data
+sub decode_protobuf_arr_presized {
+    DynamicPresize::PersonArray->decode($pbd_one_person);
+    DynamicPersonArray->decode($pbd_persons);
+}
+sub decode_protobuf_arr_not_presized {
+    DynamicPresize::PersonArray->decode($pbd_one_person);
+    DynamicPresize::PersonArray->decode($pbd_persons);
+}
+
+print "\nDecoder (pre-sized arrays)\n";
+cmpthese(-1, {
+    presized        => \&decode_protobuf_arr_presized,
+    not_presized    => \&decode_protobuf_arr_not_presized,
+});
+
+my $maps = {
+    string_int32_map => { map { (chars(5, 15) => $_) } 1 .. 100 },
+};
+
+sub encode_protobuf_arr_deterministic { DynamicDeterministic::PersonArray->encode($persons); }
+sub encode_protobuf_map { DynamicDefault::Maps->encode($maps); }
+sub encode_protobuf_map_deterministic { DynamicDeterministic::Maps->encode($maps); }
+
+print "\nEncoder (deterministic, arrays)\n";
+cmpthese(-1, {
+    default         => \&encode_protobuf_arr,
+    deterministic   => \&encode_protobuf_arr_deterministic,
+});
+
+print "\nEncoder (deterministic, maps)\n";
+cmpthese(-1, {
+    default         => \&encode_protobuf_map,
+    deterministic   => \&encode_protobuf_map_deterministic,
+});
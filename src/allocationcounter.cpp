@@ -0,0 +1,93 @@
+#include "allocationcounter.h"
+
+#ifdef GPD_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+#endif
+
+using namespace gpd;
+
+#ifdef GPD_COUNT_ALLOCATIONS
+
+namespace {
+    size_t allocations = 0;
+
+    void *counted_malloc(size_t size) {
+        ++allocations;
+        // operator new must return a unique pointer for zero-sized requests
+        return malloc(size ? size : 1);
+    }
+
+    void *counting_upb_alloc(upb_alloc *alloc, void *ptr, size_t oldsize, size_t size) {
+        if (size != 0)
+            ++allocations;
+
+        return upb_alloc_global.func(&upb_alloc_global, ptr, oldsize, size);
+    }
+
+    upb_alloc counting_alloc = { &counting_upb_alloc };
+}
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#define THROW_NOTHING noexcept
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#define THROW_NOTHING throw()
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC {
+    void *ptr = counted_malloc(size);
+
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) THROW_BAD_ALLOC {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) THROW_NOTHING {
+    return counted_malloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) THROW_NOTHING {
+    return counted_malloc(size);
+}
+
+void operator delete(void *ptr) THROW_NOTHING {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) THROW_NOTHING {
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) THROW_NOTHING {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) THROW_NOTHING {
+    free(ptr);
+}
+
+size_t gpd::allocation_count() {
+    return allocations;
+}
+
+upb_alloc *gpd::upb_allocator() {
+    return &counting_alloc;
+}
+
+#else
+
+size_t gpd::allocation_count() {
+    return 0;
+}
+
+upb_alloc *gpd::upb_allocator() {
+    return &upb_alloc_global;
+}
+
+#endif
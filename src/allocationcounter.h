@@ -0,0 +1,24 @@
+#ifndef _GPD_XS_ALLOCATIONCOUNTER_INCLUDED
+#define _GPD_XS_ALLOCATIONCOUNTER_INCLUDED
+
+#include <upb/upb.h>
+
+#include <cstddef>
+
+namespace gpd {
+
+// when built with GPD_COUNT_ALLOCATIONS (used by tests), counts calls to
+// the global operator new and allocations made through the upb allocator
+// returned by upb_allocator(); it does not count allocations made by Perl
+// (for example when growing the output SV) or direct calls to malloc()
+//
+// the count is not synchronized, so it is only meaningful when no worker
+// threads are running
+size_t allocation_count();
+
+// the allocator used for upb environments
+upb_alloc *upb_allocator();
+
+}
+
+#endif
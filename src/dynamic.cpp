@@ -33,6 +33,13 @@ MappingOptions::MappingOptions(pTHX_ SV *options_ref) :
         generic_extension_methods(true),
         implicit_maps(false),
         decode_blessed(true),
+        zero_copy_bytes(false),
+        native_encoder(false),
+        preserve_unknown_fields(false),
+        deterministic(false),
+        warning_context(true),
+        lazy_all_fields(false),
+        decode_threads(0),
         accessor_style(GetAndSet),
         client_services(Disable) {
     if (options_ref == NULL || !SvOK(options_ref))
@@ -56,6 +63,11 @@ MappingOptions::MappingOptions(pTHX_ SV *options_ref) :
     BOOLEAN_OPTION(implicit_maps, implicit_maps);
     BOOLEAN_OPTION(decode_blessed, decode_blessed);
     BOOLEAN_OPTION(fail_ref_coercion, fail_ref_coercion);
+    BOOLEAN_OPTION(zero_copy_bytes, zero_copy_bytes);
+    BOOLEAN_OPTION(native_encoder, native_encoder);
+    BOOLEAN_OPTION(preserve_unknown_fields, preserve_unknown_fields);
+    BOOLEAN_OPTION(deterministic, deterministic);
+    BOOLEAN_OPTION(warning_context, warning_context);
 
     if (SV **value = hv_fetchs(options, "accessor_style", 0)) {
         const char *buf = SvPV_nolen(*value);
@@ -85,6 +97,29 @@ MappingOptions::MappingOptions(pTHX_ SV *options_ref) :
             croak("Invalid value '%s' for 'client_services' option", buf);
     }
 
+    if (SV **value = hv_fetchs(options, "lazy_fields", 0)) {
+        if (SvROK(*value) && SvTYPE(SvRV(*value)) == SVt_PVAV) {
+            AV *names = (AV *) SvRV(*value);
+
+            for (int i = 0, max = av_len(names); i <= max; ++i) {
+                SV **name = av_fetch(names, i, 0);
+
+                if (name)
+                    lazy_field_names.insert(SvPV_nolen(*name));
+            }
+        } else {
+            lazy_all_fields = SvTRUE(*value);
+        }
+    }
+
+    if (SV **value = hv_fetchs(options, "decode_threads", 0)) {
+        IV threads = SvIV(*value);
+
+        if (threads < 0)
+            croak("Invalid value '%" IVdf "' for 'decode_threads' option", threads);
+        decode_threads = threads;
+    }
+
 #undef BOOLEAN_OPTION
 }
 
@@ -131,18 +166,44 @@ namespace {
         return 0;
     }
 
-    MGVTBL manage_refcounted = {
+#ifdef USE_ITHREADS
+    // when a thread is created, the bound XSUB gets a copy of the object
+    // for the new interpreter, sharing the upb handlers with the original
+    template<class T>
+    int dup_refcounted(pTHX_ MAGIC *mg, CLONE_PARAMS *params) {
+        T *clone = T::clone(aTHX_ static_cast<const T *>((const Refcounted *) mg->mg_ptr), params);
+
+        // mg_obj is the XSUB the magic is attached to
+        mg->mg_ptr = (char *) static_cast<Refcounted *>(clone);
+        CvXSUBANY((CV *) mg->mg_obj).any_ptr = static_cast<Refcounted *>(clone);
+
+        return 0;
+    }
+#endif
+
+    template<class T>
+    struct ManageRefcounted {
+        static MGVTBL vtbl;
+    };
+
+    template<class T>
+    MGVTBL ManageRefcounted<T>::vtbl = {
         NULL, // get
         NULL, // set
         NULL, // len
         NULL, // clear
         free_refcounted,
         NULL, // copy
+#ifdef USE_ITHREADS
+        dup_refcounted<T>,
+#else
         NULL, // dup
+#endif
         NULL, // local
     };
 
-    void copy_and_bind(pTHX_ const char *name, const char *target, const string &perl_package, Refcounted *refcounted) {
+    template<class T>
+    void copy_and_bind(pTHX_ const char *name, const char *target, const string &perl_package, T *refcounted) {
         static const char prefix[] = "Google::ProtocolBuffers::Dynamic::Mapper::";
         size_t length = strlen(name);
         char buffer[sizeof(prefix) + length + 1];
@@ -153,14 +214,20 @@ namespace {
         CV *src = get_cv(buffer, 0);
         CV *new_xs = newXS((perl_package + "::" + target).c_str(), CvXSUB(src), __FILE__);
 
-        CvXSUBANY(new_xs).any_ptr = refcounted;
-        sv_magicext((SV *) new_xs, NULL,
-                    PERL_MAGIC_ext, &manage_refcounted,
-                    (const char *) refcounted, 0);
+        CvXSUBANY(new_xs).any_ptr = static_cast<Refcounted *>(refcounted);
+        MAGIC *mg = sv_magicext((SV *) new_xs, (SV *) new_xs,
+                                PERL_MAGIC_ext, &ManageRefcounted<T>::vtbl,
+                                (const char *) static_cast<Refcounted *>(refcounted), 0);
+#ifdef USE_ITHREADS
+        mg->mg_flags |= MGf_DUP;
+#else
+        PERL_UNUSED_VAR(mg);
+#endif
         refcounted->ref();
     }
 
-    void copy_and_bind(pTHX_ const char *name, const string &perl_package, Refcounted *refcounted) {
+    template<class T>
+    void copy_and_bind(pTHX_ const char *name, const string &perl_package, T *refcounted) {
         copy_and_bind(aTHX_ name, name, perl_package, refcounted);
     }
 
@@ -433,7 +500,16 @@ void Dynamic::map_message(pTHX_ const Descriptor *descriptor, const string &perl
     pending.push_back(mapper);
 
     copy_and_bind(aTHX_ "decode", perl_package, mapper);
+    copy_and_bind(aTHX_ "decode_many", perl_package, mapper);
+    copy_and_bind(aTHX_ "decode_stream", perl_package, mapper);
+    copy_and_bind(aTHX_ "decode_partial", perl_package, mapper);
+    copy_and_bind(aTHX_ "decode_into", perl_package, mapper);
+    copy_and_bind(aTHX_ "stream_decoder", perl_package, mapper);
+    copy_and_bind(aTHX_ "decode_async", perl_package, mapper);
     copy_and_bind(aTHX_ "encode", perl_package, mapper);
+    copy_and_bind(aTHX_ "encode_many", perl_package, mapper);
+    copy_and_bind(aTHX_ "encode_into", perl_package, mapper);
+    copy_and_bind(aTHX_ "encoded_size", perl_package, mapper);
     copy_and_bind(aTHX_ "decode_json", perl_package, mapper);
     copy_and_bind(aTHX_ "encode_json", perl_package, mapper);
     copy_and_bind(aTHX_ "new", perl_package, mapper);
@@ -621,6 +697,13 @@ void Dynamic::map_service_grpc_xs(pTHX_ const ServiceDescriptor *descriptor, con
 void Dynamic::resolve_references() {
     for (std::vector<Mapper *>::iterator it = pending.begin(), en = pending.end(); it != en; ++it)
         (*it)->resolve_mappers();
+    // propagate lazy fields and unknown field preservation to messages
+    // containing them, also for recursive messages
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (std::vector<Mapper *>::iterator it = pending.begin(), en = pending.end(); it != en; ++it)
+            changed = (*it)->resolve_scanned_fields() || changed;
+    }
     for (std::vector<Mapper *>::iterator it = pending.begin(), en = pending.end(); it != en; ++it)
         (*it)->create_encoder_decoder();
     pending.clear();
@@ -44,6 +44,16 @@ struct MappingOptions {
     bool implicit_maps;
     bool decode_blessed;
     bool fail_ref_coercion;
+    bool zero_copy_bytes;
+    bool native_encoder;
+    bool preserve_unknown_fields;
+    bool deterministic;
+    bool warning_context;
+    // sub-message fields decoded on first access
+    bool lazy_all_fields;
+    STD_TR1::unordered_set<std::string> lazy_field_names;
+    // threads used to decode large inputs
+    int decode_threads;
     AccessorStyle accessor_style;
     ClientService client_services;
 
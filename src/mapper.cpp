@@ -1,12 +1,22 @@
 #include "mapper.h"
+#include "allocationcounter.h"
 #include "dynamic.h"
 #include "servicedef.h"
+#include "workerpool.h"
 
 #include "perl_unpollute.h"
 
 #include <upb/pb/encoder.h>
 #include <upb/pb/decoder.h>
 
+#include <algorithm>
+
+#ifdef GPD_WORKER_THREADS
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
 using namespace gpd;
 using namespace std;
 using namespace upb;
@@ -22,6 +32,20 @@ using namespace upb::json;
 #define HAS_FULL_NOMG (PERL_VERSION >= 14)
 
 namespace {
+#ifdef USE_ITHREADS
+    // upb does not update the reference counts of non-frozen handlers
+    // atomically, and handlers are shared between interpreters, so this
+    // is held while linking handlers together or releasing them
+    perl_mutex handlers_mutex;
+#endif
+
+    struct HandlersLock {
+#ifdef USE_ITHREADS
+        HandlersLock() { MUTEX_LOCK(&handlers_mutex); }
+        ~HandlersLock() { MUTEX_UNLOCK(&handlers_mutex); }
+#endif
+    };
+
     void unref_on_scope_leave(void *ref) {
         ((Refcounted *) ref)->unref();
     }
@@ -30,901 +54,3309 @@ namespace {
         SAVEDESTRUCTOR(unref_on_scope_leave, ref);
     }
 
-    void delete_upb_env(upb::Environment *env) {
-        delete env;
+    // initial arena block of reusable environments, and the limit it can
+    // grow to; the block is per decoder context/concurrent encoder call
+    const size_t MIN_ENVIRONMENT_BLOCK = 4 * 1024;
+    const size_t MAX_ENVIRONMENT_BLOCK = 64 * 1024;
+
+    // upper bound for the size hint of repeated fields and maps, to avoid
+    // over-allocating after decoding an unusually large value
+    const IV MAX_SIZE_HINT = 1024;
+    // default number of buckets for a Perl hash
+    const size_t HASH_BUCKETS = 8;
+    // protobuf messages are limited to 2GB
+    const uint64_t MAX_MESSAGE_LENGTH = 0x7fffffff;
+
+    void presize_hash(pTHX_ HV *hv, size_t keys) {
+        if (keys > HASH_BUCKETS)
+            hv_ksplit(hv, keys);
     }
 
-    upb::Environment *make_localized_environment(pTHX_ upb::Status *report_errors_to) {
-        upb::Environment *env = new upb::Environment();
+    // returns NULL for a truncated or overlong varint
+    const char *read_varint(const char *buffer, const char *end, uint64_t *value) {
+        *value = 0;
+        for (int shift = 0; buffer < end && shift < 64; shift += 7) {
+            unsigned char byte = *buffer++;
 
-        env->ReportErrorsTo(report_errors_to);
-        SAVEDESTRUCTOR(delete_upb_env, env);
+            *value |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return buffer;
+        }
 
-        return env;
+        return NULL;
     }
-}
-
-Mapper::DecoderHandlers::DecoderHandlers(pTHX_ const Mapper *mapper) {
-    SET_THX_MEMBER;
-    mappers.push_back(mapper);
-}
 
-void Mapper::DecoderHandlers::prepare(HV *target) {
-    mappers.resize(1);
-    seen_fields.resize(1);
-    seen_fields.back().clear();
-    seen_fields.back().resize(mappers.back()->fields.size());
-    if (int oneof_count = mappers.back()->message_def->oneof_count()) {
-        seen_oneof.resize(1);
-        seen_oneof.back().clear();
-        seen_oneof.back().resize(oneof_count, -1);
-    }
-    items.resize(1);
-    error.clear();
-    items[0] = (SV *) target;
-    string = NULL;
-}
+    // returns the number of bytes written, at most 10
+    size_t write_varint(char *buffer, uint64_t value) {
+        size_t size = 0;
 
-SV *Mapper::DecoderHandlers::get_target() {
-    return items[0];
-}
+        do {
+            unsigned char byte = value & 0x7f;
 
-void Mapper::DecoderHandlers::clear() {
-    SvREFCNT_dec(items[0]);
-}
+            value >>= 7;
+            buffer[size++] = value ? byte | 0x80 : byte;
+        } while (value);
 
-namespace {
-#if PERL_VERSION < 18
-    inline SSize_t GPD_av_top_index(pTHX_ AV *av) {
-        return AvFILL(av);
+        return size;
     }
-    #define av_top_index(av) GPD_av_top_index(aTHX_ (av))
-
-    #define READ_XDIGIT(s)  ((0xf & (isDIGIT(*(s))     \
-                                    ? (*(s)++)         \
-                                    : (*(s)++ + 9))))
-#endif
 
-#if PERL_VERSION < 14
-    inline void GPD_warn_sv(pTHX_ SV *mess) {
-        warn("%" SVf, mess);
-    }
-    #define warn_sv(sv) GPD_warn_sv(aTHX_ (sv))
-#endif
+    // initial allocation for encoder output, when there is no size hint
+    const size_t MIN_OUTPUT_SIZE = 64;
 
-    inline void set_bool(pTHX_ SV *target, bool value) {
-        if (value)
-            sv_setiv(target, 1);
-        else
-            sv_setpvn(target, "", 0);
-    }
-}
+    // smaller inputs are always decoded on the calling thread
+    const STRLEN PARALLEL_DECODE_MIN_SIZE = 64 * 1024;
+    // sub-messages are split in more batches than threads, to even out
+    // the work when messages have very different sizes
+    const int BATCHES_PER_THREAD = 4;
 
-string Mapper::Field::full_name() const {
-    if (field_def->is_extension())
-        return field_def->full_name();
-    else
-        return string(field_def->containing_type()->full_name()) +
-               '.' +
-               field_def->name();
 }
 
-FieldDef::Type Mapper::Field::map_value_type() const {
-    const vector<Field> &map_fields = mapper->fields;
+namespace gpd {
+    // growable buffer writing directly to the string buffer of an SV,
+    // either a new mortal SV returned to the caller without copying the
+    // data, or a caller-provided SV the data is written into; it can be
+    // used as a StringSink target, and implements the subset of the
+    // std::string interface used by WireWriter
+    class SVOutputBuffer {
+    public:
+        SVOutputBuffer(pTHX_ size_t size_hint) : used(0), base(0), own_sv(true) {
+            SET_THX_MEMBER;
+            // some slack so a message slightly larger than the previous
+            // one does not double the buffer
+            size_t size = size_hint + size_hint / 8;
+
+            sv = sv_2mortal(newSV(size < MIN_OUTPUT_SIZE ? MIN_OUTPUT_SIZE : size));
+            SvPOK_on(sv);
+            buffer = SvPVX(sv);
+        }
 
-    return map_fields[1].is_value ?
-        map_fields[1].field_def->type() :
-        map_fields[0].field_def->type();
-}
+        // target must be a non-UTF-8 string, and offset not past its end
+        SVOutputBuffer(pTHX_ SV *target, STRLEN offset) :
+                sv(target), used(offset), base(offset), own_sv(false) {
+            SET_THX_MEMBER;
+            buffer = SvPVX(sv);
+        }
 
-const STD_TR1::unordered_set<int32_t> &Mapper::Field::map_enum_values() const {
-    const vector<Field> &map_fields = mapper->fields;
+        // discards anything written after the initial offset
+        void clear() { used = base; }
+        size_t size() const { return used; }
+        char &operator[](size_t pos) { return buffer[pos]; }
 
-    return map_fields[1].is_value ?
-        map_fields[1].enum_values :
-        map_fields[0].enum_values;
-}
+        void push_back(char c) {
+            reserve(1);
+            buffer[used++] = c;
+        }
 
-bool Mapper::DecoderHandlers::apply_defaults_and_check() {
-    const vector<bool> &seen = seen_fields.back();
-    const Mapper *mapper = mappers.back();
-    const vector<Mapper::Field> &fields = mapper->fields;
-    bool decode_explict_defaults = mapper->decode_explicit_defaults;
-    bool check_required_fields = mapper->check_required_fields;
+        void append(const char *data, size_t len) {
+            reserve(len);
+            memcpy(buffer + used, data, len);
+            used += len;
+        }
 
-    for (int i = 0, n = fields.size(); i < n; ++i) {
-        const Mapper::Field &field = fields[i];
-        bool field_seen = seen[i];
+        void insert(size_t pos, const char *data, size_t len) {
+            replace(pos, 0, data, len);
+        }
 
-        if (!field_seen && decode_explict_defaults && field.has_default) {
-            SV *target = get_target(&i);
+        // len must not be greater than data_len
+        void replace(size_t pos, size_t len, const char *data, size_t data_len) {
+            reserve(data_len - len);
+            memmove(buffer + pos + data_len, buffer + pos + len, used - pos - len);
+            memcpy(buffer + pos, data, data_len);
+            used += data_len - len;
+        }
 
-            // this is the case where we merged multiple message instances,
-            // so defaults have already been applied
-            if (SvOK(target))
-                continue;
+        // returns the SV holding the data (mortal, unless it was
+        // provided by the caller)
+        SV *finish() {
+            buffer[used] = 0;
+            SvCUR_set(sv, used);
+            if (own_sv) {
+                // do not keep around too much unused memory
+                if (SvLEN(sv) - used > used / 2 + MIN_OUTPUT_SIZE)
+                    SvPV_shrink_to_cur(sv);
+            } else {
+                SvPOK_only(sv);
+                SvSETMAGIC(sv);
+            }
 
-            switch (field.field_def->type()) {
-            case UPB_TYPE_FLOAT:
-                sv_setnv(target, field.field_def->default_float());
-                break;
-            case UPB_TYPE_DOUBLE:
-                sv_setnv(target, field.field_def->default_double());
-                break;
-            case UPB_TYPE_BOOL:
-                set_bool(aTHX_ target, field.field_def->default_bool());
-                break;
-            case UPB_TYPE_BYTES:
-            case UPB_TYPE_STRING: {
-                size_t len;
-                const char *val = field.field_def->default_string(&len);
-                if (!val) {
-                    val = "";
-                    len = 0;
-                }
+            return sv;
+        }
 
-                sv_setpvn(target, val, len);
-                if (field.field_def->type() == UPB_TYPE_STRING)
-                    SvUTF8_on(target);
-            }
-                break;
-            case UPB_TYPE_ENUM:
-            case UPB_TYPE_INT32:
-                sv_setiv(target, field.field_def->default_int32());
-                break;
-            case UPB_TYPE_UINT32:
-                sv_setuv(target, field.field_def->default_uint32());
-                break;
-            case UPB_TYPE_INT64:
-                sv_setiv(target, field.field_def->default_int64());
-                break;
-            case UPB_TYPE_UINT64:
-                sv_setuv(target, field.field_def->default_uint64());
-                break;
-            }
-        } else if (!field_seen && check_required_fields && field.field_def->label() == UPB_LABEL_REQUIRED) {
-            error = "Missing required field " + field.full_name();
+    private:
+        void reserve(size_t len) {
+            // + 1 for the trailing NUL
+            if (used + len + 1 <= SvLEN(sv))
+                return;
+            size_t size = SvLEN(sv) * 2;
 
-            return false;
+            if (size < used + len + 1)
+                size = used + len + 1;
+            buffer = SvGROW(sv, size);
         }
-    }
 
-    return true;
+        DECL_THX_MEMBER;
+        SV *sv;
+        char *buffer;
+        size_t used, base;
+        bool own_sv;
+    };
 }
 
-bool Mapper::DecoderHandlers::on_end_message(DecoderHandlers *cxt, upb::Status *status) {
-    if (!status || status->ok()) {
-        return cxt->apply_defaults_and_check();
-    } else
-        return false;
-}
+namespace {
+    // used as a StringSink target, behaves like SVOutputBuffer but does
+    // not discard the data produced by previous top-level messages
+    class AppendingString {
+    public:
+        AppendingString(SVOutputBuffer *_target) : target(_target) { }
 
-Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_string(DecoderHandlers *cxt, const int *field_index, size_t size_hint) {
-    THX_DECLARE_AND_GET;
+        void clear() { }
+        void append(const char *buffer, size_t len) { target->append(buffer, len); }
 
-    cxt->mark_seen(field_index);
-    cxt->string = cxt->get_target(field_index);
-    // if length of the string is zero initialize it with empty string
-    if (size_hint == 0)
-        sv_setpvn(cxt->string, "", 0);
+    private:
+        SVOutputBuffer *target;
+    };
 
-    return cxt;
-}
+    // the encoder is written against this interface, with one
+    // implementation forwarding to an upb::Sink (used for JSON and by
+    // default for protobuf) and a native protobuf wire format writer
+    class UpbSinkWriter {
+    public:
+        // whether serialized sub-messages can be written as-is
+        static const bool wire_format = false;
 
-size_t Mapper::DecoderHandlers::on_string(DecoderHandlers *cxt, const int *field_index, const char *buf, size_t len) {
-    THX_DECLARE_AND_GET;
+        UpbSinkWriter() : sink(&own_sink) { }
+        UpbSinkWriter(upb::Sink *_sink) : sink(_sink) { }
 
-    if (!SvOK(cxt->string))
-        sv_setpvn(cxt->string, buf, len);
-    else
-        sv_catpvn(cxt->string, buf, len);
+        bool start_message() { return sink->StartMessage(); }
+        bool end_message(Status *status) { return sink->EndMessage(status); }
 
-    return len;
-}
+        bool put_float(const Mapper::Field &fd, float value) { return sink->PutFloat(fd.selector.primitive, value); }
+        bool put_double(const Mapper::Field &fd, double value) { return sink->PutDouble(fd.selector.primitive, value); }
+        bool put_bool(const Mapper::Field &fd, bool value) { return sink->PutBool(fd.selector.primitive, value); }
+        bool put_int32(const Mapper::Field &fd, int32_t value) { return sink->PutInt32(fd.selector.primitive, value); }
+        bool put_uint32(const Mapper::Field &fd, uint32_t value) { return sink->PutUInt32(fd.selector.primitive, value); }
+        bool put_int64(const Mapper::Field &fd, int64_t value) { return sink->PutInt64(fd.selector.primitive, value); }
+        bool put_uint64(const Mapper::Field &fd, uint64_t value) { return sink->PutUInt64(fd.selector.primitive, value); }
 
-bool Mapper::DecoderHandlers::on_end_string(DecoderHandlers *cxt, const int *field_index) {
-    const Mapper *mapper = cxt->mappers.back();
-    if (mapper->fields[*field_index].field_def->type() == UPB_TYPE_STRING)
-        SvUTF8_on(cxt->string);
-    cxt->string = NULL;
+        bool put_string(const Mapper::Field &fd, const char *str, size_t len) {
+            upb::Sink sub;
+            if (!sink->StartString(fd.selector.str_start, len, &sub))
+                return false;
+            sub.PutStringBuffer(fd.selector.str_cont, str, len, NULL);
+            return sink->EndString(fd.selector.str_end);
+        }
 
-    return true;
-}
+        bool put_message_bytes(const Mapper::Field &fd, const char *buf, size_t len) {
+            return false; // not supported
+        }
 
-Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_sequence(DecoderHandlers *cxt, const int *field_index) {
-    THX_DECLARE_AND_GET;
+        bool put_unknown_fields(const char *buf, size_t len) {
+            return true; // discarded, not supported by uPB
+        }
 
-    cxt->mark_seen(field_index);
-    SV *target = cxt->get_target(field_index);
-    AV *av = NULL;
+        bool start_sub_message(const Mapper::Field &fd, UpbSinkWriter *sub) {
+            return sink->StartSubMessage(fd.selector.msg_start, sub->sink);
+        }
 
-    if (!SvROK(target)) {
-        av = newAV();
+        bool end_sub_message(const Mapper::Field &fd) {
+            return sink->EndSubMessage(fd.selector.msg_end);
+        }
 
-        SvUPGRADE(target, SVt_RV);
-        SvROK_on(target);
-        SvRV_set(target, (SV *) av);
-    } else
-        av = (AV *) SvRV(target);
+        bool start_sequence(const Mapper::Field &fd, UpbSinkWriter *sub) {
+            return sink->StartSequence(fd.selector.seq_start, sub->sink);
+        }
 
-    cxt->items.push_back((SV *) av);
+        bool end_sequence(const Mapper::Field &fd) {
+            return sink->EndSequence(fd.selector.seq_end);
+        }
 
-    return cxt;
-}
+    private:
+        UpbSinkWriter(const UpbSinkWriter &);
+        UpbSinkWriter &operator=(const UpbSinkWriter &);
 
-bool Mapper::DecoderHandlers::on_end_sequence(DecoderHandlers *cxt, const int *field_index) {
-    cxt->items.pop_back();
+        upb::Sink own_sink, *sink;
+    };
 
-    return true;
-}
+    enum WireType {
+        WIRE_VARINT = 0,
+        WIRE_FIXED64 = 1,
+        WIRE_DELIMITED = 2,
+        WIRE_START_GROUP = 3,
+        WIRE_END_GROUP = 4,
+        WIRE_FIXED32 = 5,
+    };
 
-Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_map(DecoderHandlers *cxt, const int *field_index) {
-    THX_DECLARE_AND_GET;
+    // stands in for SVOutputBuffer to compute the encoded size without
+    // storing any data
+    class SizeCounter {
+    public:
+        SizeCounter() : used(0) { }
 
-    cxt->mark_seen(field_index);
-    const Mapper *mapper = cxt->mappers.back();
-    SV *target = cxt->get_target(field_index);
-    HV *hv = NULL;
+        size_t size() const { return used; }
+        char &operator[](size_t pos) { return dummy; }
+        void push_back(char c) { ++used; }
+        void append(const char *data, size_t len) { used += len; }
+        void replace(size_t pos, size_t len, const char *data, size_t data_len) { used += data_len - len; }
 
-    if (!SvROK(target)) {
-        hv = newHV();
+    private:
+        size_t used;
+        char dummy;
+    };
 
-        SvUPGRADE(target, SVt_RV);
-        SvROK_on(target);
-        SvRV_set(target, (SV *) hv);
-    } else
-        hv = (HV *) SvRV(target);
+    // writes protobuf wire format directly to a string; it produces the
+    // same output as upb::pb::Encoder for the same sequence of calls
+    //
+    // the length of sub-messages and packed fields is only known after
+    // writing their contents, so a single byte is reserved for it and
+    // the contents are moved forward in the (uncommon) case the length
+    // needs a longer varint
+    template<class B>
+    class WireWriter {
+    public:
+        static const bool wire_format = true;
 
-    cxt->mappers.push_back(mapper->fields[*field_index].mapper);
-    cxt->items.push_back((SV *) hv);
-    cxt->items.push_back(sv_newmortal());
-    cxt->items.push_back(NULL);
+        WireWriter() : buffer(NULL), packed(false), delimited_start(0) { }
+        WireWriter(B *_buffer) : buffer(_buffer), packed(false), delimited_start(0) { }
 
-    return cxt;
-}
+        bool start_message() { return true; }
+        bool end_message(Status *status) { return true; }
 
-bool Mapper::DecoderHandlers::on_end_map(DecoderHandlers *cxt, const int *field_index) {
-    cxt->mappers.pop_back();
-    cxt->items.pop_back();
-    cxt->items.pop_back();
-    cxt->items.pop_back();
+        bool put_float(const Mapper::Field &fd, float value) {
+            uint32_t bits;
 
-    return true;
-}
+            memcpy(&bits, &value, sizeof(bits));
+            put_tag(fd, WIRE_FIXED32);
+            put_fixed32(bits);
+            return true;
+        }
 
-Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_sub_message(DecoderHandlers *cxt, const int *field_index) {
-    THX_DECLARE_AND_GET;
+        bool put_double(const Mapper::Field &fd, double value) {
+            uint64_t bits;
 
-    cxt->mark_seen(field_index);
-    const Mapper *mapper = cxt->mappers.back();
-    SV *target = cxt->get_target(field_index);
-    HV *hv = NULL;
+            memcpy(&bits, &value, sizeof(bits));
+            put_tag(fd, WIRE_FIXED64);
+            put_fixed64(bits);
+            return true;
+        }
 
-    if (!SvROK(target)) {
-        hv = newHV();
+        bool put_bool(const Mapper::Field &fd, bool value) {
+            put_tag(fd, WIRE_VARINT);
+            buffer->push_back(value ? 1 : 0);
+            return true;
+        }
 
-        SvUPGRADE(target, SVt_RV);
-        SvROK_on(target);
-        SvRV_set(target, (SV *) hv);
-    } else
-        hv = (HV *) SvRV(target);
+        // 32-bit signed values are sign-extended, as for upb
+        bool put_int32(const Mapper::Field &fd, int32_t value) { return put_integer(fd, (int64_t) value); }
+        bool put_uint32(const Mapper::Field &fd, uint32_t value) { return put_integer(fd, value); }
+        bool put_int64(const Mapper::Field &fd, int64_t value) { return put_integer(fd, value); }
+        bool put_uint64(const Mapper::Field &fd, uint64_t value) { return put_integer(fd, value); }
 
-    cxt->items.push_back((SV *) hv);
-    cxt->mappers.push_back(mapper->fields[*field_index].mapper);
-    cxt->seen_fields.resize(cxt->seen_fields.size() + 1);
-    cxt->seen_fields.back().resize(cxt->mappers.back()->fields.size());
-    if (int oneof_count = cxt->mappers.back()->message_def->oneof_count()) {
-        cxt->seen_oneof.resize(cxt->seen_oneof.size() + 1);
-        cxt->seen_oneof.back().resize(oneof_count, -1);
-    }
-    if (mapper->get_decode_blessed())
-        sv_bless(target, cxt->mappers.back()->stash);
+        bool put_string(const Mapper::Field &fd, const char *str, size_t len) {
+            put_tag(fd, WIRE_DELIMITED);
+            put_varint(len);
+            buffer->append(str, len);
+            return true;
+        }
 
-    return cxt;
-}
+        // a serialized sub-message, used for lazy fields
+        bool put_message_bytes(const Mapper::Field &fd, const char *buf, size_t len) {
+            return put_string(fd, buf, len);
+        }
 
-bool Mapper::DecoderHandlers::on_end_sub_message(DecoderHandlers *cxt, const int *field_index) {
-    if (cxt->mappers.back()->message_def->oneof_count())
-        cxt->seen_oneof.pop_back();
-    cxt->seen_fields.pop_back();
-    cxt->mappers.pop_back();
-    cxt->items.pop_back();
+        // already serialized, including tags
+        bool put_unknown_fields(const char *buf, size_t len) {
+            buffer->append(buf, len);
+            return true;
+        }
 
-    return true;
-}
+        bool start_sub_message(const Mapper::Field &fd, WireWriter *sub) {
+            sub->buffer = buffer;
+            sub->packed = false;
+            if (fd.descriptor_type == UPB_DESCRIPTOR_TYPE_GROUP)
+                put_tag(fd, WIRE_START_GROUP);
+            else
+                start_delimited(fd);
+            return true;
+        }
 
-bool Mapper::DecoderHandlers::on_end_map_entry(DecoderHandlers *cxt, const int *field_index) {
-    THX_DECLARE_AND_GET;
+        bool end_sub_message(const Mapper::Field &fd) {
+            if (fd.descriptor_type == UPB_DESCRIPTOR_TYPE_GROUP)
+                put_tag(fd, WIRE_END_GROUP);
+            else
+                end_delimited();
+            return true;
+        }
 
-    size_t size = cxt->items.size();
-    HV *hash = (HV *) cxt->items[size - 3];
-    SV *key = (SV *) cxt->items[size - 2];
-    SV *value = (SV *) cxt->items[size - 1];
+        bool start_sequence(const Mapper::Field &fd, WireWriter *sub) {
+            sub->buffer = buffer;
+            sub->packed = fd.packed;
+            if (fd.packed)
+                start_delimited(fd);
+            return true;
+        }
 
-    if (SvOK(key) && value) {
-        SvREFCNT_inc(value);
-        hv_store_ent(hash, key, value, 0);
+        bool end_sequence(const Mapper::Field &fd) {
+            if (fd.packed)
+                end_delimited();
+            return true;
+        }
 
-        if (SvPOK(key))
-            SvLEN_set(key, 0);
-    } else {
-        // having decoding of broken maps succeed is debatable
-        warn("Incomplete map entry: missing %s",
-             (!SvOK(key) && !value) ? "both key and value" :
-             !SvOK(key)             ? "key" :
-                                      "value");
-    }
+    private:
+        bool put_integer(const Mapper::Field &fd, uint64_t value) {
+            switch (fd.descriptor_type) {
+            case UPB_DESCRIPTOR_TYPE_SINT32: {
+                int32_t svalue = value;
 
-    SvOK_off(key);
-    cxt->items[size - 1] = NULL;
+                put_tag(fd, WIRE_VARINT);
+                put_varint(((uint32_t) svalue << 1) ^ (uint32_t) (svalue >> 31));
+                break;
+            }
+            case UPB_DESCRIPTOR_TYPE_SINT64: {
+                int64_t svalue = value;
 
-    return true;
-}
+                put_tag(fd, WIRE_VARINT);
+                put_varint((value << 1) ^ (uint64_t) (svalue >> 63));
+                break;
+            }
+            case UPB_DESCRIPTOR_TYPE_FIXED32:
+            case UPB_DESCRIPTOR_TYPE_SFIXED32:
+                put_tag(fd, WIRE_FIXED32);
+                put_fixed32(value);
+                break;
+            case UPB_DESCRIPTOR_TYPE_FIXED64:
+            case UPB_DESCRIPTOR_TYPE_SFIXED64:
+                put_tag(fd, WIRE_FIXED64);
+                put_fixed64(value);
+                break;
+            default:
+                put_tag(fd, WIRE_VARINT);
+                put_varint(value);
+                break;
+            }
 
-template<class T>
-bool Mapper::DecoderHandlers::on_nv(DecoderHandlers *cxt, const int *field_index, T val) {
-    THX_DECLARE_AND_GET;
+            return true;
+        }
 
-    cxt->mark_seen(field_index);
-    sv_setnv(cxt->get_target(field_index), val);
+        // elements of packed fields share a single tag
+        void put_tag(const Mapper::Field &fd, WireType wire_type) {
+            if (!packed)
+                put_varint((fd.field_number << 3) | wire_type);
+        }
 
-    return true;
+        void put_varint(uint64_t value) {
+            if (value < 0x80) {
+                buffer->push_back(value);
+            } else {
+                char bytes[10];
+
+                buffer->append(bytes, write_varint(bytes, value));
+            }
+        }
+
+        void put_fixed32(uint32_t value) {
+            char bytes[4];
+
+            for (int i = 0; i < 4; ++i, value >>= 8)
+                bytes[i] = value & 0xff;
+            buffer->append(bytes, 4);
+        }
+
+        void put_fixed64(uint64_t value) {
+            char bytes[8];
+
+            for (int i = 0; i < 8; ++i, value >>= 8)
+                bytes[i] = value & 0xff;
+            buffer->append(bytes, 8);
+        }
+
+        void start_delimited(const Mapper::Field &fd) {
+            put_tag(fd, WIRE_DELIMITED);
+            delimited_start = buffer->size();
+            buffer->push_back(0);
+        }
+
+        void end_delimited() {
+            size_t length = buffer->size() - delimited_start - 1;
+
+            if (length < 0x80) {
+                (*buffer)[delimited_start] = length;
+            } else {
+                char bytes[10];
+
+                buffer->replace(delimited_start, 1, bytes, write_varint(bytes, length));
+            }
+        }
+
+        B *buffer;
+        bool packed;
+        size_t delimited_start;
+    };
 }
 
-template<class T>
-bool Mapper::DecoderHandlers::on_iv(DecoderHandlers *cxt, const int *field_index, T val) {
-    THX_DECLARE_AND_GET;
+Mapper::DecoderHandlers::DecoderHandlers(pTHX_ const Mapper *mapper) :
+        input(NULL),
+        shared_input(NULL),
+        input_buffer(NULL),
+        input_size(0),
+        private_input(false),
+        next_lazy_value(0),
+        next_unknown_fields(0),
+        merging(false),
+        max_size_hint(0),
+        seen_base(0),
+        seen_top(0) {
+    SET_THX_MEMBER;
+    mappers.push_back(mapper);
+}
 
-    cxt->mark_seen(field_index);
-    sv_setiv(cxt->get_target(field_index), val);
+void Mapper::DecoderHandlers::set_input(SV *sv, bool is_private) {
+    // the shared copy is kept across multiple messages decoded from the
+    // same buffer
+    if (sv != input) {
+        SvREFCNT_dec(shared_input);
+        shared_input = NULL;
+    }
 
-    return true;
+    if (sv && SvPOK(sv)) {
+        input = sv;
+        input_buffer = SvPVX(sv);
+        input_size = SvCUR(sv);
+        private_input = is_private;
+    } else {
+        input = NULL;
+        input_buffer = NULL;
+        input_size = 0;
+    }
 }
 
-template<class T>
-bool Mapper::DecoderHandlers::on_uv(DecoderHandlers *cxt, const int *field_index, T val) {
-    THX_DECLARE_AND_GET;
+SV *Mapper::DecoderHandlers::get_shared_input() {
+    if (!shared_input) {
+        // with copy-on-write this shares the string buffer with the input,
+        // without copying it
+        shared_input = private_input ? SvREFCNT_inc(input) : newSVsv(input);
+        if (SvCUR(shared_input) != input_size) {
+            SvREFCNT_dec(shared_input);
+            shared_input = NULL;
+            input = NULL;
+        }
+    }
 
-    cxt->mark_seen(field_index);
-    sv_setuv(cxt->get_target(field_index), val);
+    return shared_input;
+}
 
-    return true;
+void Mapper::DecoderHandlers::prepare(HV *target, size_t bufsize) {
+    mappers.resize(1);
+    seen_base = seen_top = 0;
+    push_seen(mappers.back());
+    items.resize(1);
+    error.clear();
+    lazy_values.clear();
+    next_lazy_value = 0;
+    unknown_fields.clear();
+    next_unknown_fields = 0;
+    merging = false;
+    // left over by a decode_into() that croaked
+    if (!spare_hashes.empty())
+        release_spare_hashes();
+    items[0] = (SV *) target;
+    presize_hash(aTHX_ target, mappers.back()->fields.size());
+    string = NULL;
+    max_size_hint = bufsize < (size_t) MAX_SIZE_HINT ? bufsize : MAX_SIZE_HINT;
 }
 
-bool Mapper::DecoderHandlers::on_enum(DecoderHandlers *cxt, const int *field_index, int32_t val) {
-    THX_DECLARE_AND_GET;
+IV Mapper::DecoderHandlers::size_hint(const Field &field) const {
+    if (!max_size_hint)
+        return 0;
+    STD_TR1::unordered_map<const Field *, IV>::const_iterator it = size_hints.find(&field);
 
-    const Field &field = cxt->mappers.back()->fields[*field_index];
-    if (field.enum_values.find(val) == field.enum_values.end()) {
-        // this will use the default value later, it's intentional
-        // mark_seen is not called
-        if (SvTYPE(cxt->items.back()) == SVt_PVAV)
-            sv_setiv(cxt->get_target(field_index), field.field_def->default_int32());
-        return true;
-    }
+    if (it == size_hints.end())
+        return 0;
 
-    cxt->mark_seen(field_index);
-    sv_setiv(cxt->get_target(field_index), val);
+    return it->second < max_size_hint ? it->second : max_size_hint;
+}
 
-    return true;
+void Mapper::DecoderHandlers::set_size_hint(const Field &field, IV size) {
+    size_hints[&field] = size < MAX_SIZE_HINT ? size : MAX_SIZE_HINT;
 }
 
-namespace {
-    bool set_bigint(pTHX_ SV *target, uint64_t value, bool negative) {
-        dSP;
+SV *Mapper::DecoderHandlers::get_target() {
+    return items[0];
+}
 
-        // this code is horribly slow; it could be made slightly faster,
-        // but I doubt there is any point
-        char buffer[19] = "-0x"; // -0x8000000000000000
-        for (int i = 15; i >= 0; --i, value >>= 4) {
-            int digit = value & 0xf;
+void Mapper::DecoderHandlers::clear() {
+    SvREFCNT_dec(items[0]);
+}
 
-            buffer[3 + i] = digit < 10 ? '0' + digit : 'a' + digit - 10;
-        }
+namespace {
+#ifdef USE_ITHREADS
+    int dup_shared_bytes(pTHX_ MAGIC *mg, CLONE_PARAMS *params);
+#endif
 
-        PUSHMARK(SP);
-        XPUSHs(sv_2mortal(newSVpvs("Math::BigInt")));
-        XPUSHs(sv_2mortal(newSVpvn(negative ? buffer : buffer + 1, negative ? 19 : 18)));
-        PUTBACK;
+    // identifies bytes values whose buffer points inside a decoded input
+    MGVTBL shared_bytes_vtbl = {
+        NULL, // get
+        NULL, // set
+        NULL, // len
+        NULL, // clear
+        NULL, // free
+        NULL, // copy
+#ifdef USE_ITHREADS
+        dup_shared_bytes,
+#else
+        NULL, // dup
+#endif
+        NULL, // local
+    };
 
-        int count = call_method("new", G_SCALAR);
+    bool is_shared_bytes(pTHX_ SV *sv) {
+        if (!SvREADONLY(sv) || !SvMAGICAL(sv))
+            return false;
+        MAGIC *mg = mg_find(sv, PERL_MAGIC_ext);
 
-        SPAGAIN;
-        SV *res = POPs;
-        PUTBACK;
+        return mg && mg->mg_virtual == &shared_bytes_vtbl;
+    }
 
-        sv_setsv(target, res);
+    void set_shared_bytes(pTHX_ SV *sv, SV *owner, const char *buf, STRLEN len) {
+        SvPV_free(sv);
+        SvUPGRADE(sv, SVt_PVMG);
+        // the magic keeps the input buffer alive, and points back to the
+        // value so the buffer can be rebased when the value is cloned
+        MAGIC *mg = sv_magicext(sv, owner, PERL_MAGIC_ext, &shared_bytes_vtbl, (const char *) sv, 0);
+#ifdef USE_ITHREADS
+        mg->mg_flags |= MGf_DUP;
+#else
+        PERL_UNUSED_VAR(mg);
+#endif
+        SvPV_set(sv, (char *) buf);
+        SvCUR_set(sv, len);
+        SvLEN_set(sv, 0);
+        SvPOK_only(sv);
+        SvREADONLY_on(sv);
+    }
 
-        return true;
+    // turns a zero-copy bytes value into a plain (writable) scalar,
+    // optionally copying its current value
+    void unshare_bytes(pTHX_ SV *sv, bool keep_value) {
+        if (!is_shared_bytes(aTHX_ sv))
+            return;
+        const char *buf = SvPVX(sv);
+        STRLEN len = SvCUR(sv);
+
+        SvREADONLY_off(sv);
+        SvPV_set(sv, NULL);
+        SvCUR_set(sv, 0);
+        SvPOK_off(sv);
+        if (keep_value)
+            sv_setpvn(sv, buf, len);
+        sv_unmagic(sv, PERL_MAGIC_ext);
     }
-}
 
-bool Mapper::DecoderHandlers::on_bigiv(DecoderHandlers *cxt, const int *field_index, int64_t val) {
-    THX_DECLARE_AND_GET;
-    cxt->mark_seen(field_index);
+#ifdef USE_ITHREADS
+    // the cloned value still points inside the original input buffer, make
+    // it point at the same offset in the cloned buffer
+    int dup_shared_bytes(pTHX_ MAGIC *mg, CLONE_PARAMS *params) {
+        SV *original = (SV *) mg->mg_ptr;
+        SV *sv = (SV *) ptr_table_fetch(PL_ptr_table, original);
+        MAGIC *original_mg = mg_find(original, PERL_MAGIC_ext);
 
-    if (val >= I32_MIN && val <= I32_MAX) {
-        sv_setiv(cxt->get_target(field_index), (IV) val);
+        SvPV_set(sv, SvPVX(mg->mg_obj) + (SvPVX(original) - SvPVX(original_mg->mg_obj)));
+        mg->mg_ptr = (char *) sv;
 
-        return true;
-    } else {
-        THX_DECLARE_AND_GET;
+        return 0;
+    }
+#endif
+
+    int free_lazy_message(pTHX_ SV *sv, MAGIC *mg) {
+        ((const Mapper *) mg->mg_ptr)->unref();
 
-        return set_bigint(aTHX_ cxt->get_target(field_index), (uint64_t) val, val < 0);
+        return 0;
     }
-}
 
-bool Mapper::DecoderHandlers::on_biguv(DecoderHandlers *cxt, const int *field_index, uint64_t val) {
-    THX_DECLARE_AND_GET;
-    cxt->mark_seen(field_index);
+#ifdef USE_ITHREADS
+    int dup_lazy_message(pTHX_ MAGIC *mg, CLONE_PARAMS *params) {
+        mg->mg_ptr = (char *) Mapper::clone(aTHX_ (const Mapper *) mg->mg_ptr, params);
 
-    if (val <= U32_MAX) {
-        sv_setiv(cxt->get_target(field_index), (IV) val);
+        return 0;
+    }
+#endif
 
-        return true;
-    } else {
-        THX_DECLARE_AND_GET;
+    // identifies sub-message values still in serialized form, the
+    // magic points to the mapper used to decode them
+    MGVTBL lazy_message_vtbl = {
+        NULL, // get
+        NULL, // set
+        NULL, // len
+        NULL, // clear
+        free_lazy_message,
+        NULL, // copy
+#ifdef USE_ITHREADS
+        dup_lazy_message,
+#else
+        NULL, // dup
+#endif
+        NULL, // local
+    };
 
-        return set_bigint(aTHX_ cxt->get_target(field_index), val, false);
+    MAGIC *find_lazy_message(pTHX_ SV *sv) {
+        if (!SvMAGICAL(sv) || SvROK(sv))
+            return NULL;
+        MAGIC *mg = mg_find(sv, PERL_MAGIC_ext);
+
+        return mg && mg->mg_virtual == &lazy_message_vtbl ? mg : NULL;
     }
-}
 
-bool Mapper::DecoderHandlers::on_bool(DecoderHandlers *cxt, const int *field_index, bool val) {
-    THX_DECLARE_AND_GET;
+    bool is_lazy_message(pTHX_ SV *sv) {
+        return find_lazy_message(aTHX_ sv) != NULL;
+    }
 
-    cxt->mark_seen(field_index);
-    set_bool(aTHX_ cxt->get_target(field_index), val);
+    void set_lazy_message(pTHX_ SV *sv, const Mapper *mapper, const char *buf, STRLEN len) {
+        if (is_lazy_message(aTHX_ sv))
+            sv_unmagic(sv, PERL_MAGIC_ext);
+        sv_setpvn(sv, buf, len);
+        mapper->ref();
+        MAGIC *mg = sv_magicext(sv, NULL, PERL_MAGIC_ext, &lazy_message_vtbl, (const char *) mapper, 0);
+#ifdef USE_ITHREADS
+        mg->mg_flags |= MGf_DUP;
+#else
+        PERL_UNUSED_VAR(mg);
+#endif
+    }
 
-    return true;
-}
+    // the unknown fields of a decoded message are kept serialized, in an
+    // SV attached to the message hash
+    MGVTBL unknown_fields_vtbl;
 
-SV *Mapper::DecoderHandlers::get_target(const int *field_index) {
-    const Mapper *mapper = mappers.back();
-    const Field &field = mapper->fields[*field_index];
-    SV *curr = items.back();
+    SV *find_unknown_fields(pTHX_ HV *hv) {
+        for (MAGIC *mg = SvMAGIC((SV *) hv); mg; mg = mg->mg_moremagic) {
+            if (mg->mg_type == PERL_MAGIC_ext && mg->mg_virtual == &unknown_fields_vtbl)
+                return mg->mg_obj;
+        }
 
-    if (field.is_key) {
-        return items[items.size() - 2];
-    } else if (field.is_value) {
-        SV *sv = sv_newmortal();
+        return NULL;
+    }
 
-        items[items.size() - 1] = sv;
+    void add_unknown_fields(pTHX_ HV *hv, const char *buf, STRLEN len) {
+        SV *unknown = find_unknown_fields(aTHX_ hv);
 
-        return sv;
-    } else if (SvTYPE(curr) == SVt_PVAV) {
-        AV *av = (AV *) curr;
+        if (unknown) {
+            sv_catpvn(unknown, buf, len);
+        } else {
+            unknown = newSVpvn(buf, len);
+            sv_magicext((SV *) hv, unknown, PERL_MAGIC_ext, &unknown_fields_vtbl, NULL, 0);
+            SvREFCNT_dec(unknown);
+        }
+    }
 
-        return *av_fetch(av, av_top_index(av) + 1, 1);
-    } else {
-        HV *hv = (HV *) curr;
+    // replaces a lazy value with the decoded message, in place
+    void decode_lazy_message(pTHX_ SV *sv) {
+        MAGIC *mg = find_lazy_message(aTHX_ sv);
+        if (!mg)
+            return;
+        Mapper *mapper = (Mapper *) mg->mg_ptr;
+        STRLEN len;
+        const char *buf = SvPV(sv, len);
+        SV *decoded = mapper->decode(buf, len);
+
+        if (!decoded)
+            croak("Deserialization failed: %s", mapper->last_error_message());
+        sv_unmagic(sv, PERL_MAGIC_ext);
+        sv_setsv(sv, decoded);
+        SvREFCNT_dec(decoded);
+    }
 
-        if (field.oneof_index != -1) {
-            int32_t seen = seen_oneof.back()[field.oneof_index];
+#if PERL_VERSION < 18
+    inline SSize_t GPD_av_top_index(pTHX_ AV *av) {
+        return AvFILL(av);
+    }
+    #define av_top_index(av) GPD_av_top_index(aTHX_ (av))
 
-            if (seen != -1 && seen != *field_index) {
-                const Field &field = mapper->fields[seen];
+    #define READ_XDIGIT(s)  ((0xf & (isDIGIT(*(s))     \
+                                    ? (*(s)++)         \
+                                    : (*(s)++ + 9))))
+#endif
 
-                hv_delete_ent(hv, field.name, G_DISCARD, field.name_hash);
-            }
-            seen_oneof.back()[field.oneof_index] = *field_index;
-        }
+#if PERL_VERSION < 14
+    inline void GPD_warn_sv(pTHX_ SV *mess) {
+        warn("%" SVf, mess);
+    }
+    #define warn_sv(sv) GPD_warn_sv(aTHX_ (sv))
+#endif
 
-        return HeVAL(hv_fetch_ent(hv, field.name, 1, field.name_hash));
+    inline void set_bool(pTHX_ SV *target, bool value) {
+        if (value)
+            sv_setiv(target, 1);
+        else
+            sv_setpvn(target, "", 0);
     }
 }
 
-void Mapper::DecoderHandlers::mark_seen(const int *field_index) {
-    seen_fields.back()[*field_index] = true;
+void Mapper::DecoderHandlers::take_unknown_fields(const Mapper *mapper, HV *target) {
+    // the queue is only filled when decoding protobuf data
+    if (!mapper->preserve_unknown_fields || next_unknown_fields == unknown_fields.size())
+        return;
+    const UnknownFields &unknown = unknown_fields[next_unknown_fields++];
+
+    if (!unknown.empty())
+        add_unknown_fields(aTHX_ target, unknown.data(), unknown.size());
 }
 
-Mapper::Mapper(pTHX_ Dynamic *_registry, const MessageDef *_message_def, HV *_stash, const MappingOptions &options) :
-        registry(_registry),
-        message_def(_message_def),
-        stash(_stash),
-        decoder_callbacks(aTHX_ this),
-        string_sink(&output_buffer) {
-    SET_THX_MEMBER;
+HV *Mapper::DecoderHandlers::new_message_hash(const Mapper *mapper) {
+    if (!spare_hashes.empty()) {
+        STD_TR1::unordered_map<const Mapper *, vector<HV *> >::iterator it = spare_hashes.find(mapper);
 
-    SvREFCNT_inc(stash);
+        if (it != spare_hashes.end() && !it->second.empty()) {
+            HV *hv = it->second.back();
 
-    registry->ref();
-    pb_encoder_handlers = Encoder::NewHandlers(message_def);
-    json_encoder_handlers = Printer::NewHandlers(message_def, false /* XXX option */);
-    decoder_handlers = Handlers::New(message_def);
-    decode_explicit_defaults = options.explicit_defaults;
-    encode_defaults = message_def->syntax() == UPB_SYNTAX_PROTO2 &&
-        options.encode_defaults;
-    check_enum_values = options.check_enum_values;
-    decode_blessed = options.decode_blessed;
-    // on older Perls it is not fully reliable because the check is performed before
-    // the SetMAGIC() call, so it is better to disable it entirely
-    fail_ref_coercion = HAS_FULL_NOMG ? options.fail_ref_coercion : false;
-    warn_context = WarnContext::get(aTHX);
+            it->second.pop_back();
+            return hv;
+        }
+    }
 
-    if (!decoder_handlers->SetEndMessageHandler(UpbMakeHandler(DecoderHandlers::on_end_message)))
-        croak("Unable to set upb end message handler for %s", message_def->full_name());
+    HV *hv = newHV();
+    presize_hash(aTHX_ hv, mapper->fields.size());
 
-    std::vector<Field*> fields_by_field_def_index;
-    fields.reserve(message_def->field_count());
-    fields_by_field_def_index.resize(message_def->field_count());
+    return hv;
+}
 
-    bool map_entry = message_def->mapentry();
-    bool has_required = false;
-    for (MessageDef::const_field_iterator it = message_def->field_begin(), en = message_def->field_end(); it != en; ++it) {
-        int index = fields.size();
-        fields.push_back(Field());
+// prepares a message hash for decode_into(): scalar values are set to
+// undef, keeping their buffers, arrays and maps are emptied, and
+// sub-message hashes are moved to spare_hashes; the fields not set by
+// the decoder are removed afterwards by remove_stale_fields()
+void Mapper::DecoderHandlers::recycle_fields(const Mapper *mapper, HV *target) {
+    if (SV *unknown = find_unknown_fields(aTHX_ target))
+        sv_setpvn(unknown, "", 0);
 
-        Field &field = fields.back();;
-        const FieldDef *field_def = *it;
-        const OneofDef *oneof_def = field_def->containing_oneof();
+    for (vector<Field>::const_iterator it = mapper->fields.begin(), en = mapper->fields.end(); it != en; ++it) {
+        const Field &field = *it;
+        HE *he = hv_fetch_ent(target, field.name, 0, field.name_hash);
 
-        fields_by_field_def_index[field_def->index()] = &fields.back();
-        has_required = has_required || field_def->label() == UPB_LABEL_REQUIRED;
-        field.field_def = field_def;
-        if (field_def->is_extension()) {
-            string temp = string() + "[" + field_def->full_name() + "]";
+        if (!he)
+            continue;
+        SV *value = HeVAL(he);
 
-            field.name = newSVpvn_share(temp.data(), temp.size(), 0);
-        } else {
-            string temp = string(field_def->name());
+        unshare_bytes(aTHX_ value, false);
+        if (SvROK(value) && field.is_map && SvTYPE(SvRV(value)) == SVt_PVHV) {
+            hv_clear((HV *) SvRV(value));
+        } else if (SvROK(value) && field.field_def->label() == UPB_LABEL_REPEATED && SvTYPE(SvRV(value)) == SVt_PVAV) {
+            AV *av = (AV *) SvRV(value);
 
-            field.name = newSVpvn_share(temp.data(), temp.size(), 0);
-        }
-        field.name_hash = SvSHARED_HASH(field.name);
-        field.has_default = field.is_map = false;
-        field.mapper = NULL;
-        field.oneof_index = -1;
+            // in reverse, so items are reused in the same position
+            if (field.field_def->type() == UPB_TYPE_MESSAGE && !field.lazy) {
+                for (SSize_t i = av_top_index(av); i >= 0; --i) {
+                    SV **item = av_fetch(av, i, 0);
 
-        if (map_entry) {
-            field.is_key = field_def->number() == 1;
-            field.is_value = field_def->number() == 2;
+                    if (item && SvROK(*item) && SvTYPE(SvRV(*item)) == SVt_PVHV) {
+                        HV *hv = (HV *) SvREFCNT_inc(SvRV(*item));
+
+                        recycle_fields(field.mapper, hv);
+                        spare_hashes[field.mapper].push_back(hv);
+                    }
+                }
+            }
+            av_clear(av);
+        } else if (SvROK(value) && field.field_def->type() == UPB_TYPE_MESSAGE && !field.lazy &&
+                       !field.is_map && SvTYPE(SvRV(value)) == SVt_PVHV) {
+            HV *hv = (HV *) SvREFCNT_inc(SvRV(value));
+
+            recycle_fields(field.mapper, hv);
+            spare_hashes[field.mapper].push_back(hv);
+            sv_setsv(value, &PL_sv_undef);
+        } else if (SvROK(value) || SvMAGICAL(value) || SvREADONLY(value)) {
+            hv_delete_ent(target, field.name, G_DISCARD, field.name_hash);
+        } else {
+            SvOK_off(value);
         }
+    }
+}
 
-        if (field_def->label() == UPB_LABEL_REPEATED &&
-                field_def->type() == UPB_TYPE_MESSAGE &&
-                field_def->message_subdef()->mapentry()) {
-            field.is_map = true;
+// removes the fields left undefined (or empty) by recycle_fields()
+void Mapper::DecoderHandlers::remove_stale_fields(const Mapper *mapper, HV *target) {
+    for (vector<Field>::const_iterator it = mapper->fields.begin(), en = mapper->fields.end(); it != en; ++it) {
+        const Field &field = *it;
+        HE *he = hv_fetch_ent(target, field.name, 0, field.name_hash);
+
+        if (!he)
+            continue;
+        SV *value = HeVAL(he);
+
+        if (!SvOK(value)) {
+            hv_delete_ent(target, field.name, G_DISCARD, field.name_hash);
+        } else if (!SvROK(value) || (field.field_def->type() != UPB_TYPE_MESSAGE && !field.is_map)) {
+            // nothing to do
+        } else if (field.is_map) {
+            if (SvTYPE(SvRV(value)) == SVt_PVHV && !HvUSEDKEYS((HV *) SvRV(value)))
+                hv_delete_ent(target, field.name, G_DISCARD, field.name_hash);
+        } else if (field.field_def->label() == UPB_LABEL_REPEATED) {
+            AV *av = (AV *) SvRV(value);
+
+            if (SvTYPE(av) != SVt_PVAV) {
+                continue;
+            } else if (av_top_index(av) == -1) {
+                hv_delete_ent(target, field.name, G_DISCARD, field.name_hash);
+            } else if (!field.lazy) {
+                for (SSize_t i = 0, n = av_top_index(av) + 1; i < n; ++i) {
+                    SV **item = av_fetch(av, i, 0);
+
+                    if (item && SvROK(*item) && SvTYPE(SvRV(*item)) == SVt_PVHV)
+                        remove_stale_fields(field.mapper, (HV *) SvRV(*item));
+                }
+            }
+        } else if (!field.lazy && SvTYPE(SvRV(value)) == SVt_PVHV) {
+            remove_stale_fields(field.mapper, (HV *) SvRV(value));
         }
+    }
+}
 
-#define GET_SELECTOR(KIND, TO) \
-    ok = ok && pb_encoder_handlers->GetSelector(field_def, UPB_HANDLER_##KIND, &field.selector.TO)
+void Mapper::DecoderHandlers::release_spare_hashes() {
+    for (STD_TR1::unordered_map<const Mapper *, vector<HV *> >::iterator it = spare_hashes.begin(), en = spare_hashes.end(); it != en; ++it) {
+        for (vector<HV *>::iterator hv = it->second.begin(), hv_end = it->second.end(); hv != hv_end; ++hv)
+            SvREFCNT_dec(*hv);
+    }
+    spare_hashes.clear();
+}
 
-#define SET_VALUE_HANDLER(TYPE, FUNCTION) \
-    ok = ok && decoder_handlers->SetValueHandler<TYPE>(field_def, UpbBind(DecoderHandlers::FUNCTION, new int(index)))
+string Mapper::Field::full_name() const {
+    if (field_def->is_extension())
+        return field_def->full_name();
+    else
+        return string(field_def->containing_type()->full_name()) +
+               '.' +
+               field_def->name();
+}
 
-#define SET_HANDLER(KIND, FUNCTION) \
-    ok = ok && decoder_handlers->Set##KIND##Handler(field_def, UpbBind(DecoderHandlers::FUNCTION, new int(index)))
+FieldDef::Type Mapper::Field::map_value_type() const {
+    const vector<Field> &map_fields = mapper->fields;
 
-        bool ok = true;
-        bool has_default = true;
-        switch (field_def->type()) {
-        case UPB_TYPE_FLOAT:
-            GET_SELECTOR(FLOAT, primitive);
-            SET_VALUE_HANDLER(float, on_nv<float>);
-            field.default_nv = field_def->default_float();
-            break;
-        case UPB_TYPE_DOUBLE:
-            GET_SELECTOR(DOUBLE, primitive);
-            SET_VALUE_HANDLER(double, on_nv<double>);
-            field.default_nv = field_def->default_double();
-            break;
-        case UPB_TYPE_BOOL:
-            GET_SELECTOR(BOOL, primitive);
-            SET_VALUE_HANDLER(bool, on_bool);
-            field.default_bool = field_def->default_bool();
-            break;
-        case UPB_TYPE_STRING:
-        case UPB_TYPE_BYTES:
-            GET_SELECTOR(STARTSTR, str_start);
-            GET_SELECTOR(STRING, str_cont);
-            GET_SELECTOR(ENDSTR, str_end);
-            SET_HANDLER(StartString, on_start_string);
-            SET_HANDLER(String, on_string);
-            SET_HANDLER(EndString, on_end_string);
-            field.default_str = field_def->default_string(&field.default_str_len);
-            break;
-        case UPB_TYPE_MESSAGE:
-            GET_SELECTOR(STARTSUBMSG, msg_start);
-            GET_SELECTOR(ENDSUBMSG, msg_end);
-            if (field.is_map) {
-                SET_HANDLER(EndSubMessage, on_end_map_entry);
-            } else {
-                SET_HANDLER(StartSubMessage, on_start_sub_message);
-                SET_HANDLER(EndSubMessage, on_end_sub_message);
-            }
-            has_default = false;
-            break;
-        case UPB_TYPE_ENUM: {
-            GET_SELECTOR(INT32, primitive);
-            if (check_enum_values)
-                SET_VALUE_HANDLER(int32_t, on_enum);
-            else
-                SET_VALUE_HANDLER(int32_t, on_iv<int32_t>);
-            field.default_iv = field_def->default_int32();
+    return map_fields[1].is_value ?
+        map_fields[1].field_def->type() :
+        map_fields[0].field_def->type();
+}
 
-            if (check_enum_values) {
-                const EnumDef *enumdef = field_def->enum_subdef();
-                upb_enum_iter i;
-                for (upb_enum_begin(&i, enumdef); !upb_enum_done(&i); upb_enum_next(&i))
-                    field.enum_values.insert(upb_enum_iter_number(&i));
+const STD_TR1::unordered_set<int32_t> &Mapper::Field::map_enum_values() const {
+    const vector<Field> &map_fields = mapper->fields;
+
+    return map_fields[1].is_value ?
+        map_fields[1].enum_values :
+        map_fields[0].enum_values;
+}
+
+template<int kind>
+SV *Mapper::DecoderHandlers::get_target(const int *field_index) {
+    switch (kind) {
+    case MapKeyTarget:
+        return items[items.size() - 2];
+    case MapValueTarget: {
+        SV *sv = sv_newmortal();
+
+        items[items.size() - 1] = sv;
+
+        return sv;
+    }
+    case RepeatedTarget: {
+        AV *av = (AV *) items.back();
+
+        return *av_fetch(av, av_top_index(av) + 1, 1);
+    }
+    default: {
+        const Mapper *mapper = mappers.back();
+        const Field &field = mapper->fields[*field_index];
+        HV *hv = (HV *) items.back();
+
+        if (kind == OneofTarget) {
+            uint64_t &seen = seen_fields[seen_base + mapper->seen_field_words + field.oneof_index];
+
+            if (seen && seen != (uint64_t) *field_index + 1) {
+                const Field &field = mapper->fields[seen - 1];
+
+                hv_delete_ent(hv, field.name, G_DISCARD, field.name_hash);
+            } else if (!seen && merging) {
+                // the member might have been set by the merged message
+                for (vector<Field>::const_iterator it = mapper->fields.begin(), en = mapper->fields.end(); it != en; ++it) {
+                    if (it->oneof_index == field.oneof_index && &*it != &field)
+                        hv_delete_ent(hv, it->name, G_DISCARD, it->name_hash);
+                }
             }
-        }
-            break;
-        case UPB_TYPE_INT32:
-            GET_SELECTOR(INT32, primitive);
-            SET_VALUE_HANDLER(int32_t, on_iv<int32_t>);
-            field.default_iv = field_def->default_int32();
-            break;
-        case UPB_TYPE_UINT32:
-            GET_SELECTOR(UINT32, primitive);
-            SET_VALUE_HANDLER(uint32_t, on_uv<uint32_t>);
-            field.default_uv = field_def->default_uint32();
-            break;
-        case UPB_TYPE_INT64:
-            GET_SELECTOR(INT64, primitive);
-            if (options.use_bigints)
-                SET_VALUE_HANDLER(int64_t, on_bigiv);
-            else
-                SET_VALUE_HANDLER(int64_t, on_iv<int64_t>);
-            field.default_i64 = field_def->default_int64();
-            break;
-        case UPB_TYPE_UINT64:
-            GET_SELECTOR(UINT64, primitive);
-            if (options.use_bigints)
-                SET_VALUE_HANDLER(uint64_t, on_biguv);
-            else
-                SET_VALUE_HANDLER(uint64_t, on_uv<uint64_t>);
-            field.default_u64 = field_def->default_uint64();
-            break;
-        default:
-            croak("Unhandled field type %d for field '%s'", field_def->type(), field.full_name().c_str());
+            seen = *field_index + 1;
         }
 
-        if (has_default &&
-                field_def->label() == UPB_LABEL_OPTIONAL &&
-                !oneof_def) {
-            field.has_default = true;
-        }
+        return HeVAL(hv_fetch_ent(hv, field.name, 1, field.name_hash));
+    }
+    }
+}
 
-        if (field_def->label() == UPB_LABEL_REPEATED) {
-            GET_SELECTOR(STARTSEQ, seq_start);
-            GET_SELECTOR(ENDSEQ, seq_end);
-            if (field.is_map) {
-                SET_HANDLER(StartSequence, on_start_map);
-                SET_HANDLER(EndSequence, on_end_map);
-            } else {
-                SET_HANDLER(StartSequence, on_start_sequence);
-                SET_HANDLER(EndSequence, on_end_sequence);
+bool Mapper::DecoderHandlers::apply_defaults_and_check() {
+    const Mapper *mapper = mappers.back();
+    const vector<Mapper::Field> &fields = mapper->fields;
+    bool decode_explict_defaults = mapper->decode_explicit_defaults;
+    bool check_required_fields = mapper->check_required_fields;
+    // when merging, the fields already set in the target message count as
+    // seen (items.back() is not a hash for map entries)
+    HV *merge_target = merging && SvTYPE(items.back()) == SVt_PVHV ? (HV *) items.back() : NULL;
+
+    for (int i = 0, n = fields.size(); i < n; ++i) {
+        const Mapper::Field &field = fields[i];
+        bool field_seen = is_seen(i) ||
+            (merge_target && hv_exists_ent(merge_target, field.name, field.name_hash));
+
+        if (!field_seen && decode_explict_defaults && field.has_default) {
+            SV *target = get_target(&i);
+
+            // this is the case where we merged multiple message instances,
+            // so defaults have already been applied
+            if (SvOK(target))
+                continue;
+
+            switch (field.field_def->type()) {
+            case UPB_TYPE_FLOAT:
+                sv_setnv(target, field.field_def->default_float());
+                break;
+            case UPB_TYPE_DOUBLE:
+                sv_setnv(target, field.field_def->default_double());
+                break;
+            case UPB_TYPE_BOOL:
+                set_bool(aTHX_ target, field.field_def->default_bool());
+                break;
+            case UPB_TYPE_BYTES:
+            case UPB_TYPE_STRING: {
+                size_t len;
+                const char *val = field.field_def->default_string(&len);
+                if (!val) {
+                    val = "";
+                    len = 0;
+                }
+
+                sv_setpvn(target, val, len);
+                if (field.field_def->type() == UPB_TYPE_STRING)
+                    SvUTF8_on(target);
+            }
+                break;
+            case UPB_TYPE_ENUM:
+            case UPB_TYPE_INT32:
+                sv_setiv(target, field.field_def->default_int32());
+                break;
+            case UPB_TYPE_UINT32:
+                sv_setuv(target, field.field_def->default_uint32());
+                break;
+            case UPB_TYPE_INT64:
+                sv_setiv(target, field.field_def->default_int64());
+                break;
+            case UPB_TYPE_UINT64:
+                sv_setuv(target, field.field_def->default_uint64());
+                break;
             }
+        } else if (!field_seen && check_required_fields && field.field_def->label() == UPB_LABEL_REQUIRED) {
+            error = "Missing required field " + field.full_name();
+
+            return false;
         }
+    }
 
-#undef GET_SELECTOR
-#undef SET_VALUE_HANDLER
-#undef SET_HANDLER
+    return true;
+}
 
-        if (!ok)
-            croak("Unable to get upb selector for field %s", field.full_name().c_str());
+bool Mapper::DecoderHandlers::on_end_message(DecoderHandlers *cxt, upb::Status *status) {
+    if (!status || status->ok()) {
+        return cxt->apply_defaults_and_check();
+    } else
+        return false;
+}
 
-    }
+template<bool track_seen, int kind>
+Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_string(DecoderHandlers *cxt, const int *field_index, size_t size_hint) {
+    THX_DECLARE_AND_GET;
 
-    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
-        if (it->field_def->is_extension()) {
-            extension_mapper_fields.push_back(new MapperField(aTHX_ this, &*it));
-            unref(); // to avoid ref loop
-        }
-        field_map[SvPV_nolen(it->name)] = &*it;
+    cxt->mark_seen<track_seen>(field_index);
+    cxt->string = cxt->get_target<kind>(field_index);
+    // when merging, the target holds the value of the merged message
+    if (cxt->merging) {
+        unshare_bytes(aTHX_ cxt->string, false);
+        sv_setsv(cxt->string, &PL_sv_undef);
     }
+    // if length of the string is zero initialize it with empty string
+    if (size_hint == 0)
+        sv_setpvn(cxt->string, "", 0);
 
-    int oneof_index = 0;
-    for (MessageDef::const_oneof_iterator it = message_def->oneof_begin(), en = message_def->oneof_end(); it != en; ++it, ++oneof_index) {
-        const OneofDef *oneof_def = *it;
+    return cxt;
+}
 
-        for (OneofDef::const_iterator it = oneof_def->begin(), en = oneof_def->end(); it != en; ++it) {
-            const FieldDef *field_def = *it;
-            Field *field = fields_by_field_def_index[field_def->index()];
+size_t Mapper::DecoderHandlers::on_string(DecoderHandlers *cxt, const int *field_index, const char *buf, size_t len) {
+    THX_DECLARE_AND_GET;
 
-            field->oneof_index = oneof_index;
+    if (!SvOK(cxt->string))
+        sv_setpvn(cxt->string, buf, len);
+    else
+        sv_catpvn(cxt->string, buf, len);
+
+    return len;
+}
+
+template<bool track_seen, int kind>
+Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_shared_bytes(DecoderHandlers *cxt, const int *field_index, size_t size_hint) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    cxt->string = cxt->get_target<kind>(field_index);
+    // when merging, the target holds the value of the merged message, and
+    // it is reset to undef so the new value can point inside the input
+    unshare_bytes(aTHX_ cxt->string, !cxt->merging);
+    if (cxt->merging)
+        sv_setsv(cxt->string, &PL_sv_undef);
+    // if length of the string is zero initialize it with empty string
+    if (size_hint == 0)
+        sv_setpvn(cxt->string, "", 0);
+
+    return cxt;
+}
+
+size_t Mapper::DecoderHandlers::on_shared_bytes(DecoderHandlers *cxt, const int *field_index, const char *buf, size_t len) {
+    THX_DECLARE_AND_GET;
+
+    if (!SvOK(cxt->string) && cxt->input &&
+            buf >= cxt->input_buffer &&
+            buf + len <= cxt->input_buffer + cxt->input_size) {
+        if (SV *shared = cxt->get_shared_input()) {
+            set_shared_bytes(aTHX_ cxt->string, shared, SvPVX(shared) + (buf - cxt->input_buffer), len);
+
+            return len;
+        }
+    }
+
+    // the value was split in multiple chunks
+    unshare_bytes(aTHX_ cxt->string, true);
+    if (!SvOK(cxt->string))
+        sv_setpvn(cxt->string, buf, len);
+    else
+        sv_catpvn(cxt->string, buf, len);
+
+    return len;
+}
+
+bool Mapper::DecoderHandlers::on_end_string(DecoderHandlers *cxt, const int *field_index) {
+    SvUTF8_on(cxt->string);
+    cxt->string = NULL;
+
+    return true;
+}
+
+bool Mapper::DecoderHandlers::on_end_bytes(DecoderHandlers *cxt, const int *field_index) {
+    cxt->string = NULL;
+
+    return true;
+}
+
+template<bool track_seen>
+Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_sequence(DecoderHandlers *cxt, const int *field_index) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    SV *target = cxt->get_target<PlainTarget>(field_index);
+    AV *av = NULL;
+
+    if (!SvROK(target)) {
+        IV size = cxt->size_hint(cxt->mappers.back()->fields[*field_index]);
+
+        av = newAV();
+        if (size)
+            av_extend(av, size - 1);
+
+        SvUPGRADE(target, SVt_RV);
+        SvROK_on(target);
+        SvRV_set(target, (SV *) av);
+    } else
+        av = (AV *) SvRV(target);
+
+    cxt->items.push_back((SV *) av);
+
+    return cxt;
+}
+
+bool Mapper::DecoderHandlers::on_end_sequence(DecoderHandlers *cxt, const int *field_index) {
+    THX_DECLARE_AND_GET;
+
+    cxt->set_size_hint(cxt->mappers.back()->fields[*field_index],
+                       av_top_index((AV *) cxt->items.back()) + 1);
+    cxt->items.pop_back();
+
+    return true;
+}
+
+template<bool track_seen>
+Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_map(DecoderHandlers *cxt, const int *field_index) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    const Mapper *mapper = cxt->mappers.back();
+    SV *target = cxt->get_target<PlainTarget>(field_index);
+    HV *hv = NULL;
+
+    if (!SvROK(target)) {
+        hv = newHV();
+        presize_hash(aTHX_ hv, cxt->size_hint(mapper->fields[*field_index]));
+
+        SvUPGRADE(target, SVt_RV);
+        SvROK_on(target);
+        SvRV_set(target, (SV *) hv);
+    } else
+        hv = (HV *) SvRV(target);
+
+    cxt->mappers.push_back(mapper->fields[*field_index].mapper);
+    cxt->items.push_back((SV *) hv);
+    cxt->items.push_back(sv_newmortal());
+    cxt->items.push_back(NULL);
+
+    return cxt;
+}
+
+bool Mapper::DecoderHandlers::on_end_map(DecoderHandlers *cxt, const int *field_index) {
+    cxt->set_size_hint(cxt->mappers[cxt->mappers.size() - 2]->fields[*field_index],
+                       HvTOTALKEYS((HV *) cxt->items[cxt->items.size() - 3]));
+    cxt->mappers.pop_back();
+    cxt->items.pop_back();
+    cxt->items.pop_back();
+    cxt->items.pop_back();
+
+    return true;
+}
+
+template<bool track_seen, int kind>
+Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_sub_message(DecoderHandlers *cxt, const int *field_index) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    const Mapper *mapper = cxt->mappers.back();
+    SV *target = cxt->get_target<kind>(field_index);
+    HV *hv = NULL;
+
+    if (!SvROK(target)) {
+        hv = cxt->new_message_hash(mapper->fields[*field_index].mapper);
+
+        SvUPGRADE(target, SVt_RV);
+        SvROK_on(target);
+        SvRV_set(target, (SV *) hv);
+    } else
+        hv = (HV *) SvRV(target);
+
+    cxt->items.push_back((SV *) hv);
+    cxt->mappers.push_back(mapper->fields[*field_index].mapper);
+    cxt->push_seen(cxt->mappers.back());
+    if (cxt->mappers.back()->preserve_unknown_fields)
+        cxt->take_unknown_fields(cxt->mappers.back(), hv);
+    if (mapper->get_decode_blessed())
+        sv_bless(target, cxt->mappers.back()->stash);
+
+    return cxt;
+}
+
+template<bool track_seen, int kind>
+Mapper::DecoderHandlers *Mapper::DecoderHandlers::on_start_lazy_sub_message(DecoderHandlers *cxt, const int *field_index) {
+    THX_DECLARE_AND_GET;
+
+    // values are found by scan_fields() in the same order
+    if (cxt->next_lazy_value == cxt->lazy_values.size()) {
+        cxt->error = "Internal error: lazy field value not found";
+
+        return NULL;
+    }
+    const LazyValue &value = cxt->lazy_values[cxt->next_lazy_value++];
+    cxt->mark_seen<track_seen>(field_index);
+    const Mapper *mapper = cxt->mappers.back();
+    SV *target = cxt->get_target<kind>(field_index);
+
+    set_lazy_message(aTHX_ target, mapper->fields[*field_index].mapper, value.first, value.second);
+
+    return cxt;
+}
+
+bool Mapper::DecoderHandlers::on_end_sub_message(DecoderHandlers *cxt, const int *field_index) {
+    cxt->pop_seen();
+    cxt->mappers.pop_back();
+    cxt->items.pop_back();
+
+    return true;
+}
+
+bool Mapper::DecoderHandlers::on_end_map_entry(DecoderHandlers *cxt, const int *field_index) {
+    THX_DECLARE_AND_GET;
+
+    size_t size = cxt->items.size();
+    HV *hash = (HV *) cxt->items[size - 3];
+    SV *key = (SV *) cxt->items[size - 2];
+    SV *value = (SV *) cxt->items[size - 1];
+
+    if (SvOK(key) && value) {
+        SvREFCNT_inc(value);
+        hv_store_ent(hash, key, value, 0);
+
+        if (SvPOK(key))
+            SvLEN_set(key, 0);
+    } else {
+        // having decoding of broken maps succeed is debatable
+        warn("Incomplete map entry: missing %s",
+             (!SvOK(key) && !value) ? "both key and value" :
+             !SvOK(key)             ? "key" :
+                                      "value");
+    }
+
+    SvOK_off(key);
+    cxt->items[size - 1] = NULL;
+
+    return true;
+}
+
+template<class T, bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_nv(DecoderHandlers *cxt, const int *field_index, T val) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    sv_setnv(cxt->get_target<kind>(field_index), val);
+
+    return true;
+}
+
+template<class T, bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_iv(DecoderHandlers *cxt, const int *field_index, T val) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    sv_setiv(cxt->get_target<kind>(field_index), val);
+
+    return true;
+}
+
+template<class T, bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_uv(DecoderHandlers *cxt, const int *field_index, T val) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    sv_setuv(cxt->get_target<kind>(field_index), val);
+
+    return true;
+}
+
+template<bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_enum(DecoderHandlers *cxt, const int *field_index, int32_t val) {
+    THX_DECLARE_AND_GET;
+
+    const Field &field = cxt->mappers.back()->fields[*field_index];
+    if (field.enum_values.find(val) == field.enum_values.end()) {
+        // this will use the default value later, it's intentional
+        // mark_seen is not called
+        if (kind == RepeatedTarget)
+            sv_setiv(cxt->get_target<kind>(field_index), field.field_def->default_int32());
+        return true;
+    }
+
+    cxt->mark_seen<track_seen>(field_index);
+    sv_setiv(cxt->get_target<kind>(field_index), val);
+
+    return true;
+}
+
+namespace {
+    bool set_bigint(pTHX_ SV *target, uint64_t value, bool negative) {
+        dSP;
+
+        // this code is horribly slow; it could be made slightly faster,
+        // but I doubt there is any point
+        char buffer[19] = "-0x"; // -0x8000000000000000
+        for (int i = 15; i >= 0; --i, value >>= 4) {
+            int digit = value & 0xf;
+
+            buffer[3 + i] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        }
+
+        PUSHMARK(SP);
+        XPUSHs(sv_2mortal(newSVpvs("Math::BigInt")));
+        XPUSHs(sv_2mortal(newSVpvn(negative ? buffer : buffer + 1, negative ? 19 : 18)));
+        PUTBACK;
+
+        int count = call_method("new", G_SCALAR);
+
+        SPAGAIN;
+        SV *res = POPs;
+        PUTBACK;
+
+        sv_setsv(target, res);
+
+        return true;
+    }
+}
+
+template<bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_bigiv(DecoderHandlers *cxt, const int *field_index, int64_t val) {
+    THX_DECLARE_AND_GET;
+    cxt->mark_seen<track_seen>(field_index);
+
+    if (val >= I32_MIN && val <= I32_MAX) {
+        sv_setiv(cxt->get_target<kind>(field_index), (IV) val);
+
+        return true;
+    } else {
+        THX_DECLARE_AND_GET;
+
+        return set_bigint(aTHX_ cxt->get_target<kind>(field_index), (uint64_t) val, val < 0);
+    }
+}
+
+template<bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_biguv(DecoderHandlers *cxt, const int *field_index, uint64_t val) {
+    THX_DECLARE_AND_GET;
+    cxt->mark_seen<track_seen>(field_index);
+
+    if (val <= U32_MAX) {
+        sv_setiv(cxt->get_target<kind>(field_index), (IV) val);
+
+        return true;
+    } else {
+        THX_DECLARE_AND_GET;
+
+        return set_bigint(aTHX_ cxt->get_target<kind>(field_index), val, false);
+    }
+}
+
+template<bool track_seen, int kind>
+bool Mapper::DecoderHandlers::on_bool(DecoderHandlers *cxt, const int *field_index, bool val) {
+    THX_DECLARE_AND_GET;
+
+    cxt->mark_seen<track_seen>(field_index);
+    set_bool(aTHX_ cxt->get_target<kind>(field_index), val);
+
+    return true;
+}
+
+SV *Mapper::DecoderHandlers::get_target(const int *field_index) {
+    const Field &field = mappers.back()->fields[*field_index];
+
+    if (field.is_key)
+        return get_target<MapKeyTarget>(field_index);
+    else if (field.is_value)
+        return get_target<MapValueTarget>(field_index);
+    else if (SvTYPE(items.back()) == SVt_PVAV)
+        return get_target<RepeatedTarget>(field_index);
+    else if (field.oneof_index != -1)
+        return get_target<OneofTarget>(field_index);
+    else
+        return get_target<PlainTarget>(field_index);
+}
+
+template<bool track_seen>
+void Mapper::DecoderHandlers::mark_seen(const int *field_index) {
+    if (track_seen)
+        seen_fields[seen_base + (*field_index >> 6)] |= (uint64_t) 1 << (*field_index & 63);
+}
+
+bool Mapper::DecoderHandlers::is_seen(int field_index) const {
+    return seen_fields[seen_base + (field_index >> 6)] & ((uint64_t) 1 << (field_index & 63));
+}
+
+void Mapper::DecoderHandlers::push_seen(const Mapper *mapper) {
+    size_t header = seen_top;
+    size_t words = mapper->seen_field_words + mapper->message_def->oneof_count();
+
+    if (seen_fields.size() < header + 1 + words)
+        seen_fields.resize(max(header + 1 + words, seen_fields.size() * 2));
+    seen_fields[header] = seen_base;
+    seen_base = header + 1;
+    seen_top = seen_base + words;
+    std::fill(seen_fields.begin() + seen_base, seen_fields.begin() + seen_top, 0);
+}
+
+void Mapper::DecoderHandlers::pop_seen() {
+    seen_top = seen_base - 1;
+    seen_base = seen_fields[seen_top];
+}
+
+// creates the Perl values for a message parsed by parse_message(), with
+// the target hash at the top of the stack; the values are stored as the
+// handlers above would do for the same data
+bool Mapper::DecoderHandlers::materialize(const vector<ParsedTree> &trees, int tree, size_t index) {
+    const ParsedTree &parsed = trees[tree];
+    const ParsedMessage &message = parsed.messages[index];
+    const Mapper *mapper = mappers.back();
+    // the array of a repeated field is kept on the stack while its
+    // values are consecutive
+    int sequence = -1;
+
+    for (size_t i = message.first, n = message.first + message.count; i < n; ++i) {
+        const ParsedValue &value = parsed.values[i];
+        const int *field_index = &value.field_index;
+
+        if (sequence != -1 && sequence != value.field_index) {
+            items.pop_back();
+            sequence = -1;
+        }
+        if (value.field_index == -1) {
+            add_unknown_fields(aTHX_ (HV *) items.back(), value.buf, value.len);
+            continue;
+        }
+        const Field &field = mapper->fields[value.field_index];
+        // number of consecutive values of the field, to size arrays/maps
+        bool run_start = i == message.first || parsed.values[i - 1].field_index != value.field_index;
+        size_t run = 1;
+
+        if (run_start && (field.is_map || field.field_def->label() == UPB_LABEL_REPEATED)) {
+            while (i + run < n && parsed.values[i + run].field_index == value.field_index)
+                ++run;
+        }
+
+        if (field.is_map) {
+            on_start_map<true>(this, field_index);
+            if (run_start) {
+                HV *hv = (HV *) items[items.size() - 3];
+
+                presize_hash(aTHX_ hv, HvTOTALKEYS(hv) + run);
+            }
+            push_seen(mappers.back());
+            bool ok = materialize(trees, value.tree, value.message) &&
+                (!mappers.back()->track_seen || apply_defaults_and_check());
+            pop_seen();
+            if (!ok)
+                return false;
+            on_end_map_entry(this, field_index);
+            on_end_map(this, field_index);
+            continue;
+        }
+        if (sequence == -1 && field.field_def->label() == UPB_LABEL_REPEATED) {
+            on_start_sequence<true>(this, field_index);
+            sequence = value.field_index;
+
+            AV *av = (AV *) items.back();
+            av_extend(av, av_top_index(av) + run);
+        }
+
+        switch (field.field_def->type()) {
+        case UPB_TYPE_FLOAT:
+            mark_seen<true>(field_index);
+            sv_setnv(get_target(field_index), value.fv);
+            break;
+        case UPB_TYPE_DOUBLE:
+            mark_seen<true>(field_index);
+            sv_setnv(get_target(field_index), value.nv);
+            break;
+        case UPB_TYPE_BOOL:
+            mark_seen<true>(field_index);
+            set_bool(aTHX_ get_target(field_index), value.bv);
+            break;
+        case UPB_TYPE_STRING: {
+            mark_seen<true>(field_index);
+            SV *target = get_target(field_index);
+
+            sv_setpvn(target, value.buf, value.len);
+            SvUTF8_on(target);
+        }
+            break;
+        case UPB_TYPE_BYTES: {
+            mark_seen<true>(field_index);
+            SV *target = get_target(field_index);
+
+            if (mapper->zero_copy_bytes && value.len) {
+                unshare_bytes(aTHX_ target, false);
+                SvOK_off(target);
+                string = target;
+                on_shared_bytes(this, field_index, value.buf, value.len);
+                string = NULL;
+            } else {
+                unshare_bytes(aTHX_ target, false);
+                sv_setpvn(target, value.buf, value.len);
+            }
+        }
+            break;
+        case UPB_TYPE_MESSAGE: {
+            mark_seen<true>(field_index);
+            SV *target = get_target(field_index);
+
+            if (field.lazy) {
+                set_lazy_message(aTHX_ target, field.mapper, value.buf, value.len);
+                break;
+            }
+
+            HV *hv = NULL;
+            if (!SvROK(target)) {
+                hv = new_message_hash(field.mapper);
+
+                SvUPGRADE(target, SVt_RV);
+                SvROK_on(target);
+                SvRV_set(target, (SV *) hv);
+            } else
+                hv = (HV *) SvRV(target);
+            if (mapper->get_decode_blessed())
+                sv_bless(target, field.mapper->stash);
+
+            items.push_back((SV *) hv);
+            mappers.push_back(field.mapper);
+            push_seen(field.mapper);
+            bool ok = materialize(trees, value.tree, value.message) &&
+                (!field.mapper->track_seen || apply_defaults_and_check());
+            pop_seen();
+            mappers.pop_back();
+            items.pop_back();
+            if (!ok)
+                return false;
+        }
+            break;
+        case UPB_TYPE_ENUM:
+            if (mapper->check_enum_values && field.enum_values.find((int32_t) value.iv) == field.enum_values.end()) {
+                // as in on_enum()
+                if (sequence != -1)
+                    sv_setiv(get_target(field_index), field.field_def->default_int32());
+                break;
+            }
+            mark_seen<true>(field_index);
+            sv_setiv(get_target(field_index), value.iv);
+            break;
+        case UPB_TYPE_INT32:
+            mark_seen<true>(field_index);
+            sv_setiv(get_target(field_index), value.iv);
+            break;
+        case UPB_TYPE_UINT32:
+            mark_seen<true>(field_index);
+            sv_setuv(get_target(field_index), value.uv);
+            break;
+        case UPB_TYPE_INT64:
+            mark_seen<true>(field_index);
+            if (mapper->use_bigints && (value.iv < I32_MIN || value.iv > I32_MAX))
+                set_bigint(aTHX_ get_target(field_index), (uint64_t) value.iv, value.iv < 0);
+            else
+                sv_setiv(get_target(field_index), (IV) value.iv);
+            break;
+        case UPB_TYPE_UINT64:
+            mark_seen<true>(field_index);
+            if (mapper->use_bigints && value.uv > U32_MAX)
+                set_bigint(aTHX_ get_target(field_index), value.uv, false);
+            else if (mapper->use_bigints)
+                sv_setiv(get_target(field_index), (IV) value.uv);
+            else
+                sv_setuv(get_target(field_index), value.uv);
+            break;
+        }
+    }
+
+    if (sequence != -1)
+        items.pop_back();
+
+    return true;
+}
+
+Mapper::Mapper(pTHX_ Dynamic *_registry, const MessageDef *_message_def, HV *_stash, const MappingOptions &options) :
+        registry(_registry),
+        message_def(_message_def),
+        stash(_stash),
+        shared(new SharedHandlers()),
+        environments_in_use(0),
+        output_size_hint(0),
+        decode_threads(options.decode_threads) {
+    SET_THX_MEMBER;
+#ifdef USE_ITHREADS
+    MUTEX_INIT(&decoder_contexts_mutex);
+#endif
+
+    SvREFCNT_inc(stash);
+
+    registry->ref();
+    shared->pb_encoder_handlers = Encoder::NewHandlers(message_def);
+    shared->json_encoder_handlers = Printer::NewHandlers(message_def, false /* XXX option */);
+    shared->decoder_handlers = Handlers::New(message_def);
+    decode_explicit_defaults = options.explicit_defaults;
+    encode_defaults = message_def->syntax() == UPB_SYNTAX_PROTO2 &&
+        options.encode_defaults;
+    check_enum_values = options.check_enum_values;
+    decode_blessed = options.decode_blessed;
+    // on older Perls it is not fully reliable because the check is performed before
+    // the SetMAGIC() call, so it is better to disable it entirely
+    fail_ref_coercion = HAS_FULL_NOMG ? options.fail_ref_coercion : false;
+    zero_copy_bytes = options.zero_copy_bytes;
+    // the uPB encoder can't write unknown fields
+    native_encoder = options.native_encoder || options.preserve_unknown_fields;
+    use_bigints = options.use_bigints;
+    deterministic = options.deterministic;
+    warning_context = options.warning_context;
+    // map entries are never exposed
+    preserve_unknown_fields = options.preserve_unknown_fields && !message_def->mapentry();
+    has_lazy_fields = false;
+    has_unknown_fields = preserve_unknown_fields;
+    warn_context = WarnContext::get(aTHX);
+
+    track_seen = decode_explicit_defaults;
+    if (options.check_required_fields) {
+        for (MessageDef::const_field_iterator it = message_def->field_begin(), en = message_def->field_end(); it != en; ++it)
+            track_seen = track_seen || (*it)->label() == UPB_LABEL_REQUIRED;
+    }
+
+    // when there are no defaults to apply and no required fields to check,
+    // seen fields are not tracked and there is nothing to do at message end
+    if (track_seen && !shared->decoder_handlers->SetEndMessageHandler(UpbMakeHandler(DecoderHandlers::on_end_message)))
+        croak("Unable to set upb end message handler for %s", message_def->full_name());
+
+    std::vector<Field*> fields_by_field_def_index;
+    fields.reserve(message_def->field_count());
+    seen_field_words = (message_def->field_count() + 63) / 64;
+    fields_by_field_def_index.resize(message_def->field_count());
+
+    bool map_entry = message_def->mapentry();
+    bool has_required = false;
+    for (MessageDef::const_field_iterator it = message_def->field_begin(), en = message_def->field_end(); it != en; ++it) {
+        int index = fields.size();
+        fields.push_back(Field());
+
+        Field &field = fields.back();;
+        const FieldDef *field_def = *it;
+        const OneofDef *oneof_def = field_def->containing_oneof();
+
+        fields_by_field_def_index[field_def->index()] = &fields.back();
+        has_required = has_required || field_def->label() == UPB_LABEL_REQUIRED;
+        field.field_def = field_def;
+        if (field_def->is_extension()) {
+            string temp = string() + "[" + field_def->full_name() + "]";
+
+            field.name = newSVpvn_share(temp.data(), temp.size(), 0);
+        } else {
+            string temp = string(field_def->name());
+
+            field.name = newSVpvn_share(temp.data(), temp.size(), 0);
+        }
+        field.name_hash = SvSHARED_HASH(field.name);
+        field.has_default = field.is_map = false;
+        field.mapper = NULL;
+        field.oneof_index = -1;
+        field.field_number = field_def->number();
+        field.descriptor_type = field_def->descriptor_type();
+        // same condition used by upb::pb::Encoder
+        field.packed = field_def->IsSequence() && field_def->IsPrimitive() &&
+            field_def->packed();
+
+        if (map_entry) {
+            field.is_key = field_def->number() == 1;
+            field.is_value = field_def->number() == 2;
+        }
+
+        if (field_def->label() == UPB_LABEL_REPEATED &&
+                field_def->type() == UPB_TYPE_MESSAGE &&
+                field_def->message_subdef()->mapentry()) {
+            field.is_map = true;
+        }
+
+        // groups are not length-delimited, so they are always decoded; map
+        // values are stored directly in the map hash, which map accessors
+        // return as-is
+        field.lazy = field_def->descriptor_type() == UPB_DESCRIPTOR_TYPE_MESSAGE && !field.is_map && !map_entry &&
+            (options.lazy_all_fields || options.lazy_field_names.count(field_def->full_name()));
+        has_lazy_fields = has_lazy_fields || field.lazy;
+
+#define GET_SELECTOR(KIND, TO) \
+    ok = ok && shared->pb_encoder_handlers->GetSelector(field_def, UPB_HANDLER_##KIND, &field.selector.TO)
+
+        bool ok = true;
+        bool has_default = true;
+        switch (field_def->type()) {
+        case UPB_TYPE_FLOAT:
+            GET_SELECTOR(FLOAT, primitive);
+            field.value_encoding = EncodeFloat;
+            field.default_nv = field_def->default_float();
+            break;
+        case UPB_TYPE_DOUBLE:
+            GET_SELECTOR(DOUBLE, primitive);
+            field.value_encoding = EncodeDouble;
+            field.default_nv = field_def->default_double();
+            break;
+        case UPB_TYPE_BOOL:
+            GET_SELECTOR(BOOL, primitive);
+            field.value_encoding = EncodeBool;
+            field.default_bool = field_def->default_bool();
+            break;
+        case UPB_TYPE_STRING:
+        case UPB_TYPE_BYTES:
+            GET_SELECTOR(STARTSTR, str_start);
+            GET_SELECTOR(STRING, str_cont);
+            GET_SELECTOR(ENDSTR, str_end);
+            field.value_encoding = field_def->type() == UPB_TYPE_STRING ? EncodeString : EncodeBytes;
+            field.default_str = field_def->default_string(&field.default_str_len);
+            break;
+        case UPB_TYPE_MESSAGE:
+            GET_SELECTOR(STARTSUBMSG, msg_start);
+            GET_SELECTOR(ENDSUBMSG, msg_end);
+            field.value_encoding = EncodeMessage;
+            has_default = false;
+            break;
+        case UPB_TYPE_ENUM: {
+            GET_SELECTOR(INT32, primitive);
+            field.value_encoding = check_enum_values ? EncodeCheckedEnum : EncodeEnum;
+            field.default_iv = field_def->default_int32();
+
+            if (check_enum_values) {
+                const EnumDef *enumdef = field_def->enum_subdef();
+                upb_enum_iter i;
+                for (upb_enum_begin(&i, enumdef); !upb_enum_done(&i); upb_enum_next(&i))
+                    field.enum_values.insert(upb_enum_iter_number(&i));
+            }
+        }
+            break;
+        case UPB_TYPE_INT32:
+            GET_SELECTOR(INT32, primitive);
+            field.value_encoding = EncodeInt32;
+            field.default_iv = field_def->default_int32();
+            break;
+        case UPB_TYPE_UINT32:
+            GET_SELECTOR(UINT32, primitive);
+            field.value_encoding = EncodeUInt32;
+            field.default_uv = field_def->default_uint32();
+            break;
+        case UPB_TYPE_INT64:
+            GET_SELECTOR(INT64, primitive);
+            field.value_encoding = sizeof(IV) >= sizeof(int64_t) ? EncodeInt64 : EncodeBigInt64;
+            field.default_i64 = field_def->default_int64();
+            break;
+        case UPB_TYPE_UINT64:
+            GET_SELECTOR(UINT64, primitive);
+            field.value_encoding = sizeof(UV) >= sizeof(int64_t) ? EncodeUInt64 : EncodeBigUInt64;
+            field.default_u64 = field_def->default_uint64();
+            break;
+        default:
+            croak("Unhandled field type %d for field '%s'", field_def->type(), field.full_name().c_str());
+        }
+
+        if (has_default &&
+                field_def->label() == UPB_LABEL_OPTIONAL &&
+                !oneof_def) {
+            field.has_default = true;
+        }
+
+        if (field_def->label() == UPB_LABEL_REPEATED) {
+            GET_SELECTOR(STARTSEQ, seq_start);
+            GET_SELECTOR(ENDSEQ, seq_end);
+        }
+
+#undef GET_SELECTOR
+
+        if (!ok)
+            croak("Unable to get upb selector for field %s", field.full_name().c_str());
+
+    }
+
+    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
+        if (it->field_def->is_extension()) {
+            extension_mapper_fields.push_back(new MapperField(aTHX_ this, &*it));
+            unref(); // to avoid ref loop
+        }
+        field_map[SvPV_nolen(it->name)] = &*it;
+        fields_by_number[it->field_number] = &*it;
+    }
+
+    int oneof_index = 0;
+    for (MessageDef::const_oneof_iterator it = message_def->oneof_begin(), en = message_def->oneof_end(); it != en; ++it, ++oneof_index) {
+        const OneofDef *oneof_def = *it;
+
+        for (OneofDef::const_iterator it = oneof_def->begin(), en = oneof_def->end(); it != en; ++it) {
+            const FieldDef *field_def = *it;
+            Field *field = fields_by_field_def_index[field_def->index()];
+
+            field->oneof_index = oneof_index;
+        }
+    }
+
+    for (int i = 0, n = fields.size(); i < n; ++i) {
+        if (!bind_decoder_handlers(shared->decoder_handlers.get(), fields[i], i, false))
+            croak("Unable to set upb decoder handlers for field %s", fields[i].full_name().c_str());
+    }
+
+    check_required_fields = has_required && options.check_required_fields;
+}
+
+bool Mapper::bind_decoder_handlers(Handlers *handlers, const Field &field, int index, bool lazy) const {
+    // the handler variant not tracking seen fields is used when possible
+    if (track_seen)
+        return bind_decoder_handlers<true>(handlers, field, index, lazy);
+    else
+        return bind_decoder_handlers<false>(handlers, field, index, lazy);
+}
+
+template<bool track_seen>
+bool Mapper::bind_decoder_handlers(Handlers *handlers, const Field &field, int index, bool lazy) const {
+    if (field.is_key)
+        return bind_decoder_handlers<track_seen, DecoderHandlers::MapKeyTarget>(handlers, field, index, lazy);
+    else if (field.is_value)
+        return bind_decoder_handlers<track_seen, DecoderHandlers::MapValueTarget>(handlers, field, index, lazy);
+    else if (field.field_def->label() == UPB_LABEL_REPEATED)
+        return bind_decoder_handlers<track_seen, DecoderHandlers::RepeatedTarget>(handlers, field, index, lazy);
+    else if (field.oneof_index != -1)
+        return bind_decoder_handlers<track_seen, DecoderHandlers::OneofTarget>(handlers, field, index, lazy);
+    else
+        return bind_decoder_handlers<track_seen, DecoderHandlers::PlainTarget>(handlers, field, index, lazy);
+}
+
+template<bool track_seen, int kind>
+bool Mapper::bind_decoder_handlers(Handlers *handlers, const Field &field, int index, bool lazy) const {
+    const FieldDef *field_def = field.field_def;
+
+// COMMA avoids splitting template arguments in UpbBind() macro arguments
+#define COMMA ,
+#define SET_VALUE_HANDLER(TYPE, FUNCTION) \
+    ok = ok && handlers->SetValueHandler<TYPE>(field_def, UpbBind(DecoderHandlers::FUNCTION<track_seen COMMA kind>, new int(index)))
+
+#define SET_TYPED_VALUE_HANDLER(TYPE, FUNCTION) \
+    ok = ok && handlers->SetValueHandler<TYPE>(field_def, UpbBind(DecoderHandlers::FUNCTION<TYPE COMMA track_seen COMMA kind>, new int(index)))
+
+#define SET_HANDLER(KIND, FUNCTION) \
+    ok = ok && handlers->Set##KIND##Handler(field_def, UpbBind(DecoderHandlers::FUNCTION, new int(index)))
+
+#define SET_TARGET_HANDLER(KIND, FUNCTION) \
+    ok = ok && handlers->Set##KIND##Handler(field_def, UpbBind(DecoderHandlers::FUNCTION<track_seen COMMA kind>, new int(index)))
+
+    bool ok = true;
+    switch (field_def->type()) {
+    case UPB_TYPE_FLOAT:
+        SET_TYPED_VALUE_HANDLER(float, on_nv);
+        break;
+    case UPB_TYPE_DOUBLE:
+        SET_TYPED_VALUE_HANDLER(double, on_nv);
+        break;
+    case UPB_TYPE_BOOL:
+        SET_VALUE_HANDLER(bool, on_bool);
+        break;
+    case UPB_TYPE_STRING:
+        SET_TARGET_HANDLER(StartString, on_start_string);
+        SET_HANDLER(String, on_string);
+        SET_HANDLER(EndString, on_end_string);
+        break;
+    case UPB_TYPE_BYTES:
+        if (zero_copy_bytes) {
+            SET_TARGET_HANDLER(StartString, on_start_shared_bytes);
+            SET_HANDLER(String, on_shared_bytes);
+        } else {
+            SET_TARGET_HANDLER(StartString, on_start_string);
+            SET_HANDLER(String, on_string);
+        }
+        SET_HANDLER(EndString, on_end_bytes);
+        break;
+    case UPB_TYPE_MESSAGE:
+        if (field.is_map) {
+            SET_HANDLER(EndSubMessage, on_end_map_entry);
+        } else if (lazy && field.lazy) {
+            // the sub-message is skipped, see scan_fields()
+            SET_TARGET_HANDLER(StartSubMessage, on_start_lazy_sub_message);
+        } else {
+            SET_TARGET_HANDLER(StartSubMessage, on_start_sub_message);
+            SET_HANDLER(EndSubMessage, on_end_sub_message);
+        }
+        break;
+    case UPB_TYPE_ENUM:
+        if (check_enum_values)
+            SET_VALUE_HANDLER(int32_t, on_enum);
+        else
+            SET_TYPED_VALUE_HANDLER(int32_t, on_iv);
+        break;
+    case UPB_TYPE_INT32:
+        SET_TYPED_VALUE_HANDLER(int32_t, on_iv);
+        break;
+    case UPB_TYPE_UINT32:
+        SET_TYPED_VALUE_HANDLER(uint32_t, on_uv);
+        break;
+    case UPB_TYPE_INT64:
+        if (use_bigints)
+            SET_VALUE_HANDLER(int64_t, on_bigiv);
+        else
+            SET_TYPED_VALUE_HANDLER(int64_t, on_iv);
+        break;
+    case UPB_TYPE_UINT64:
+        if (use_bigints)
+            SET_VALUE_HANDLER(uint64_t, on_biguv);
+        else
+            SET_TYPED_VALUE_HANDLER(uint64_t, on_uv);
+        break;
+    }
+
+    if (field_def->label() == UPB_LABEL_REPEATED) {
+        if (field.is_map) {
+            SET_HANDLER(StartSequence, on_start_map<track_seen>);
+            SET_HANDLER(EndSequence, on_end_map);
+        } else {
+            SET_HANDLER(StartSequence, on_start_sequence<track_seen>);
+            SET_HANDLER(EndSequence, on_end_sequence);
+        }
+    }
+
+#undef COMMA
+#undef SET_VALUE_HANDLER
+#undef SET_TYPED_VALUE_HANDLER
+#undef SET_HANDLER
+#undef SET_TARGET_HANDLER
+
+    return ok;
+}
+
+Mapper::~Mapper() {
+    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it)
+        if (it->mapper)
+            it->mapper->unref();
+    for (vector<MapperField *>::iterator it = extension_mapper_fields.begin(), en = extension_mapper_fields.end(); it != en; ++it)
+        // this will make the mapper ref count to go negative, but it's OK
+        (*it)->unref();
+
+    for (vector<DecoderContext *>::iterator it = decoder_contexts.begin(), en = decoder_contexts.end(); it != en; ++it)
+        delete *it;
+    for (vector<ReusableEnvironment *>::iterator it = environments.begin(), en = environments.end(); it != en; ++it)
+        delete *it;
+#ifdef USE_ITHREADS
+    MUTEX_DESTROY(&decoder_contexts_mutex);
+#endif
+
+    {
+        HandlersLock lock;
+
+        partial_decoders.clear();
+        shared->unref();
+    }
+
+    // make sure this only goes away after inner destructors have completed
+    refcounted_mortalize(aTHX_ registry);
+    SvREFCNT_dec(stash);
+}
+
+void Mapper::setup(pTHX) {
+#ifdef USE_ITHREADS
+    static bool initialized = false;
+
+    // BOOT only runs again for interpreters that are not clones
+    if (!initialized) {
+        MUTEX_INIT(&handlers_mutex);
+        initialized = true;
+    }
+#endif
+}
+
+#ifdef USE_ITHREADS
+
+// called while cloning the interpreter: handlers and methods are shared,
+// Perl values are taken from the clone
+Mapper::Mapper(pTHX_ const Mapper &original, CLONE_PARAMS *params) :
+        registry(original.registry),
+        message_def(original.message_def),
+        stash((HV *) sv_dup_inc((SV *) original.stash, params)),
+        shared(original.shared),
+        fields(original.fields),
+        encode_program(original.encode_program),
+        seen_field_words(original.seen_field_words),
+        track_seen(original.track_seen),
+        environments_in_use(0),
+        output_size_hint(original.output_size_hint),
+        decode_threads(original.decode_threads),
+        check_required_fields(original.check_required_fields),
+        decode_explicit_defaults(original.decode_explicit_defaults),
+        encode_defaults(original.encode_defaults),
+        check_enum_values(original.check_enum_values),
+        decode_blessed(original.decode_blessed),
+        fail_ref_coercion(original.fail_ref_coercion),
+        zero_copy_bytes(original.zero_copy_bytes),
+        native_encoder(original.native_encoder),
+        use_bigints(original.use_bigints),
+        preserve_unknown_fields(original.preserve_unknown_fields),
+        deterministic(original.deterministic),
+        warning_context(original.warning_context),
+        has_lazy_fields(original.has_lazy_fields),
+        has_unknown_fields(original.has_unknown_fields) {
+    SET_THX_MEMBER;
+    MUTEX_INIT(&decoder_contexts_mutex);
+
+    // recursive messages find this copy instead of creating a new one
+    ptr_table_store(PL_ptr_table, &original, this);
+    registry->ref();
+    shared->ref();
+    warn_context = WarnContext::clone(aTHX_ original.warn_context, params);
+
+    const Field *original_fields = original.fields.empty() ? NULL : &original.fields[0];
+
+    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
+        it->name = sv_dup_inc(it->name, params);
+        if (it->mapper)
+            it->mapper = Mapper::clone(aTHX_ it->mapper, params);
+    }
+    for (vector<EncodeInstruction>::iterator it = encode_program.begin(), en = encode_program.end(); it != en; ++it)
+        it->field = &fields[it->field - original_fields];
+    for (STD_TR1::unordered_map<string, Field *>::const_iterator it = original.field_map.begin(), en = original.field_map.end(); it != en; ++it)
+        field_map[it->first] = &fields[it->second - original_fields];
+    for (STD_TR1::unordered_map<uint32_t, const Field *>::const_iterator it = original.fields_by_number.begin(), en = original.fields_by_number.end(); it != en; ++it)
+        fields_by_number[it->first] = &fields[it->second - original_fields];
+    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
+        if (it->field_def->is_extension()) {
+            extension_mapper_fields.push_back(new MapperField(aTHX_ this, &*it));
+            unref(); // to avoid ref loop
+        }
+    }
+}
+
+Mapper *Mapper::clone(pTHX_ const Mapper *original, CLONE_PARAMS *params) {
+    Mapper *mapper = (Mapper *) ptr_table_fetch(PL_ptr_table, original);
+
+    if (mapper)
+        mapper->ref();
+    else
+        mapper = new Mapper(aTHX_ *original, params);
+
+    return mapper;
+}
+
+#endif
+
+const char *Mapper::full_name() const {
+    return message_def->full_name();
+}
+
+const char *Mapper::package_name() const {
+    return HvNAME(stash);
+}
+
+MapperField *Mapper::find_extension(const std::string &name) const {
+    for (vector<MapperField *>::const_iterator it = extension_mapper_fields.begin(), en = extension_mapper_fields.end(); it != en; ++it) {
+        if (name == (*it)->name())
+            return *it;
+    }
+
+    return NULL;
+}
+
+int Mapper::field_count() const {
+    return fields.size();
+}
+
+const Mapper::Field *Mapper::get_field(int index) const {
+    return &fields[index];
+}
+
+SV *Mapper::message_descriptor() const {
+    SV *ref = newSV(0);
+
+    sv_setref_iv(ref, "Google::ProtocolBuffers::Dynamic::MessageDef", (IV) message_def);
+
+    return ref;
+}
+
+SV *Mapper::make_object(SV *data) const {
+    SV *obj = NULL;
+
+    if (data) {
+        if (!SvROK(data) || SvTYPE(SvRV(data)) != SVt_PVHV)
+            croak("Not an hash reference");
+
+        if (SvTEMP(data) && SvREFCNT(data) == 1) {
+            // steal
+            SvREFCNT_inc(data);
+            obj = data;
+        } else {
+            HV * hv = newHV();
+            sv_2mortal((SV *) hv);
+            HV *orig = (HV *) SvRV(data);
+            I32 keylen;
+            char *key;
+            hv_iterinit(orig);
+            while (SV *sv = hv_iternextsv(orig, &key, &keylen)) {
+                hv_store(hv, key, keylen, newSVsv(sv), 0);
+            }
+            obj = newRV_inc((SV *) hv);
+        }
+    } else {
+        obj = newRV_noinc((SV *) newHV());
+    }
+
+    if (decode_blessed)
+        sv_bless(obj, stash);
+
+    return obj;
+}
+
+void Mapper::resolve_mappers() {
+    HandlersLock lock;
+
+    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
+        const FieldDef *field = it->field_def;
+
+        if (field->type() != UPB_TYPE_MESSAGE)
+            continue;
+        it->mapper = registry->find_mapper(field->message_subdef());
+        it->mapper->ref();
+        shared->decoder_handlers->SetSubHandlers(it->field_def, it->mapper->shared->decoder_handlers.get());
+    }
+}
+
+bool Mapper::resolve_scanned_fields() {
+    bool changed = false;
+
+    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
+        if (!it->mapper)
+            continue;
+        if (!has_lazy_fields && it->mapper->has_lazy_fields) {
+            has_lazy_fields = true;
+            changed = true;
+        }
+        // lazy sub-messages are not scanned, their unknown fields are
+        // found when they are decoded
+        if (!has_unknown_fields && !it->lazy && it->mapper->has_unknown_fields) {
+            has_unknown_fields = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// the JSON decoder always uses decoder_handlers; for protobuf, lazy
+// sub-messages are skipped by using handlers that do not descend into
+// them, so messages containing lazy fields need a separate set of handlers
+const Handlers *Mapper::pb_decoder_handlers() const {
+    if (!has_lazy_fields)
+        return shared->decoder_handlers.get();
+    if (shared->lazy_decoder_handlers.get())
+        return shared->lazy_decoder_handlers.get();
+
+    // set before recursing, for recursive messages
+    shared->lazy_decoder_handlers = Handlers::New(message_def);
+    if (track_seen && !shared->lazy_decoder_handlers->SetEndMessageHandler(UpbMakeHandler(DecoderHandlers::on_end_message)))
+        croak("Unable to set upb end message handler for %s", message_def->full_name());
+
+    for (int i = 0, n = fields.size(); i < n; ++i) {
+        const Field &field = fields[i];
+
+        if (!bind_decoder_handlers(shared->lazy_decoder_handlers.get(), field, i, true))
+            croak("Unable to set upb decoder handlers for field %s", field.full_name().c_str());
+        if (field.field_def->type() != UPB_TYPE_MESSAGE)
+            continue;
+
+        if (field.lazy) {
+            // no handlers at all, so nested messages are skipped as well
+            shared->skip_handlers.push_back(Handlers::New(field.field_def->message_subdef()));
+            shared->lazy_decoder_handlers->SetSubHandlers(field.field_def, shared->skip_handlers.back().get());
+        } else {
+            shared->lazy_decoder_handlers->SetSubHandlers(field.field_def, field.mapper->pb_decoder_handlers());
+        }
+    }
+
+    return shared->lazy_decoder_handlers.get();
+}
+
+void Mapper::create_encoder_decoder() {
+    HandlersLock lock;
+
+    shared->pb_decoder_method = DecoderMethod::New(DecoderMethodOptions(pb_decoder_handlers()));
+    shared->json_decoder_method = ParserMethod::New(message_def);
+    compile_encode_program();
+}
+
+void Mapper::compile_encode_program() {
+    encode_program.clear();
+    encode_program.reserve(fields.size());
+
+    for (vector<Field>::const_iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
+        EncodeInstruction instruction;
+
+        if (it->is_map)
+            instruction.action = EncodeInstruction::EncodeMap;
+        else if (it->field_def->label() == UPB_LABEL_REPEATED)
+            instruction.action = EncodeInstruction::EncodeRepeated;
+        else if (encode_defaults || !it->has_default)
+            instruction.action = EncodeInstruction::EncodeSingle;
+        else
+            instruction.action = EncodeInstruction::EncodeSingleNoDefault;
+        instruction.required = it->field_def->label() == UPB_LABEL_REQUIRED;
+        instruction.oneof_index = it->oneof_index;
+        instruction.field = &*it;
+
+        encode_program.push_back(instruction);
+    }
+
+    // the default order is the one of the message definition
+    if (deterministic)
+        stable_sort(encode_program.begin(), encode_program.end());
+}
+
+bool Mapper::get_decode_blessed() const {
+    return decode_blessed;
+}
+
+SV *Mapper::encode(SV *ref) {
+    SVOutputBuffer output(aTHX_ output_size_hint);
+
+    if (!encode_to(&output, ref))
+        return NULL;
+    output_size_hint = output.size();
+
+    return SvREFCNT_inc(output.finish());
+}
+
+bool Mapper::encode_into(SV *ref, SV *target, SV *offset_sv, bool delimited, STRLEN *written) {
+    STRLEN target_len;
+
+    if (!SvOK(target))
+        sv_setpvs(target, "");
+    SvPV_force(target, target_len);
+    if (SvUTF8(target))
+        sv_utf8_downgrade(target, 0);
+    target_len = SvCUR(target);
+
+    IV offset = offset_sv && SvOK(offset_sv) ? SvIV(offset_sv) : target_len;
+    if (offset < 0 || (STRLEN) offset > target_len)
+        croak("Offset %" IVdf " is outside the string", offset);
+
+    SVOutputBuffer output(aTHX_ target, offset);
+
+    if (!encode_to(&output, ref)) {
+        output.clear();
+        output.finish();
+
+        return false;
+    }
+
+    if (delimited) {
+        char prefix[10];
+        size_t prefix_len = write_varint(prefix, output.size() - offset);
+
+        output.insert(offset, prefix, prefix_len);
+    }
+    *written = output.size() - offset;
+    output.finish();
+
+    return true;
+}
+
+bool Mapper::encode_to(SVOutputBuffer *output, SV *ref) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    // releases the environment and the warning context as soon as
+    // encoding is done
+    ENTER;
+    status.Clear();
+    warn_context->localize_levels(aTHX);
+    if (warning_context)
+        warn_context->localize_warning_handler(aTHX);
+
+#if HAS_FULL_NOMG
+    SvGETMAGIC(ref);
+#endif
+
+    bool ok;
+    if (native_encoder) {
+        WireWriter<SVOutputBuffer> writer(output);
+
+        ok = encode_value(&writer, &status, ref);
+    } else {
+        upb::Environment *env = localized_environment(&status);
+        upb::StringSink string_sink(output);
+        upb::pb::Encoder *pb_encoder = upb::pb::Encoder::Create(env, shared->pb_encoder_handlers.get(), string_sink.input());
+        UpbSinkWriter writer(pb_encoder->input());
+
+        ok = encode_value(&writer, &status, ref);
+    }
+    LEAVE;
+
+    return ok;
+}
+
+bool Mapper::encoded_size(SV *ref, STRLEN *size) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    SizeCounter counter;
+    WireWriter<SizeCounter> writer(&counter);
+    ENTER;
+    status.Clear();
+    warn_context->localize_levels(aTHX);
+    if (warning_context)
+        warn_context->localize_warning_handler(aTHX);
+
+#if HAS_FULL_NOMG
+    SvGETMAGIC(ref);
+#endif
+
+    bool ok = encode_value(&writer, &status, ref);
+    LEAVE;
+    if (!ok)
+        return false;
+    *size = counter.size();
+
+    return true;
+}
+
+SV *Mapper::encode_many(AV *values, bool delimited) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    SVOutputBuffer output(aTHX_ output_size_hint);
+    AppendingString target(&output);
+    upb::StringSink appending_sink(&target);
+    // the native encoder does not need an environment
+    upb::pb::Encoder *pb_encoder = native_encoder ? NULL :
+        upb::pb::Encoder::Create(localized_environment(&status), shared->pb_encoder_handlers.get(), appending_sink.input());
+    UpbSinkWriter upb_writer(pb_encoder ? pb_encoder->input() : NULL);
+    WireWriter<SVOutputBuffer> wire_writer(&output);
+    status.Clear();
+    warn_context->localize_levels(aTHX);
+    if (warning_context)
+        warn_context->localize_warning_handler(aTHX);
+    int size = av_top_index(values) + 1;
+
+    for (int i = 0; i < size; ++i) {
+        SV **item = av_fetch(values, i, 0);
+        SV *ref = item ? *item : &PL_sv_undef;
+        size_t start = output.size();
+
+#if HAS_FULL_NOMG
+        SvGETMAGIC(ref);
+#endif
+
+        bool ok = native_encoder ? encode_value(&wire_writer, &status, ref) :
+                                   encode_value(&upb_writer, &status, ref);
+
+        if (!ok) {
+            LEAVE;
+            return NULL;
+        }
+
+        if (delimited) {
+            // the length is only known after encoding, so the prefix
+            // is inserted before the message just encoded
+            char prefix[10];
+            size_t prefix_len = write_varint(prefix, output.size() - start);
+
+            output.insert(start, prefix, prefix_len);
+        }
+    }
+    LEAVE;
+
+    return SvREFCNT_inc(output.finish());
+}
+
+SV *Mapper::encode_json(SV *ref) {
+    if (shared->json_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    upb::Environment *env = localized_environment(&status);
+    SVOutputBuffer output(aTHX_ output_size_hint);
+    upb::StringSink string_sink(&output);
+    upb::json::Printer *json_encoder = upb::json::Printer::Create(env, shared->json_encoder_handlers.get(), string_sink.input());
+    status.Clear();
+    warn_context->localize_levels(aTHX);
+    if (warning_context)
+        warn_context->localize_warning_handler(aTHX);
+
+#if HAS_FULL_NOMG
+    SvGETMAGIC(ref);
+#endif
+
+    UpbSinkWriter writer(json_encoder->input());
+    bool ok = encode_value(&writer, &status, ref);
+    LEAVE;
+
+    if (!ok)
+        return NULL;
+    output_size_hint = output.size();
+
+    return SvREFCNT_inc(output.finish());
+}
+
+ReusableEnvironment::ReusableEnvironment() :
+        env((upb::Environment *) operator new(sizeof(upb::Environment))),
+        block(new char[MIN_ENVIRONMENT_BLOCK]),
+        block_size(MIN_ENVIRONMENT_BLOCK),
+        started(false) {
+}
+
+ReusableEnvironment::~ReusableEnvironment() {
+    reset();
+    delete[] block;
+    operator delete(env);
+}
+
+upb::Environment *ReusableEnvironment::start(upb::Status *report_errors_to) {
+    reset();
+    upb_env_init2(env, block, block_size, upb_allocator());
+    env->ReportErrorsTo(report_errors_to);
+    started = true;
+
+    return env;
+}
+
+void ReusableEnvironment::reset() {
+    if (!started)
+        return;
+    size_t used = env->BytesAllocated();
+
+    // frees the blocks allocated past the initial one
+    upb_env_uninit(env);
+    started = false;
+    if (used > block_size && block_size < MAX_ENVIRONMENT_BLOCK) {
+        delete[] block;
+        block_size = min(max(used, block_size * 2), MAX_ENVIRONMENT_BLOCK);
+        block = new char[block_size];
+    }
+}
+
+Mapper::DecoderContext::DecoderContext(pTHX_ const Mapper *mapper) :
+        callbacks(aTHX_ mapper),
+        sink(mapper->pb_decoder_handlers(), &callbacks),
+        json_sink(mapper->shared->decoder_handlers.get(), &callbacks) {
+}
+
+void Mapper::DecoderContext::release_input() {
+    callbacks.set_input(NULL, false);
+}
+
+const char *Mapper::DecoderContext::error_message() const {
+    return !callbacks.error.empty() ? callbacks.error.c_str() :
+           !status.ok()             ? status.error_message() :
+                                      "Unknown error";
+}
+
+Mapper::DecoderContext *Mapper::acquire_decoder_context() {
+    DecoderContext *cxt = NULL;
+
+#ifdef USE_ITHREADS
+    MUTEX_LOCK(&decoder_contexts_mutex);
+#endif
+    if (!decoder_contexts.empty()) {
+        cxt = decoder_contexts.back();
+        decoder_contexts.pop_back();
+    }
+#ifdef USE_ITHREADS
+    MUTEX_UNLOCK(&decoder_contexts_mutex);
+#endif
+
+    if (!cxt)
+        cxt = new DecoderContext(aTHX_ this);
+    cxt->status.Clear();
+    cxt->callbacks.error.clear();
+
+    return cxt;
+}
+
+void Mapper::release_decoder_context(DecoderContext *cxt) {
+    cxt->release_input();
+    cxt->environment.reset();
+#ifdef USE_ITHREADS
+    MUTEX_LOCK(&decoder_contexts_mutex);
+#endif
+    decoder_contexts.push_back(cxt);
+#ifdef USE_ITHREADS
+    MUTEX_UNLOCK(&decoder_contexts_mutex);
+#endif
+}
+
+namespace {
+    struct LocalizedDecoderContext {
+        Mapper *mapper;
+        Mapper::DecoderContext *cxt;
+    };
+
+    void release_localized_decoder_context(pTHX_ void *ptr) {
+        LocalizedDecoderContext *localized = (LocalizedDecoderContext *) ptr;
+
+        localized->mapper->release_decoder_context(localized->cxt);
+        delete localized;
+    }
+}
+
+// the context is returned to the free list when the current scope is
+// left, also when decoding dies
+Mapper::DecoderContext *Mapper::localized_decoder_context() {
+    LocalizedDecoderContext *localized = new LocalizedDecoderContext;
+
+    localized->mapper = this;
+    localized->cxt = acquire_decoder_context();
+    SAVEDESTRUCTOR_X(release_localized_decoder_context, localized);
+
+    return localized->cxt;
+}
+
+// the environment is reset when the current scope is left, also when
+// encoding dies; nested calls (for example from a warning handler) use
+// the following environments, and scopes are left in reverse order
+upb::Environment *Mapper::localized_environment(upb::Status *report_errors_to) {
+    if (environments_in_use == environments.size())
+        environments.push_back(new ReusableEnvironment());
+    ReusableEnvironment *environment = environments[environments_in_use++];
+
+    SAVEDESTRUCTOR_X(release_localized_environment, this);
+
+    return environment->start(report_errors_to);
+}
+
+void Mapper::release_localized_environment(pTHX_ void *ptr) {
+    Mapper *mapper = (Mapper *) ptr;
+
+    mapper->environments[--mapper->environments_in_use]->reset();
+}
+
+void Mapper::report_decoder_error(DecoderContext *cxt) {
+    status.SetFormattedErrorMessage("%s", cxt->error_message());
+}
+
+SV *Mapper::decode(const char *buffer, STRLEN bufsize, SV *input) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    DecoderContext *cxt = localized_decoder_context();
+    SV *result = NULL;
+
+    if (decode_threads > 1 && bufsize >= PARALLEL_DECODE_MIN_SIZE &&
+            decode_parallel(cxt, buffer, bufsize, input, &result)) {
+        LEAVE;
+
+        return result;
+    }
+
+    upb::Environment *env = cxt->environment.start(&cxt->status);
+    upb::pb::Decoder *pb_decoder = upb::pb::Decoder::Create(env, shared->pb_decoder_method.get(), &cxt->sink);
+    result = decode(cxt, pb_decoder, buffer, bufsize, input);
+    LEAVE;
+
+    return result;
+}
+
+SV *Mapper::decode(DecoderContext *cxt, upb::pb::Decoder *pb_decoder, const char *buffer, STRLEN bufsize, SV *input, bool private_input) {
+    DecoderHandlers &callbacks = cxt->callbacks;
+
+    cxt->status.Clear();
+    callbacks.set_input(input, private_input);
+    pb_decoder->Reset();
+    callbacks.prepare(newHV(), bufsize);
+    // in case of failure, the error is reported by the upb decoder
+    if (has_lazy_fields || has_unknown_fields)
+        scan_fields(buffer, buffer + bufsize, 0, &callbacks);
+    callbacks.take_unknown_fields(this, (HV *) callbacks.get_target());
+
+    SV *result = NULL;
+    if (BufferSource::PutBuffer(buffer, bufsize, pb_decoder->input())) {
+        result = newRV_inc(callbacks.get_target());
+        if (decode_blessed)
+            sv_bless(result, stash);
+    } else {
+        report_decoder_error(cxt);
+    }
+    callbacks.clear();
+
+    return result;
+}
+
+upb::pb::Decoder *Mapper::create_pb_decoder(upb::Environment *env, DecoderContext *cxt) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    env->ReportErrorsTo(&cxt->status);
+
+    return upb::pb::Decoder::Create(env, shared->pb_decoder_method.get(), &cxt->sink);
+}
+
+SV *Mapper::decode_many(AV *buffers) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    // a single context/environment/decoder is reused for the whole batch
+    DecoderContext *cxt = localized_decoder_context();
+    upb::Environment *env = cxt->environment.start(&cxt->status);
+    upb::pb::Decoder *pb_decoder = upb::pb::Decoder::Create(env, shared->pb_decoder_method.get(), &cxt->sink);
+    AV *result = newAV();
+    int size = av_top_index(buffers) + 1;
+
+    sv_2mortal((SV *) result);
+    if (size)
+        av_extend(result, size - 1);
+    for (int i = 0; i < size; ++i) {
+        SV **item = av_fetch(buffers, i, 0);
+        STRLEN bufsize = 0;
+        const char *buffer = item ? SvPV(*item, bufsize) : "";
+        SV *decoded = decode(cxt, pb_decoder, buffer, bufsize, item ? *item : NULL);
+
+        if (!decoded) {
+            LEAVE;
+            return NULL;
+        }
+        av_push(result, decoded);
+    }
+    LEAVE;
+
+    return newRV_inc((SV *) result);
+}
+
+SV *Mapper::decode_partial(const char *buffer, STRLEN bufsize, AV *paths, SV *input) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    string error;
+    const PartialDecoder *partial = find_partial_decoder(paths, &error);
+    if (!partial)
+        croak("%s", error.c_str());
+    ENTER;
+    DecoderContext *cxt = localized_decoder_context();
+    upb::Environment *env = cxt->environment.start(&cxt->status);
+    upb::Sink partial_sink(partial->handlers.front().get(), &cxt->callbacks);
+    upb::pb::Decoder *pb_decoder = upb::pb::Decoder::Create(env, partial->method.get(), &partial_sink);
+
+    cxt->callbacks.set_input(input, false);
+    cxt->callbacks.prepare(newHV(), bufsize);
+
+    SV *result = NULL;
+    if (BufferSource::PutBuffer(buffer, bufsize, pb_decoder->input())) {
+        result = newRV_inc(cxt->callbacks.get_target());
+        if (decode_blessed)
+            sv_bless(result, stash);
+    } else {
+        report_decoder_error(cxt);
+    }
+    cxt->callbacks.clear();
+    LEAVE;
+
+    return result;
+}
+
+// decodes into an existing message hash, either merging the decoded
+// fields or reusing its hashes/arrays/scalars for the decoded value
+bool Mapper::decode_into(HV *target, const char *buffer, STRLEN bufsize, bool merge, SV *input) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    DecoderContext *cxt = localized_decoder_context();
+    upb::Environment *env = cxt->environment.start(&cxt->status);
+    upb::pb::Decoder *pb_decoder = upb::pb::Decoder::Create(env, shared->pb_decoder_method.get(), &cxt->sink);
+    DecoderHandlers &callbacks = cxt->callbacks;
+
+    callbacks.set_input(input, false);
+    callbacks.prepare((HV *) SvREFCNT_inc(target), bufsize);
+    if (merge)
+        callbacks.merging = true;
+    else
+        callbacks.recycle_fields(this, target);
+    // in case of failure, the error is reported by the upb decoder
+    if (has_lazy_fields || has_unknown_fields)
+        scan_fields(buffer, buffer + bufsize, 0, &callbacks);
+    callbacks.take_unknown_fields(this, target);
+
+    bool ok = BufferSource::PutBuffer(buffer, bufsize, pb_decoder->input());
+    if (!ok)
+        report_decoder_error(cxt);
+    else if (!merge)
+        callbacks.remove_stale_fields(this, target);
+    callbacks.release_spare_hashes();
+    callbacks.clear();
+    LEAVE;
+
+    return ok;
+}
+
+const Mapper::PartialDecoder *Mapper::find_partial_decoder(AV *paths, string *error) {
+    vector<string> names;
+    int size = av_top_index(paths) + 1;
+
+    for (int i = 0; i < size; ++i) {
+        SV **item = av_fetch(paths, i, 0);
+        STRLEN len;
+        const char *name = item ? SvPV(*item, len) : NULL;
+
+        if (!name || !len) {
+            *error = "Empty field path for decode_partial()";
+            return NULL;
+        }
+        names.push_back(string(name, len));
+    }
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+
+    string key;
+    for (vector<string>::iterator it = names.begin(), en = names.end(); it != en; ++it) {
+        if (!key.empty())
+            key += ',';
+        key += *it;
+    }
+
+    STD_TR1::unordered_map<string, PartialDecoder>::iterator cached = partial_decoders.find(key);
+    if (cached != partial_decoders.end())
+        return &cached->second;
+
+    HandlersLock lock;
+    PartialDecoder partial;
+    const Handlers *handlers = partial_decoder_handlers(names, &partial.handlers, error);
+    if (!handlers)
+        return NULL;
+    partial.method = DecoderMethod::New(DecoderMethodOptions(handlers));
+
+    PartialDecoder &stored = partial_decoders[key];
+    stored = partial;
+
+    return &stored;
+}
+
+// handlers are only bound for fields in the paths, everything else is
+// skipped by the decoder; required fields are not checked and defaults
+// are not applied, because most fields are missing by design
+Handlers *Mapper::partial_decoder_handlers(const vector<string> &paths, vector<reffed_ptr<Handlers> > *handlers, string *error) const {
+    // paths grouped by their first component, an empty sub-path means
+    // the whole field
+    STD_TR1::unordered_map<string, vector<string> > subpaths;
+
+    for (vector<string>::const_iterator it = paths.begin(), en = paths.end(); it != en; ++it) {
+        size_t dot = it->find('.');
+
+        if (dot == string::npos)
+            subpaths[*it].push_back(string());
+        else
+            subpaths[it->substr(0, dot)].push_back(it->substr(dot + 1));
+    }
+
+    handlers->push_back(Handlers::New(message_def));
+    Handlers *partial = handlers->back().get();
+
+    for (STD_TR1::unordered_map<string, vector<string> >::iterator it = subpaths.begin(), en = subpaths.end(); it != en; ++it) {
+        STD_TR1::unordered_map<string, Field *>::const_iterator found = field_map.find(it->first);
+
+        if (found == field_map.end()) {
+            *error = "Unknown field '" + it->first + "' in message '" + message_def->full_name() + "'";
+            return NULL;
+        }
+        const Field &field = *found->second;
+        bool whole = find(it->second.begin(), it->second.end(), string()) != it->second.end();
+
+        if (!bind_decoder_handlers(partial, field, &field - &fields[0], false)) {
+            *error = "Unable to set upb decoder handlers for field " + field.full_name();
+            return NULL;
+        }
+        if (field.field_def->type() != UPB_TYPE_MESSAGE || field.is_map) {
+            if (!whole) {
+                *error = "Field '" + field.full_name() + "' is not a message field";
+                return NULL;
+            }
+            if (field.is_map)
+                partial->SetSubHandlers(field.field_def, field.mapper->shared->decoder_handlers.get());
+        } else if (whole) {
+            partial->SetSubHandlers(field.field_def, field.mapper->shared->decoder_handlers.get());
+        } else {
+            const Handlers *sub = field.mapper->partial_decoder_handlers(it->second, handlers, error);
+            if (!sub)
+                return NULL;
+            partial->SetSubHandlers(field.field_def, sub);
+        }
+    }
+
+    return partial;
+}
+
+SV *Mapper::decode_stream(const char *buffer, STRLEN bufsize, SV *input) {
+    if (shared->pb_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    DecoderContext *cxt = localized_decoder_context();
+    upb::Environment *env = cxt->environment.start(&cxt->status);
+    upb::pb::Decoder *pb_decoder = upb::pb::Decoder::Create(env, shared->pb_decoder_method.get(), &cxt->sink);
+    AV *result = newAV();
+    const char *start = buffer, *end = buffer + bufsize;
+
+    sv_2mortal((SV *) result);
+    while (buffer < end) {
+        uint64_t length;
+        const char *message = read_varint(buffer, end, &length);
+
+        if (!message || length > (uint64_t) (end - message)) {
+            LEAVE;
+            status.SetFormattedErrorMessage(
+                "Truncated length-delimited message at offset %lu",
+                (unsigned long) (buffer - start));
+            return NULL;
+        }
+
+        SV *decoded = decode(cxt, pb_decoder, message, length, input);
+        if (!decoded) {
+            LEAVE;
+            return NULL;
+        }
+        av_push(result, decoded);
+        buffer = message + length;
+    }
+    LEAVE;
+
+    return newRV_inc((SV *) result);
+}
+
+SV *Mapper::decode_json(const char *buffer, STRLEN bufsize) {
+    if (shared->json_decoder_method.get() == NULL)
+        croak("It looks like resolve_references() was not called (and please use map() anyway)");
+    ENTER;
+    DecoderContext *cxt = localized_decoder_context();
+    upb::Environment *env = cxt->environment.start(&cxt->status);
+    upb::json::Parser *json_decoder = upb::json::Parser::Create(env, shared->json_decoder_method.get(), &cxt->json_sink);
+    cxt->callbacks.prepare(newHV(), bufsize);
+
+    SV *result = NULL;
+    if (BufferSource::PutBuffer(buffer, bufsize, json_decoder->input())) {
+        result = newRV_inc(cxt->callbacks.get_target());
+        if (decode_blessed)
+            sv_bless(result, stash);
+    } else {
+        report_decoder_error(cxt);
+    }
+    cxt->callbacks.clear();
+    LEAVE;
+
+    return result;
+}
+
+namespace {
+    const char *skip_group(const char *buffer, const char *end, uint32_t group_number) {
+        while (buffer < end) {
+            uint64_t tag, value;
+
+            if (!(buffer = read_varint(buffer, end, &tag)))
+                return NULL;
+            switch (tag & 7) {
+            case WIRE_VARINT:
+                if (!(buffer = read_varint(buffer, end, &value)))
+                    return NULL;
+                break;
+            case WIRE_FIXED64:
+                if (end - buffer < 8)
+                    return NULL;
+                buffer += 8;
+                break;
+            case WIRE_FIXED32:
+                if (end - buffer < 4)
+                    return NULL;
+                buffer += 4;
+                break;
+            case WIRE_DELIMITED:
+                if (!(buffer = read_varint(buffer, end, &value)) || value > (uint64_t) (end - buffer))
+                    return NULL;
+                buffer += value;
+                break;
+            case WIRE_START_GROUP:
+                if (!(buffer = skip_group(buffer, end, tag >> 3)))
+                    return NULL;
+                break;
+            case WIRE_END_GROUP:
+                return (tag >> 3) == group_number ? buffer : NULL;
+            default:
+                return NULL;
+            }
         }
-    }
 
-    check_required_fields = has_required && options.check_required_fields;
+        return NULL;
+    }
 }
 
-Mapper::~Mapper() {
-    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it)
-        if (it->mapper)
-            it->mapper->unref();
-    for (vector<MapperField *>::iterator it = extension_mapper_fields.begin(), en = extension_mapper_fields.end(); it != en; ++it)
-        // this will make the mapper ref count to go negative, but it's OK
-        (*it)->unref();
-
-    // make sure this only goes away after inner destructors have completed
-    refcounted_mortalize(aTHX_ registry);
-    SvREFCNT_dec(stash);
-}
+// collects the serialized values of lazy fields and the unknown fields
+// of messages preserving them, descending into sub-messages containing
+// either; values are collected in the same order the upb decoder starts
+// the corresponding (sub-)messages
+const char *Mapper::scan_fields(const char *buffer, const char *end, uint32_t group_number, DecoderHandlers *cxt) const {
+    size_t unknown_index = cxt->unknown_fields.size();
+    if (preserve_unknown_fields)
+        cxt->unknown_fields.push_back(UnknownFields());
 
-const char *Mapper::full_name() const {
-    return message_def->full_name();
-}
+    while (buffer < end) {
+        const char *field_start = buffer;
+        uint64_t tag, value;
 
-const char *Mapper::package_name() const {
-    return HvNAME(stash);
-}
+        if (!(buffer = read_varint(buffer, end, &tag)))
+            return NULL;
+        STD_TR1::unordered_map<uint32_t, const Field *>::const_iterator it = fields_by_number.find(tag >> 3);
+        const Field *field = it == fields_by_number.end() ? NULL : it->second;
+        bool scan_sub_message = field && field->mapper && !field->lazy &&
+            (field->mapper->has_lazy_fields || field->mapper->has_unknown_fields);
+
+        switch (tag & 7) {
+        case WIRE_VARINT:
+            if (!(buffer = read_varint(buffer, end, &value)))
+                return NULL;
+            break;
+        case WIRE_FIXED64:
+            if (end - buffer < 8)
+                return NULL;
+            buffer += 8;
+            break;
+        case WIRE_FIXED32:
+            if (end - buffer < 4)
+                return NULL;
+            buffer += 4;
+            break;
+        case WIRE_DELIMITED:
+            if (!(buffer = read_varint(buffer, end, &value)) || value > (uint64_t) (end - buffer))
+                return NULL;
+            if (field && field->descriptor_type == UPB_DESCRIPTOR_TYPE_MESSAGE) {
+                if (field->lazy)
+                    cxt->lazy_values.push_back(LazyValue(buffer, value));
+                else if (scan_sub_message &&
+                             !field->mapper->scan_fields(buffer, buffer + value, 0, cxt))
+                    return NULL;
+            }
+            buffer += value;
+            break;
+        case WIRE_START_GROUP:
+            if (field && field->descriptor_type == UPB_DESCRIPTOR_TYPE_GROUP && scan_sub_message)
+                buffer = field->mapper->scan_fields(buffer, end, tag >> 3, cxt);
+            else
+                buffer = skip_group(buffer, end, tag >> 3);
+            if (!buffer)
+                return NULL;
+            break;
+        case WIRE_END_GROUP:
+            return (tag >> 3) == group_number ? buffer : NULL;
+        default:
+            return NULL;
+        }
 
-MapperField *Mapper::find_extension(const std::string &name) const {
-    for (vector<MapperField *>::const_iterator it = extension_mapper_fields.begin(), en = extension_mapper_fields.end(); it != en; ++it) {
-        if (name == (*it)->name())
-            return *it;
+        if (!field && preserve_unknown_fields)
+            cxt->unknown_fields[unknown_index].append(field_start, buffer - field_start);
     }
 
-    return NULL;
+    return group_number == 0 && buffer == end ? buffer : NULL;
 }
 
-int Mapper::field_count() const {
-    return fields.size();
-}
+namespace {
+    // skips a field value, after its tag
+    const char *skip_value(const char *buffer, const char *end, uint64_t tag) {
+        uint64_t value;
+
+        switch (tag & 7) {
+        case WIRE_VARINT:
+            return read_varint(buffer, end, &value);
+        case WIRE_FIXED64:
+            return end - buffer < 8 ? NULL : buffer + 8;
+        case WIRE_FIXED32:
+            return end - buffer < 4 ? NULL : buffer + 4;
+        case WIRE_DELIMITED:
+            if (!(buffer = read_varint(buffer, end, &value)) || value > (uint64_t) (end - buffer))
+                return NULL;
+            return buffer + value;
+        case WIRE_START_GROUP:
+            return skip_group(buffer, end, tag >> 3);
+        default:
+            return NULL;
+        }
+    }
 
-const Mapper::Field *Mapper::get_field(int index) const {
-    return &fields[index];
-}
+    WireType value_wire_type(FieldDef::DescriptorType type) {
+        switch (type) {
+        case UPB_DESCRIPTOR_TYPE_DOUBLE:
+        case UPB_DESCRIPTOR_TYPE_FIXED64:
+        case UPB_DESCRIPTOR_TYPE_SFIXED64:
+            return WIRE_FIXED64;
+        case UPB_DESCRIPTOR_TYPE_FLOAT:
+        case UPB_DESCRIPTOR_TYPE_FIXED32:
+        case UPB_DESCRIPTOR_TYPE_SFIXED32:
+            return WIRE_FIXED32;
+        case UPB_DESCRIPTOR_TYPE_STRING:
+        case UPB_DESCRIPTOR_TYPE_BYTES:
+        case UPB_DESCRIPTOR_TYPE_MESSAGE:
+            return WIRE_DELIMITED;
+        case UPB_DESCRIPTOR_TYPE_GROUP:
+            return WIRE_START_GROUP;
+        default:
+            return WIRE_VARINT;
+        }
+    }
 
-SV *Mapper::message_descriptor() const {
-    SV *ref = newSV(0);
+    uint64_t read_fixed(const char *buffer, int size) {
+        uint64_t value = 0;
 
-    sv_setref_iv(ref, "Google::ProtocolBuffers::Dynamic::MessageDef", (IV) message_def);
+        for (int i = size - 1; i >= 0; --i)
+            value = (value << 8) | (unsigned char) buffer[i];
 
-    return ref;
+        return value;
+    }
+
+    // reads a single value of a numeric/boolean/enum field
+    const char *parse_scalar(const Mapper::Field &field, const char *buffer, const char *end, Mapper::ParsedValue *value) {
+        uint64_t raw;
+
+        switch (value_wire_type(field.descriptor_type)) {
+        case WIRE_FIXED64:
+            if (end - buffer < 8)
+                return NULL;
+            raw = read_fixed(buffer, 8);
+            if (field.descriptor_type == UPB_DESCRIPTOR_TYPE_DOUBLE)
+                memcpy(&value->nv, &raw, sizeof(value->nv));
+            else
+                value->uv = raw;
+            return buffer + 8;
+        case WIRE_FIXED32: {
+            if (end - buffer < 4)
+                return NULL;
+            uint32_t bits = read_fixed(buffer, 4);
+
+            if (field.descriptor_type == UPB_DESCRIPTOR_TYPE_FLOAT)
+                memcpy(&value->fv, &bits, sizeof(value->fv));
+            else if (field.descriptor_type == UPB_DESCRIPTOR_TYPE_SFIXED32)
+                value->iv = (int32_t) bits;
+            else
+                value->uv = bits;
+            return buffer + 4;
+        }
+        case WIRE_VARINT:
+            if (!(buffer = read_varint(buffer, end, &raw)))
+                return NULL;
+            switch (field.descriptor_type) {
+            case UPB_DESCRIPTOR_TYPE_BOOL:
+                value->bv = raw != 0;
+                break;
+            case UPB_DESCRIPTOR_TYPE_INT32:
+            case UPB_DESCRIPTOR_TYPE_ENUM:
+                value->iv = (int32_t) raw;
+                break;
+            case UPB_DESCRIPTOR_TYPE_UINT32:
+                value->uv = (uint32_t) raw;
+                break;
+            case UPB_DESCRIPTOR_TYPE_SINT32:
+                value->iv = (int32_t) ((uint32_t) raw >> 1) ^ -(int32_t) (raw & 1);
+                break;
+            case UPB_DESCRIPTOR_TYPE_SINT64:
+                value->iv = (int64_t) (raw >> 1) ^ -(int64_t) (raw & 1);
+                break;
+            default:
+                // int64 and uint64, the union makes them equivalent
+                value->uv = raw;
+                break;
+            }
+            return buffer;
+        default:
+            return NULL;
+        }
+    }
 }
 
-SV *Mapper::make_object(SV *data) const {
-    SV *obj = NULL;
+// fills the tree with the values of the message, in wire order; it
+// returns NULL for data it can't parse (including the cases the upb
+// decoder might accept), so callers can fall back to the upb decoder
+const char *Mapper::parse_message(const char *buffer, const char *end, uint32_t group_number, ParsedTree *tree, size_t *message, bool defer_sub_messages) const {
+    size_t start = tree->stack.size();
+    bool group_end = false;
 
-    if (data) {
-        if (!SvROK(data) || SvTYPE(SvRV(data)) != SVt_PVHV)
-            croak("Not an hash reference");
+    while (buffer < end) {
+        const char *field_start = buffer;
+        uint64_t tag, length;
 
-        if (SvTEMP(data) && SvREFCNT(data) == 1) {
-            // steal
-            SvREFCNT_inc(data);
-            obj = data;
-        } else {
-            HV * hv = newHV();
-            sv_2mortal((SV *) hv);
-            HV *orig = (HV *) SvRV(data);
-            I32 keylen;
-            char *key;
-            hv_iterinit(orig);
-            while (SV *sv = hv_iternextsv(orig, &key, &keylen)) {
-                hv_store(hv, key, keylen, newSVsv(sv), 0);
+        if (!(buffer = read_varint(buffer, end, &tag)))
+            return NULL;
+        if ((tag & 7) == WIRE_END_GROUP) {
+            if (!group_number || (tag >> 3) != group_number)
+                return NULL;
+            group_end = true;
+            break;
+        }
+        STD_TR1::unordered_map<uint32_t, const Field *>::const_iterator it = fields_by_number.find(tag >> 3);
+        const Field *field = it == fields_by_number.end() ? NULL : it->second;
+        ParsedValue value;
+
+        value.tree = -1;
+        if (!field) {
+            if (!(buffer = skip_value(buffer, end, tag)))
+                return NULL;
+            if (preserve_unknown_fields) {
+                value.field_index = -1;
+                value.buf = field_start;
+                value.len = buffer - field_start;
+                tree->stack.push_back(value);
             }
-            obj = newRV_inc((SV *) hv);
+            continue;
+        }
+        WireType wire_type = value_wire_type(field->descriptor_type);
+        value.field_index = field - &fields[0];
+
+        if ((tag & 7) == WIRE_DELIMITED) {
+            if (!(buffer = read_varint(buffer, end, &length)) || length > (uint64_t) (end - buffer))
+                return NULL;
+            const char *value_end = buffer + length;
+
+            if (field->descriptor_type == UPB_DESCRIPTOR_TYPE_MESSAGE) {
+                if (field->lazy || defer_sub_messages) {
+                    value.buf = buffer;
+                    value.len = length;
+                } else {
+                    if (field->mapper->parse_message(buffer, value_end, 0, tree, &value.message) != value_end)
+                        return NULL;
+                    value.tree = tree->index;
+                }
+                tree->stack.push_back(value);
+            } else if (wire_type == WIRE_DELIMITED) {
+                value.buf = buffer;
+                value.len = length;
+                tree->stack.push_back(value);
+            } else if (wire_type != WIRE_START_GROUP && field->field_def->label() == UPB_LABEL_REPEATED) {
+                // packed repeated field, accepted also when not declared
+                // as packed
+                for (const char *item = buffer; item < value_end; ) {
+                    if (!(item = parse_scalar(*field, item, value_end, &value)))
+                        return NULL;
+                    tree->stack.push_back(value);
+                }
+            } else {
+                return NULL;
+            }
+            buffer = value_end;
+        } else if ((tag & 7) == WIRE_START_GROUP && wire_type == WIRE_START_GROUP) {
+            if (!(buffer = field->mapper->parse_message(buffer, end, tag >> 3, tree, &value.message)))
+                return NULL;
+            value.tree = tree->index;
+            tree->stack.push_back(value);
+        } else if ((tag & 7) == wire_type && wire_type != WIRE_START_GROUP) {
+            if (!(buffer = parse_scalar(*field, buffer, end, &value)))
+                return NULL;
+            tree->stack.push_back(value);
+        } else {
+            return NULL;
         }
-    } else {
-        obj = newRV_noinc((SV *) newHV());
     }
 
-    if (decode_blessed)
-        sv_bless(obj, stash);
+    if (group_number && !group_end)
+        return NULL;
 
-    return obj;
-}
+    ParsedMessage parsed = { tree->values.size(), tree->stack.size() - start };
 
-void Mapper::resolve_mappers() {
-    for (vector<Field>::iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
-        const FieldDef *field = it->field_def;
+    tree->values.insert(tree->values.end(), tree->stack.begin() + start, tree->stack.end());
+    tree->stack.resize(start);
+    *message = tree->messages.size();
+    tree->messages.push_back(parsed);
 
-        if (field->type() != UPB_TYPE_MESSAGE)
-            continue;
-        it->mapper = registry->find_mapper(field->message_subdef());
-        it->mapper->ref();
-        decoder_handlers->SetSubHandlers(it->field_def, it->mapper->decoder_handlers.get());
-    }
+    return buffer;
 }
 
-void Mapper::create_encoder_decoder() {
-    pb_decoder_method = DecoderMethod::New(DecoderMethodOptions(decoder_handlers.get()));
-    json_decoder_method = ParserMethod::New(message_def);
-    decoder_sink.Reset(decoder_handlers.get(), &decoder_callbacks);
-}
+namespace {
+    // top-level sub-messages parsed by a single job
+    struct ParseBatch {
+        const Mapper *mapper;
+        Mapper::ParsedTree *top, *tree;
+        // range in ParallelDecode::deferred
+        size_t first, last;
+        const vector<size_t> *deferred;
+        bool ok;
+    };
 
-bool Mapper::get_decode_blessed() const {
-    return decode_blessed;
-}
+    struct ParallelDecode {
+        // the first tree holds the top-level message
+        vector<Mapper::ParsedTree> trees;
+        vector<ParseBatch> batches;
+        // indices of the top-level values holding unparsed sub-messages
+        vector<size_t> deferred;
+    };
 
-SV *Mapper::encode(SV *ref) {
-    if (pb_decoder_method.get() == NULL)
-        croak("It looks like resolve_references() was not called (and please use map() anyway)");
-    upb::Environment *env = make_localized_environment(aTHX_ &status);
-    upb::pb::Encoder *pb_encoder = upb::pb::Encoder::Create(env, pb_encoder_handlers.get(), string_sink.input());
-    status.Clear();
-    output_buffer.clear();
-    warn_context->clear();
-    warn_context->localize_warning_handler(aTHX);
-    SV *result = NULL;
+    void delete_parallel_decode(ParallelDecode *decode) {
+        delete decode;
+    }
 
-#if HAS_FULL_NOMG
-    SvGETMAGIC(ref);
-#endif
+    // runs on a worker thread
+    void parse_batch(void *arg) {
+        ParseBatch *batch = (ParseBatch *) arg;
 
-    if (encode_value(pb_encoder->input(), &status, ref))
-        result = newSVpvn(output_buffer.data(), output_buffer.size());
-    output_buffer.clear();
+        batch->ok = true;
+        for (size_t i = batch->first; i < batch->last; ++i) {
+            Mapper::ParsedValue &value = batch->top->values[(*batch->deferred)[i]];
+            const Mapper *mapper = batch->mapper->get_field(value.field_index)->mapper;
+            const char *end = value.buf + value.len;
+            size_t message;
 
-    return result;
+            if (mapper->parse_message(value.buf, end, 0, batch->tree, &message) != end) {
+                batch->ok = false;
+                return;
+            }
+            value.tree = batch->tree->index;
+            value.message = message;
+        }
+    }
 }
 
-SV *Mapper::encode_json(SV *ref) {
-    if (json_decoder_method.get() == NULL)
-        croak("It looks like resolve_references() was not called (and please use map() anyway)");
-    upb::Environment *env = make_localized_environment(aTHX_ &status);
-    upb::json::Printer *json_encoder = upb::json::Printer::Create(env, json_encoder_handlers.get(), string_sink.input());
-    status.Clear();
-    output_buffer.clear();
-    warn_context->clear();
-    warn_context->localize_warning_handler(aTHX);
-    SV *result = NULL;
+// the top-level message is scanned on the calling thread, its
+// sub-messages (for example the elements of a large repeated field) are
+// parsed on worker threads into the Perl-free form, and the Perl values
+// are created by the calling thread; returns false, without side effects,
+// when the data can't be parsed, so upb can report the error
+bool Mapper::decode_parallel(DecoderContext *cxt, const char *buffer, STRLEN bufsize, SV *input, SV **result) {
+    ParallelDecode *decode = new ParallelDecode;
+    size_t message;
+
+    SAVEDESTRUCTOR(delete_parallel_decode, decode);
+    // batch trees are added later, and references must stay valid
+    decode->trees.reserve(decode_threads * BATCHES_PER_THREAD + 1);
+    decode->trees.resize(1);
+    ParsedTree &top = decode->trees[0];
+
+    top.index = 0;
+    if (!parse_message(buffer, buffer + bufsize, 0, &top, &message, true))
+        return false;
 
-#if HAS_FULL_NOMG
-    SvGETMAGIC(ref);
-#endif
+    STRLEN deferred_size = 0;
+    for (size_t i = 0, n = top.values.size(); i < n; ++i) {
+        const ParsedValue &value = top.values[i];
 
-    if (encode_value(json_encoder->input(), &status, ref))
-        result = newSVpvn(output_buffer.data(), output_buffer.size());
-    output_buffer.clear();
+        if (value.field_index == -1 || value.tree != -1)
+            continue;
+        const Field &field = fields[value.field_index];
 
-    return result;
-}
+        if (field.descriptor_type == UPB_DESCRIPTOR_TYPE_MESSAGE && !field.lazy) {
+            decode->deferred.push_back(i);
+            deferred_size += value.len;
+        }
+    }
 
-SV *Mapper::decode(const char *buffer, STRLEN bufsize) {
-    if (pb_decoder_method.get() == NULL)
-        croak("It looks like resolve_references() was not called (and please use map() anyway)");
-    upb::Environment *env = make_localized_environment(aTHX_ &status);
-    upb::pb::Decoder *pb_decoder = upb::pb::Decoder::Create(env, pb_decoder_method.get(), &decoder_sink);
-    status.Clear();
-    pb_decoder->Reset();
-    decoder_callbacks.prepare(newHV());
+    // batches of contiguous sub-messages, of similar size in bytes
+    size_t batch_count = min(decode->deferred.size(), (size_t) decode_threads * BATCHES_PER_THREAD);
+    vector<void *> args;
+
+    decode->trees.resize(batch_count + 1);
+    decode->batches.resize(batch_count);
+    for (size_t i = 0, next = 0, batch_size = 0; i < batch_count; ++i) {
+        ParseBatch &batch = decode->batches[i];
+        // the last batch takes all remaining sub-messages
+        STRLEN limit = i == batch_count - 1 ? deferred_size : deferred_size / batch_count * (i + 1);
+
+        decode->trees[i + 1].index = i + 1;
+        batch.mapper = this;
+        batch.top = &top;
+        batch.tree = &decode->trees[i + 1];
+        batch.deferred = &decode->deferred;
+        batch.first = next;
+        while (next < decode->deferred.size() && (next == batch.first || batch_size < limit))
+            batch_size += top.values[decode->deferred[next++]].len;
+        batch.last = next;
+        args.push_back(&batch);
+    }
+    if (!args.empty())
+        WorkerPool::instance(decode_threads - 1)->run_all(parse_batch, &args[0], args.size());
+    for (size_t i = 0; i < batch_count; ++i) {
+        if (!decode->batches[i].ok)
+            return false;
+    }
+
+    *result = materialize(cxt, decode->trees, message, input, false);
 
+    return true;
+}
+
+SV *Mapper::materialize(DecoderContext *cxt, const vector<ParsedTree> &trees, size_t message, SV *input, bool private_input) {
+    DecoderHandlers &callbacks = cxt->callbacks;
     SV *result = NULL;
-    if (BufferSource::PutBuffer(buffer, bufsize, pb_decoder->input())) {
-        result = newRV_inc(decoder_callbacks.get_target());
+
+    callbacks.set_input(input, private_input);
+    // arrays and maps are sized from the parsed trees
+    callbacks.prepare(newHV(), 0);
+    if (callbacks.materialize(trees, 0, message) &&
+            (!track_seen || callbacks.apply_defaults_and_check())) {
+        result = newRV_inc(callbacks.get_target());
         if (decode_blessed)
             sv_bless(result, stash);
+    } else {
+        report_decoder_error(cxt);
     }
-    decoder_callbacks.clear();
+    callbacks.clear();
 
     return result;
 }
 
-SV *Mapper::decode_json(const char *buffer, STRLEN bufsize) {
-    if (json_decoder_method.get() == NULL)
-        croak("It looks like resolve_references() was not called (and please use map() anyway)");
-    upb::Environment *env = make_localized_environment(aTHX_ &status);
-    upb::json::Parser *json_decoder = upb::json::Parser::Create(env, json_decoder_method.get(), &decoder_sink);
-    status.Clear();
-    decoder_callbacks.prepare(newHV());
-
-    SV *result = NULL;
-    if (BufferSource::PutBuffer(buffer, bufsize, json_decoder->input())) {
-        result = newRV_inc(decoder_callbacks.get_target());
-        if (decode_blessed)
-            sv_bless(result, stash);
-    }
-    decoder_callbacks.clear();
+SV *Mapper::decode_parsed(const vector<ParsedTree> &trees, size_t message, SV *input, bool private_input) {
+    ENTER;
+    DecoderContext *cxt = localized_decoder_context();
+    SV *result = materialize(cxt, trees, message, input, private_input);
+    LEAVE;
 
     return result;
 }
 
 bool Mapper::check(SV *ref) {
-    if (pb_decoder_method.get() == NULL)
+    if (shared->pb_decoder_method.get() == NULL)
         croak("It looks like resolve_references() was not called (and please use map() anyway)");
     status.Clear();
     return check(&status, ref);
 }
 
 const char *Mapper::last_error_message() const {
-    return !decoder_callbacks.error.empty() ? decoder_callbacks.error.c_str() :
-           !status.ok()                     ? status.error_message() :
-                                              "Unknown error";
+    return !status.ok() ? status.error_message() : "Unknown error";
 }
 
 namespace {
@@ -1073,6 +3505,53 @@ namespace {
     #define SvTRUE_enc SvTRUE
 #endif
 
+    typedef WarnContext::MapEntry SortedMapEntry;
+
+    // appends the UTF-8 encoding of a Latin-1 string, like bytes_to_utf8()
+    // but reusing the buffer
+    void append_bytes_as_utf8(string *target, const char *bytes, STRLEN len) {
+        for (const char *end = bytes + len; bytes != end; ++bytes) {
+            U8 c = *bytes;
+
+            if (c < 0x80) {
+                *target += (char) c;
+            } else {
+                *target += (char) (0xc0 | (c >> 6));
+                *target += (char) (0x80 | (c & 0x3f));
+            }
+        }
+    }
+
+    bool is_ascii(const char *bytes, STRLEN len) {
+        for (const char *end = bytes + len; bytes != end; ++bytes)
+            if ((U8) *bytes >= 0x80)
+                return false;
+
+        return true;
+    }
+
+    struct SortedMapEntryLess {
+        FieldDef::Type key_type;
+
+        bool operator()(const SortedMapEntry &a, const SortedMapEntry &b) const {
+            switch (key_type) {
+            case UPB_TYPE_INT32:
+            case UPB_TYPE_INT64:
+                return a.ikey < b.ikey;
+            case UPB_TYPE_UINT32:
+            case UPB_TYPE_UINT64:
+            case UPB_TYPE_BOOL:
+                return a.ukey < b.ukey;
+            default: {
+                // string keys are compared as UTF-8 bytes
+                int cmp = memcmp(a.key, b.key, a.keylen < b.keylen ? a.keylen : b.keylen);
+
+                return cmp < 0 || (cmp == 0 && a.keylen < b.keylen);
+            }
+            }
+        }
+    };
+
     UV key_uv(pTHX_ const char *key, I32 keylen) {
         UV value;
         int numtype = grok_number(key, keylen, &value);
@@ -1142,18 +3621,19 @@ namespace {
 #define DEF_SIMPLE_SETTER(NAME, METHOD, TYPE)   \
     struct NAME { \
         NAME(Status *status) { } \
-        bool operator()(pTHX_ Sink *sink, const Mapper::Field &fd, TYPE value) { \
-            return sink->METHOD(fd.selector.primitive, value);    \
+        template<class W> \
+        bool operator()(pTHX_ W *sink, const Mapper::Field &fd, TYPE value) { \
+            return sink->METHOD(fd, value);    \
         } \
     }
 
-    DEF_SIMPLE_SETTER(Int32Emitter, PutInt32, int32_t);
-    DEF_SIMPLE_SETTER(Int64Emitter, PutInt64, int64_t);
-    DEF_SIMPLE_SETTER(UInt32Emitter, PutUInt32, uint32_t);
-    DEF_SIMPLE_SETTER(UInt64Emitter, PutUInt64, uint64_t);
-    DEF_SIMPLE_SETTER(FloatEmitter, PutFloat, float);
-    DEF_SIMPLE_SETTER(DoubleEmitter, PutDouble, double);
-    DEF_SIMPLE_SETTER(BoolEmitter, PutBool, bool);
+    DEF_SIMPLE_SETTER(Int32Emitter, put_int32, int32_t);
+    DEF_SIMPLE_SETTER(Int64Emitter, put_int64, int64_t);
+    DEF_SIMPLE_SETTER(UInt32Emitter, put_uint32, uint32_t);
+    DEF_SIMPLE_SETTER(UInt64Emitter, put_uint64, uint64_t);
+    DEF_SIMPLE_SETTER(FloatEmitter, put_float, float);
+    DEF_SIMPLE_SETTER(DoubleEmitter, put_double, double);
+    DEF_SIMPLE_SETTER(BoolEmitter, put_bool, bool);
 
 #undef DEF_SIMPLE_SETTER
 
@@ -1162,7 +3642,8 @@ namespace {
 
         EnumEmitter(Status *_status) { status = _status; }
 
-        bool operator()(pTHX_ Sink *sink, const Mapper::Field &fd, int32_t value) {
+        template<class W>
+        bool operator()(pTHX_ W *sink, const Mapper::Field &fd, int32_t value) {
             if (fd.enum_values.find(value) == fd.enum_values.end()) {
                 status->SetFormattedErrorMessage(
                     "Invalid enumeration value %d for field '%s'",
@@ -1172,36 +3653,34 @@ namespace {
                 return false;
             }
 
-            return sink->PutInt32(fd.selector.primitive, value);
+            return sink->put_int32(fd, value);
         }
     };
 
     struct StringEmitter {
         StringEmitter(Status *status) { }
 
-        bool operator()(pTHX_ Sink *sink, const Mapper::Field &fd, SV *value) {
+        template<class W>
+        bool operator()(pTHX_ W *sink, const Mapper::Field &fd, SV *value) {
             STRLEN len;
-            const char *str = fd.field_def->type() == UPB_TYPE_STRING ? SvPVutf8(value, len) : SvPV(value, len);
-            Sink sub;
-            if (!sink->StartString(fd.selector.str_start, len, &sub))
-                return false;
-            sub.PutStringBuffer(fd.selector.str_cont, str, len, NULL);
-            return sink->EndString(fd.selector.str_end);
+            const char *str = fd.value_encoding == Mapper::EncodeString ? SvPVutf8(value, len) : SvPV(value, len);
+            return sink->put_string(fd, str, len);
         }
     };
 }
 
-template<class G, class S>
-bool Mapper::encode_from_array(Sink *sink, Status *status, const Mapper::Field &fd, AV *source) const {
+template<class G, class S, class W>
+bool Mapper::encode_from_array(W *sink, Status *status, const Mapper::Field &fd, AV *source) const {
     G getter;
     S setter(status);
-    Sink sub;
+    W sub;
 
-    if (!sink->StartSequence(fd.selector.seq_start, &sub))
+    if (!sink->start_sequence(fd, &sub))
         return false;
     int size = av_top_index(source) + 1;
 
-    WarnContext::Item &warn_cxt = warn_context->push_level(WarnContext::Array);
+    WarnContext::Item unused_warn_cxt(WarnContext::Array);
+    WarnContext::Item &warn_cxt = warning_context ? warn_context->push_level(WarnContext::Array) : unused_warn_cxt;
     for (int i = 0; i < size; ++i) {
         warn_cxt.index = i;
         SV **item = av_fetch(source, i, 0);
@@ -1217,40 +3696,75 @@ bool Mapper::encode_from_array(Sink *sink, Status *status, const Mapper::Field &
         if (!setter(aTHX_ &sub, fd, getter(aTHX_ *item)))
             return false;
     }
-    warn_context->pop_level();
+    if (warning_context)
+        warn_context->pop_level();
 
-    return sink->EndSequence(fd.selector.seq_end);
+    return sink->end_sequence(fd);
 }
 
-bool Mapper::encode_from_message_array(Sink *sink, Status *status, const Mapper::Field &fd, AV *source) const {
+template<class W>
+bool Mapper::encode_from_message_array(W *sink, Status *status, const Mapper::Field &fd, AV *source) const {
     int size = av_top_index(source) + 1;
-    Sink sub;
+    W sub;
 
-    if (!sink->StartSequence(fd.selector.seq_start, &sub))
+    if (!sink->start_sequence(fd, &sub))
         return false;
 
-    WarnContext::Item &warn_cxt = warn_context->push_level(WarnContext::Array);
+    WarnContext::Item unused_warn_cxt(WarnContext::Array);
+    WarnContext::Item &warn_cxt = warning_context ? warn_context->push_level(WarnContext::Array) : unused_warn_cxt;
     for (int i = 0; i < size; ++i) {
         warn_cxt.index = i;
         SV **item = av_fetch(source, i, 0);
         if (!item)
             return false;
-        Sink submsg;
+        W submsg;
 
 #if HAS_FULL_NOMG
         SvGETMAGIC(*item);
 #endif
 
-        if (!sub.StartSubMessage(fd.selector.msg_start, &submsg))
+        if (fd.lazy && is_lazy_message(aTHX_ *item)) {
+            if (!encode_lazy_message(&sub, status, fd, *item))
+                return false;
+            continue;
+        }
+        if (!sub.start_sub_message(fd, &submsg))
             return false;
         if (!encode_value(&submsg, status, *item))
             return false;
-        if (!sub.EndSubMessage(fd.selector.msg_end))
+        if (!sub.end_sub_message(fd))
             return false;
     }
-    warn_context->pop_level();
+    if (warning_context)
+        warn_context->pop_level();
+
+    return sink->end_sequence(fd);
+}
+
+template<class W>
+bool Mapper::encode_lazy_message(W *sink, Status *status, const Mapper::Field &fd, SV *value) const {
+    STRLEN len;
+    const char *buf = SvPV(value, len);
+
+    if (W::wire_format)
+        return sink->put_message_bytes(fd, buf, len);
+
+    // upb sinks can't take serialized data: decode and encode again
+    SV *decoded = const_cast<Mapper *>(fd.mapper)->decode(buf, len);
+    if (!decoded) {
+        status->SetFormattedErrorMessage(
+            "Invalid serialized value for field '%s'",
+            fd.full_name().c_str());
+        return false;
+    }
+    sv_2mortal(decoded);
 
-    return sink->EndSequence(fd.selector.seq_end);
+    W sub;
+    if (!sink->start_sub_message(fd, &sub))
+        return false;
+    if (!fd.mapper->encode_value(&sub, status, decoded))
+        return false;
+    return sink->end_sub_message(fd);
 }
 
 namespace {
@@ -1262,7 +3776,8 @@ namespace {
     }
 }
 
-bool Mapper::encode_value(Sink *sink, Status *status, SV *ref) const {
+template<class W>
+bool Mapper::encode_value(W *sink, Status *status, SV *ref) const {
 #if !HAS_FULL_NOMG
     SvGETMAGIC(ref);
 #endif
@@ -1271,31 +3786,45 @@ bool Mapper::encode_value(Sink *sink, Status *status, SV *ref) const {
         croak("Not an hash reference when encoding a %s value", message_def->full_name());
     HV *hv = (HV *) SvRV(ref);
 
-    if (!sink->StartMessage())
+    if (!sink->start_message())
         return false;
 
     bool tied = SvTIED_mg((SV *) hv, PERL_MAGIC_tied);
     bool ok = true;
-    WarnContext::Item &warn_cxt = warn_context->push_level(WarnContext::Message);
-    vector<bool> seen_oneof;
-    seen_oneof.resize(message_def->oneof_count());
-    for (vector<Field>::const_iterator it = fields.begin(), en = fields.end(); it != en; ++it) {
-        warn_cxt.field = &*it;
-        HE *he = tied ? hv_fetch_ent_tied(aTHX_ hv, it->name, 0, it->name_hash) :
-                        hv_fetch_ent(hv, it->name, 0, it->name_hash);
+    // with warning_context disabled the field path is tracked but never used
+    WarnContext::Item unused_warn_cxt(WarnContext::Message);
+    WarnContext::Item &warn_cxt = warning_context ? warn_context->push_level(WarnContext::Message) : unused_warn_cxt;
+    // one bit per oneof, on the stack unless the message has many oneofs
+    uint64_t seen_oneof_word = 0;
+    uint64_t *seen_oneof = &seen_oneof_word;
+    bool many_oneofs = message_def->oneof_count() > 64;
+    if (many_oneofs) {
+        vector<uint64_t> &words = warn_context->push_scratch().oneof_words;
+
+        words.assign((message_def->oneof_count() + 63) / 64, 0);
+        seen_oneof = &words[0];
+    }
+    for (vector<EncodeInstruction>::const_iterator it = encode_program.begin(), en = encode_program.end(); it != en; ++it) {
+        const Field &fd = *it->field;
+        warn_cxt.field = &fd;
+        HE *he = tied ? hv_fetch_ent_tied(aTHX_ hv, fd.name, 0, fd.name_hash) :
+                        hv_fetch_ent(hv, fd.name, 0, fd.name_hash);
 
         if (!he) {
-            if (it->field_def->label() == UPB_LABEL_REQUIRED) {
+            if (it->required) {
                 status->SetFormattedErrorMessage(
                     "Missing required field '%s'",
-                    it->full_name().c_str());
+                    fd.full_name().c_str());
                 return false;
             } else
                 continue;
         } else if (it->oneof_index != -1) {
-            if (seen_oneof[it->oneof_index])
+            uint64_t &word = seen_oneof[it->oneof_index >> 6];
+            uint64_t bit = (uint64_t) 1 << (it->oneof_index & 63);
+
+            if (word & bit)
                 continue;
-            seen_oneof[it->oneof_index] = true;
+            word |= bit;
         }
 
         SV *value = HeVAL(he);
@@ -1303,128 +3832,140 @@ bool Mapper::encode_value(Sink *sink, Status *status, SV *ref) const {
         SvGETMAGIC(value);
 #endif
 
-        if (it->is_map)
-            ok = ok && encode_from_perl_hash(sink, status, *it, value);
-        else if (it->field_def->label() == UPB_LABEL_REPEATED)
-            ok = ok && encode_from_perl_array(sink, status, *it, value);
-        else if (encode_defaults || !it->has_default)
-            ok = ok && encode_field(sink, status, *it, value);
-        else
-            ok = ok && encode_field_nodefaults(sink, status, *it, value);
+        switch (it->action) {
+        case EncodeInstruction::EncodeSingle:
+            ok = ok && encode_field(sink, status, fd, value);
+            break;
+        case EncodeInstruction::EncodeSingleNoDefault:
+            ok = ok && encode_field_nodefaults(sink, status, fd, value);
+            break;
+        case EncodeInstruction::EncodeRepeated:
+            ok = ok && encode_from_perl_array(sink, status, fd, value);
+            break;
+        case EncodeInstruction::EncodeMap:
+            ok = ok && encode_from_perl_hash(sink, status, fd, value);
+            break;
+        }
+    }
+    if (many_oneofs)
+        warn_context->pop_scratch();
+    if (warning_context)
+        warn_context->pop_level();
+
+    if (preserve_unknown_fields && ok) {
+        if (SV *unknown = find_unknown_fields(aTHX_ hv)) {
+            STRLEN len;
+            const char *buf = SvPV(unknown, len);
+
+            ok = sink->put_unknown_fields(buf, len);
+        }
     }
-    warn_context->pop_level();
 
-    if (!sink->EndMessage(status))
+    if (!sink->end_message(status))
         return false;
 
     return ok;
 }
 
-bool Mapper::encode_field(Sink *sink, Status *status, const Field &fd, SV *ref) const {
-    int field_type = fd.field_def->type();
-
-    if (fail_ref_coercion && field_type != UPB_TYPE_MESSAGE && is_coerced_ref(aTHX_ status, fd, ref))
+template<class W>
+bool Mapper::encode_field(W *sink, Status *status, const Field &fd, SV *ref) const {
+    if (fail_ref_coercion && fd.value_encoding != EncodeMessage && is_coerced_ref(aTHX_ status, fd, ref))
         return false;
 
-    switch (field_type) {
-    case UPB_TYPE_FLOAT:
-        return sink->PutFloat(fd.selector.primitive, SvNV_enc(ref));
-    case UPB_TYPE_DOUBLE:
-        return sink->PutDouble(fd.selector.primitive, SvNV_enc(ref));
-    case UPB_TYPE_BOOL:
-        return sink->PutBool(fd.selector.primitive, SvTRUE_enc(ref));
-    case UPB_TYPE_STRING:
-    case UPB_TYPE_BYTES: {
+    switch (fd.value_encoding) {
+    case EncodeFloat:
+        return sink->put_float(fd, SvNV_enc(ref));
+    case EncodeDouble:
+        return sink->put_double(fd, SvNV_enc(ref));
+    case EncodeBool:
+        return sink->put_bool(fd, SvTRUE_enc(ref));
+    case EncodeString:
+    case EncodeBytes: {
         STRLEN len;
-        const char *str = fd.field_def->type() == UPB_TYPE_STRING ? SvPVutf8_enc(ref, len) : SvPV_enc(ref, len);
-        Sink sub;
-        if (!sink->StartString(fd.selector.str_start, len, &sub))
-            return false;
-        sub.PutStringBuffer(fd.selector.str_cont, str, len, NULL);
-        return sink->EndString(fd.selector.str_end);
+        const char *str = fd.value_encoding == EncodeString ? SvPVutf8_enc(ref, len) : SvPV_enc(ref, len);
+        return sink->put_string(fd, str, len);
     }
-    case UPB_TYPE_MESSAGE: {
-        Sink sub;
-        if (!sink->StartSubMessage(fd.selector.msg_start, &sub))
+    case EncodeMessage: {
+        if (fd.lazy && is_lazy_message(aTHX_ ref))
+            return encode_lazy_message(sink, status, fd, ref);
+        W sub;
+        if (!sink->start_sub_message(fd, &sub))
             return false;
         if (!fd.mapper->encode_value(&sub, status, ref))
             return false;
-        return sink->EndSubMessage(fd.selector.msg_end);
+        return sink->end_sub_message(fd);
     }
-    case UPB_TYPE_ENUM: {
+    case EncodeEnum:
+        return sink->put_int32(fd, SvIV_enc(ref));
+    case EncodeCheckedEnum: {
         IV value = SvIV_enc(ref);
-        if (check_enum_values &&
-                fd.enum_values.find(value) == fd.enum_values.end()) {
+        if (fd.enum_values.find(value) == fd.enum_values.end()) {
             status->SetFormattedErrorMessage(
                 "Invalid enumeration value %d for field '%s'",
                 value,
                 fd.full_name().c_str()
-            );
-            return false;
-        }
-
-        return sink->PutInt32(fd.selector.primitive, value);
-    }
-    case UPB_TYPE_INT32:
-        return sink->PutInt32(fd.selector.primitive, SvIV_enc(ref));
-    case UPB_TYPE_UINT32:
-        return sink->PutUInt32(fd.selector.primitive, SvUV_enc(ref));
-    case UPB_TYPE_INT64:
-        if (sizeof(IV) >= sizeof(int64_t))
-            return sink->PutInt64(fd.selector.primitive, SvIV_enc(ref));
-        else
-            return sink->PutInt64(fd.selector.primitive, SvIV64_enc(ref));
-    case UPB_TYPE_UINT64:
-        if (sizeof(UV) >= sizeof(int64_t))
-            return sink->PutInt64(fd.selector.primitive, SvUV_enc(ref));
-        else
-            return sink->PutUInt64(fd.selector.primitive, SvUV64_enc(ref));
+            );
+            return false;
+        }
+
+        return sink->put_int32(fd, value);
+    }
+    case EncodeInt32:
+        return sink->put_int32(fd, SvIV_enc(ref));
+    case EncodeUInt32:
+        return sink->put_uint32(fd, SvUV_enc(ref));
+    case EncodeInt64:
+        return sink->put_int64(fd, SvIV_enc(ref));
+    case EncodeBigInt64:
+        return sink->put_int64(fd, SvIV64_enc(ref));
+    case EncodeUInt64:
+        return sink->put_int64(fd, SvUV_enc(ref));
+    case EncodeBigUInt64:
+        return sink->put_uint64(fd, SvUV64_enc(ref));
     default:
         return false; // just in case
     }
 }
 
-bool Mapper::encode_field_nodefaults(Sink *sink, Status *status, const Field &fd, SV *ref) const {
+template<class W>
+bool Mapper::encode_field_nodefaults(W *sink, Status *status, const Field &fd, SV *ref) const {
     if (fail_ref_coercion && is_coerced_ref(aTHX_ status, fd, ref))
         return false;
 
-    switch (fd.field_def->type()) {
-    case UPB_TYPE_FLOAT: {
+    switch (fd.value_encoding) {
+    case EncodeFloat: {
         NV value = SvNV_enc(ref);
         if (value == fd.default_nv)
             return true;
-        return sink->PutFloat(fd.selector.primitive, value);
+        return sink->put_float(fd, value);
     }
-    case UPB_TYPE_DOUBLE: {
+    case EncodeDouble: {
         NV value = SvNV_enc(ref);
         if (value == fd.default_nv)
             return true;
-        return sink->PutDouble(fd.selector.primitive, value);
+        return sink->put_double(fd, value);
     }
-    case UPB_TYPE_BOOL: {
+    case EncodeBool: {
         bool value = SvTRUE_enc(ref);
         if (value == fd.default_bool)
             return true;
-        return sink->PutBool(fd.selector.primitive, value);
+        return sink->put_bool(fd, value);
     }
-    case UPB_TYPE_STRING:
-    case UPB_TYPE_BYTES: {
+    case EncodeString:
+    case EncodeBytes: {
         STRLEN len;
-        const char *str = fd.field_def->type() == UPB_TYPE_STRING ? SvPVutf8_enc(ref, len) : SvPV_enc(ref, len);
+        const char *str = fd.value_encoding == EncodeString ? SvPVutf8_enc(ref, len) : SvPV_enc(ref, len);
         if (len == fd.default_str_len &&
                 (len == 0 || memcmp(str, fd.default_str, len) == 0))
             return true;
-        Sink sub;
-        if (!sink->StartString(fd.selector.str_start, len, &sub))
-            return false;
-        sub.PutStringBuffer(fd.selector.str_cont, str, len, NULL);
-        return sink->EndString(fd.selector.str_end);
+        return sink->put_string(fd, str, len);
     }
-    case UPB_TYPE_ENUM: {
+    case EncodeEnum:
+    case EncodeCheckedEnum: {
         IV value = SvIV_enc(ref);
         if (value == fd.default_iv)
             return true;
-        if (check_enum_values &&
+        if (fd.value_encoding == EncodeCheckedEnum &&
                 fd.enum_values.find(value) == fd.enum_values.end()) {
             status->SetFormattedErrorMessage(
                 "Invalid enumeration value %d for field '%s'",
@@ -1434,66 +3975,81 @@ bool Mapper::encode_field_nodefaults(Sink *sink, Status *status, const Field &fd
             return false;
         }
 
-        return sink->PutInt32(fd.selector.primitive, value);
+        return sink->put_int32(fd, value);
     }
-    case UPB_TYPE_INT32: {
+    case EncodeInt32: {
         IV value = SvIV_enc(ref);
         if (value == fd.default_iv)
             return true;
-        return sink->PutInt32(fd.selector.primitive, value);
+        return sink->put_int32(fd, value);
     }
-    case UPB_TYPE_UINT32: {
+    case EncodeUInt32: {
         UV value = SvUV_enc(ref);
         if (value == fd.default_uv)
             return true;
-        return sink->PutUInt32(fd.selector.primitive, value);
+        return sink->put_uint32(fd, value);
     }
-    case UPB_TYPE_INT64: {
-        int64_t value = sizeof(IV) >= sizeof(int64_t) ? SvIV_enc(ref) : SvIV64_enc(ref);
+    case EncodeInt64:
+    case EncodeBigInt64: {
+        int64_t value = fd.value_encoding == EncodeInt64 ? SvIV_enc(ref) : SvIV64_enc(ref);
         if (value == fd.default_i64)
             return true;
-        return sink->PutInt64(fd.selector.primitive, value);
+        return sink->put_int64(fd, value);
     }
-    case UPB_TYPE_UINT64: {
-        uint64_t value = sizeof(UV) >= sizeof(int64_t) ? SvUV_enc(ref) : SvUV64_enc(ref);
+    case EncodeUInt64:
+    case EncodeBigUInt64: {
+        uint64_t value = fd.value_encoding == EncodeUInt64 ? SvUV_enc(ref) : SvUV64_enc(ref);
         if (value == fd.default_u64)
             return true;
-        return sink->PutUInt64(fd.selector.primitive, value);
+        return sink->put_uint64(fd, value);
     }
     default:
         return false; // just in case
     }
 }
 
-bool Mapper::encode_key(Sink *sink, Status *status, const Field &fd, const char *key, I32 keylen) const {
+template<class W>
+bool Mapper::encode_key(W *sink, Status *status, const Field &fd, const char *key, I32 keylen) const {
     switch (fd.field_def->type()) {
     case UPB_TYPE_BOOL: {
         // follows what SvTRUE() does for strings
         bool bval = keylen > 1 || (keylen == 1 && key[0] != '0');
-        return sink->PutBool(fd.selector.primitive, bval);
+        return sink->put_bool(fd, bval);
     }
     case UPB_TYPE_STRING: {
-        Sink sub;
-        if (!sink->StartString(fd.selector.str_start, keylen, &sub))
-            return false;
-        sub.PutStringBuffer(fd.selector.str_cont, key, keylen, NULL);
-        return sink->EndString(fd.selector.str_end);
+        return sink->put_string(fd, key, keylen);
     }
     case UPB_TYPE_INT32:
-        return sink->PutInt32(fd.selector.primitive, key_iv(aTHX_ key, keylen));
+        return sink->put_int32(fd, key_iv(aTHX_ key, keylen));
     case UPB_TYPE_UINT32:
-        return sink->PutUInt32(fd.selector.primitive, key_uv(aTHX_ key, keylen));
+        return sink->put_uint32(fd, key_uv(aTHX_ key, keylen));
     case UPB_TYPE_INT64:
-        return sink->PutInt64(fd.selector.primitive, key_iv(aTHX_ key, keylen));
+        return sink->put_int64(fd, key_iv(aTHX_ key, keylen));
     case UPB_TYPE_UINT64:
-        return sink->PutInt64(fd.selector.primitive, key_uv(aTHX_ key, keylen));
+        return sink->put_int64(fd, key_uv(aTHX_ key, keylen));
     default:
         return false; // just in case
     }
 }
 
-bool Mapper::encode_hash_kv(Sink *sink, Status *status, const char *key, STRLEN keylen, SV *value) const {
-    if (!sink->StartMessage())
+template<class W>
+bool Mapper::encode_map_entry(W *sink, Status *status, const Field &fd, const char *key, STRLEN keylen, SV *value) const {
+    W key_value;
+
+#if HAS_FULL_NOMG
+    SvGETMAGIC(value);
+#endif
+
+    if (!sink->start_sub_message(fd, &key_value))
+        return false;
+    if (!fd.mapper->encode_hash_kv(&key_value, status, key, keylen, value))
+        return false;
+    return sink->end_sub_message(fd);
+}
+
+template<class W>
+bool Mapper::encode_hash_kv(W *sink, Status *status, const char *key, STRLEN keylen, SV *value) const {
+    if (!sink->start_message())
         return false;
     if (fields[0].is_key) {
         if (!encode_key(sink, status, fields[0], key, keylen))
@@ -1506,12 +4062,13 @@ bool Mapper::encode_hash_kv(Sink *sink, Status *status, const char *key, STRLEN
         if (!encode_field(sink, status, fields[0], value))
             return false;
     }
-    if (!sink->EndMessage(status))
+    if (!sink->end_message(status))
         return false;
     return true;
 }
 
-bool Mapper::encode_from_perl_hash(Sink *sink, Status *status, const Field &fd, SV *ref) const {
+template<class W>
+bool Mapper::encode_from_perl_hash(W *sink, Status *status, const Field &fd, SV *ref) const {
 #if !HAS_FULL_NOMG
     SvGETMAGIC(ref);
 #endif
@@ -1519,53 +4076,90 @@ bool Mapper::encode_from_perl_hash(Sink *sink, Status *status, const Field &fd,
     if (!SvROK(ref) || SvTYPE(SvRV(ref)) != SVt_PVHV)
         croak("Not an hash reference when encoding field '%s'", fd.full_name().c_str());
     HV *hash = (HV *) SvRV(ref);
-    Sink repeated;
+    W repeated;
 
-    if (!sink->StartSequence(fd.selector.seq_start, &repeated))
+    if (!sink->start_sequence(fd, &repeated))
         return false;
 
     hv_iterinit(hash);
-    WarnContext::Item &warn_cxt = warn_context->push_level(WarnContext::Hash);
+    WarnContext::Item unused_warn_cxt(WarnContext::Hash);
+    WarnContext::Item &warn_cxt = warning_context ? warn_context->push_level(WarnContext::Hash) : unused_warn_cxt;
+    // with deterministic output, entries are sorted by key before encoding;
+    // nested maps use the next scratch level, so these are not overwritten
+    WarnContext::Scratch &scratch = warn_context->push_scratch();
+    vector<SortedMapEntry> &sorted = scratch.map_entries;
+    string &keys = scratch.map_keys;
+    sorted.clear();
+    keys.clear();
+    const Field &key_field = fd.mapper->fields[0].is_key ? fd.mapper->fields[0] : fd.mapper->fields[1];
+    FieldDef::Type key_type = key_field.field_def->type();
     while (HE *entry = hv_iternext(hash)) {
-        Sink key_value;
         SV *value = HeVAL(entry);
         const char *key;
-        STRLEN keylen;
-        bool needs_free = false;
+        STRLEN keylen, key_offset = 0;
+        bool copied = false;
 
         if (HeKLEN(entry) == HEf_SVKEY) {
             key = SvPVutf8(HeKEY_sv(entry), keylen);
         } else {
-            if (HeKUTF8(entry)) {
-                key = HeKEY(entry);
-                keylen = HeKLEN(entry);
-            } else {
-                keylen = HeKLEN(entry);
-                key = (const char *) bytes_to_utf8((U8*) HeKEY(entry), &keylen);
-                SAVEFREEPV(key);
+            key = HeKEY(entry);
+            keylen = HeKLEN(entry);
+            if (!HeKUTF8(entry) && !is_ascii(key, keylen)) {
+                if (!deterministic)
+                    keys.clear();
+                key_offset = keys.size();
+                copied = true;
+                append_bytes_as_utf8(&keys, key, keylen);
+                key = keys.data() + key_offset;
+                keylen = keys.size() - key_offset;
             }
         }
 
-        warn_cxt.key = key;
-        warn_cxt.keylen = keylen;
+        if (deterministic) {
+            // appending more keys can move the buffer, so the key pointer
+            // is set after all keys have been copied
+            SortedMapEntry sorted_entry = { copied ? NULL : key, keylen, key_offset, value, 0, 0 };
 
-#if HAS_FULL_NOMG
-        SvGETMAGIC(value);
-#endif
+            if (key_type == UPB_TYPE_INT32 || key_type == UPB_TYPE_INT64)
+                sorted_entry.ikey = key_iv(aTHX_ key, keylen);
+            else if (key_type == UPB_TYPE_UINT32 || key_type == UPB_TYPE_UINT64)
+                sorted_entry.ukey = key_uv(aTHX_ key, keylen);
+            else if (key_type == UPB_TYPE_BOOL)
+                sorted_entry.ukey = keylen > 1 || (keylen == 1 && key[0] != '0');
+            sorted.push_back(sorted_entry);
 
-        if (!repeated.StartSubMessage(fd.selector.msg_start, &key_value))
-            return false;
-        if (!fd.mapper->encode_hash_kv(&key_value, status, key, keylen, value))
-            return false;
-        if (!repeated.EndSubMessage(fd.selector.msg_end))
+            continue;
+        }
+
+        warn_cxt.key = key;
+        warn_cxt.keylen = keylen;
+        if (!encode_map_entry(&repeated, status, fd, key, keylen, value))
             return false;
     }
-    warn_context->pop_level();
 
-    return sink->EndSequence(fd.selector.seq_end);
+    if (deterministic) {
+        SortedMapEntryLess less = { key_type };
+
+        for (vector<SortedMapEntry>::iterator it = sorted.begin(), en = sorted.end(); it != en; ++it)
+            if (!it->key)
+                it->key = keys.data() + it->key_offset;
+        sort(sorted.begin(), sorted.end(), less);
+        for (vector<SortedMapEntry>::iterator it = sorted.begin(), en = sorted.end(); it != en; ++it) {
+            warn_cxt.key = it->key;
+            warn_cxt.keylen = it->keylen;
+            if (!encode_map_entry(&repeated, status, fd, it->key, it->keylen, it->value))
+                return false;
+        }
+    }
+    warn_context->pop_scratch();
+    if (warning_context)
+        warn_context->pop_level();
+
+    return sink->end_sequence(fd);
 }
 
-bool Mapper::encode_from_perl_array(Sink *sink, Status *status, const Field &fd, SV *ref) const {
+template<class W>
+bool Mapper::encode_from_perl_array(W *sink, Status *status, const Field &fd, SV *ref) const {
 #if !HAS_FULL_NOMG
     SvGETMAGIC(ref);
 #endif
@@ -1573,38 +4167,33 @@ bool Mapper::encode_from_perl_array(Sink *sink, Status *status, const Field &fd,
         croak("Not an array reference when encoding field '%s'", fd.full_name().c_str());
     AV *array = (AV *) SvRV(ref);
 
-    switch (fd.field_def->type()) {
-    case UPB_TYPE_FLOAT:
+    switch (fd.value_encoding) {
+    case EncodeFloat:
         return encode_from_array<NVGetter, FloatEmitter>(sink, status, fd, array);
-    case UPB_TYPE_DOUBLE:
+    case EncodeDouble:
         return encode_from_array<NVGetter, DoubleEmitter>(sink, status, fd, array);
-    case UPB_TYPE_BOOL:
+    case EncodeBool:
         return encode_from_array<BoolGetter, BoolEmitter>(sink, status, fd, array);
-    case UPB_TYPE_STRING:
+    case EncodeString:
+    case EncodeBytes:
         return encode_from_array<SVGetter, StringEmitter>(sink, status, fd, array);
-    case UPB_TYPE_BYTES:
-        return encode_from_array<SVGetter, StringEmitter>(sink, status, fd, array);
-    case UPB_TYPE_MESSAGE:
+    case EncodeMessage:
         return fd.mapper->encode_from_message_array(sink, status, fd, array);
-    case UPB_TYPE_ENUM:
-        if (check_enum_values)
-            return encode_from_array<IVGetter, EnumEmitter>(sink, status, fd, array);
-        else
-            return encode_from_array<IVGetter, Int32Emitter>(sink, status, fd, array);
-    case UPB_TYPE_INT32:
+    case EncodeCheckedEnum:
+        return encode_from_array<IVGetter, EnumEmitter>(sink, status, fd, array);
+    case EncodeEnum:
+    case EncodeInt32:
         return encode_from_array<IVGetter, Int32Emitter>(sink, status, fd, array);
-    case UPB_TYPE_UINT32:
+    case EncodeUInt32:
         return encode_from_array<UVGetter, UInt32Emitter>(sink, status, fd, array);
-    case UPB_TYPE_INT64:
-        if (sizeof(IV) >= sizeof(int64_t))
-            return encode_from_array<IVGetter, Int64Emitter>(sink, status, fd, array);
-        else
-            return encode_from_array<I64Getter, Int64Emitter>(sink, status, fd, array);
-    case UPB_TYPE_UINT64:
-        if (sizeof(IV) >= sizeof(int64_t))
-            return encode_from_array<UVGetter, UInt64Emitter>(sink, status, fd, array);
-        else
-            return encode_from_array<U64Getter, UInt64Emitter>(sink, status, fd, array);
+    case EncodeInt64:
+        return encode_from_array<IVGetter, Int64Emitter>(sink, status, fd, array);
+    case EncodeBigInt64:
+        return encode_from_array<I64Getter, Int64Emitter>(sink, status, fd, array);
+    case EncodeUInt64:
+        return encode_from_array<UVGetter, UInt64Emitter>(sink, status, fd, array);
+    case EncodeBigUInt64:
+        return encode_from_array<U64Getter, UInt64Emitter>(sink, status, fd, array);
     default:
         return false; // just in case
     }
@@ -1620,6 +4209,8 @@ bool Mapper::check_from_message_array(Status *status, const Mapper::Field &fd, A
 
         SvGETMAGIC(*item);
 
+        if (fd.lazy && is_lazy_message(aTHX_ *item))
+            continue;
         if (!check(status, *item))
             return false;
     }
@@ -1686,6 +4277,8 @@ bool Mapper::check(Status *status, SV *ref) const {
 bool Mapper::check(Status *status, const Field &fd, SV *ref) const {
     switch (fd.field_def->type()) {
     case UPB_TYPE_MESSAGE:
+        if (fd.lazy && is_lazy_message(aTHX_ ref))
+            return true;
         return fd.mapper->check(status, ref);
     case UPB_TYPE_ENUM: {
         if (!check_enum_values)
@@ -1731,6 +4324,351 @@ bool Mapper::check_from_perl_array(Status *status, const Field &fd, SV *ref) con
     }
 }
 
+StreamDecoder::StreamDecoder(pTHX_ Mapper *_mapper) :
+        mapper(_mapper),
+        pending_offset(0),
+        chunk(NULL),
+        chunk_offset(0) {
+    SET_THX_MEMBER;
+
+    mapper->ref();
+    decoder_context = mapper->acquire_decoder_context();
+    pb_decoder = NULL;
+}
+
+void StreamDecoder::start() {
+    pb_decoder = mapper->create_pb_decoder(&env, decoder_context);
+}
+
+StreamDecoder::~StreamDecoder() {
+    SvREFCNT_dec(chunk);
+    mapper->release_decoder_context(decoder_context);
+    mapper->unref();
+}
+
+void StreamDecoder::feed(SV *new_chunk) {
+    // unconsumed data from the previous chunk, if any, is copied in the
+    // pending buffer
+    stash_chunk();
+
+    STRLEN len;
+    SvPV(new_chunk, len);
+    if (len) {
+        // with copy-on-write this does not copy the string buffer, and
+        // protects against the caller modifying the scalar
+        chunk = newSVsv(new_chunk);
+        chunk_offset = 0;
+    }
+}
+
+IV StreamDecoder::feed_from(SV *fh, IV size) {
+    PerlIO *io = IoIFP(sv_2io(fh));
+
+    if (!io)
+        croak("Reading from a closed filehandle");
+    if (size < 0)
+        croak("Invalid negative size %" IVdf, size);
+    stash_chunk();
+
+    // reads straight in the pending buffer
+    size_t offset = pending.size();
+    pending.resize(offset + size);
+    SSize_t count = PerlIO_read(io, &pending[offset], size);
+    pending.resize(offset + (count > 0 ? count : 0));
+
+    if (count < 0)
+        croak("Error reading from filehandle: %s", Strerror(errno));
+
+    return count;
+}
+
+void StreamDecoder::stash_chunk() {
+    // drops the messages already decoded from the pending buffer, once per
+    // chunk, before appending to it
+    if (pending_offset) {
+        pending.erase(0, pending_offset);
+        pending_offset = 0;
+    }
+    if (!chunk)
+        return;
+
+    STRLEN len;
+    const char *buffer = SvPV(chunk, len);
+
+    if (chunk_offset < len)
+        pending.append(buffer + chunk_offset, len - chunk_offset);
+    SvREFCNT_dec(chunk);
+    chunk = NULL;
+    chunk_offset = 0;
+}
+
+IV StreamDecoder::pending_bytes() const {
+    STRLEN len = 0;
+
+    if (chunk)
+        SvPV(chunk, len);
+
+    return (pending.size() - pending_offset) + (len - chunk_offset);
+}
+
+SV *StreamDecoder::next_message() {
+    STRLEN chunk_len = 0;
+    const char *chunk_buffer = chunk ? SvPV(chunk, chunk_len) : NULL;
+
+    if (pending_offset < pending.size()) {
+        // complete the partial message using the current chunk, copying
+        // at most the bytes needed by the message
+        for (;;) {
+            uint64_t length;
+            const char *data = pending.data() + pending_offset;
+            size_t available = pending.size() - pending_offset;
+            const char *message = read_varint(data, data + available, &length);
+
+            if (message) {
+                if (length > MAX_MESSAGE_LENGTH)
+                    croak("Deserialization failed: Invalid length prefix");
+                size_t total = (message - data) + length;
+
+                if (available < total) {
+                    size_t take = min(total - available, (size_t) (chunk_len - chunk_offset));
+
+                    pending.append(chunk_buffer + chunk_offset, take);
+                    chunk_offset += take;
+                    available += take;
+                    if (available < total)
+                        break;
+                    data = pending.data() + pending_offset;
+                    message = data + (total - length);
+                }
+
+                // consumed before decoding, like in the branch below; the
+                // buffer is compacted when exhausted or before appending to it
+                pending_offset += total;
+                SV *result = decode_message(message, length, NULL);
+                if (pending_offset == pending.size()) {
+                    pending.clear();
+                    pending_offset = 0;
+                }
+
+                return result;
+            } else if (available >= 10) {
+                croak("Deserialization failed: Invalid length prefix");
+            } else if (chunk_offset < chunk_len) {
+                pending.push_back(chunk_buffer[chunk_offset++]);
+            } else {
+                break;
+            }
+        }
+    } else if (chunk_offset < chunk_len) {
+        // decode straight from the chunk when the message is complete
+        uint64_t length;
+        const char *data = chunk_buffer + chunk_offset, *end = chunk_buffer + chunk_len;
+        const char *message = read_varint(data, end, &length);
+
+        if (message && length > MAX_MESSAGE_LENGTH) {
+            croak("Deserialization failed: Invalid length prefix");
+        } else if (message && length <= (uint64_t) (end - message)) {
+            chunk_offset = (message + length) - chunk_buffer;
+
+            return decode_message(message, length, chunk);
+        } else if (!message && end - data >= 10) {
+            croak("Deserialization failed: Invalid length prefix");
+        }
+    }
+
+    // not enough data for a full message
+    stash_chunk();
+
+    return &PL_sv_undef;
+}
+
+namespace {
+    void release_decoder_input(pTHX_ void *ptr) {
+        ((Mapper::DecoderContext *) ptr)->release_input();
+    }
+}
+
+SV *StreamDecoder::decode_message(const char *buffer, STRLEN bufsize, SV *input) {
+    // the context outlives the call, so the input is released when the
+    // scope is left, also when decoding dies
+    ENTER;
+    SAVEDESTRUCTOR_X(release_decoder_input, decoder_context);
+    SV *result = mapper->decode(decoder_context, pb_decoder, buffer, bufsize, input, true);
+    LEAVE;
+
+    if (!result)
+        croak("Deserialization failed: %s", mapper->last_error_message());
+
+    return result;
+}
+
+struct AsyncDecode::Job {
+    const Mapper *mapper;
+    const char *buffer;
+    STRLEN bufsize;
+    vector<Mapper::ParsedTree> trees;
+    size_t message;
+    bool parsed;
+    // the read end is watched by the caller, the worker writes a byte to
+    // the other end when done
+    int fds[2];
+};
+
+AsyncDecode::AsyncDecode(pTHX_ Mapper *_mapper, SV *scalar) :
+        mapper(_mapper),
+        job(new Job()),
+        pid(0),
+        started(false),
+        completed(false),
+        decoded(NULL) {
+    SET_THX_MEMBER;
+
+    mapper->ref();
+    // with copy-on-write this does not copy the string buffer, and
+    // protects against the caller modifying the scalar
+    input = newSVsv(scalar);
+    job->mapper = mapper;
+    job->buffer = SvPV(input, job->bufsize);
+    job->fds[0] = job->fds[1] = -1;
+}
+
+AsyncDecode::~AsyncDecode() {
+#ifdef GPD_WORKER_THREADS
+    // the worker thread uses the job and the input buffer (there is no
+    // worker thread in a child process)
+    if (started && !completed) {
+        if (getpid() == pid)
+            wait();
+        else
+            abandon_job();
+    }
+    if (job->fds[0] != -1) {
+        close(job->fds[0]);
+        close(job->fds[1]);
+    }
+#endif
+    delete job;
+    SvREFCNT_dec(decoded);
+    SvREFCNT_dec(input);
+    mapper->unref();
+}
+
+void AsyncDecode::start() {
+#ifdef GPD_WORKER_THREADS
+    if (pipe(job->fds)) {
+        job->fds[0] = job->fds[1] = -1;
+        croak("Unable to create a pipe: %s", Strerror(errno));
+    }
+    fcntl(job->fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(job->fds[1], F_SETFD, FD_CLOEXEC);
+    pid = getpid();
+    started = true;
+    WorkerPool::instance(1)->submit(run, job);
+#else
+    parse(job);
+    completed = true;
+#endif
+}
+
+SV *AsyncDecode::fileno() const {
+    return job->fds[0] == -1 ? &PL_sv_undef : newSViv(job->fds[0]);
+}
+
+// does not use the Perl API, runs on a worker thread
+bool AsyncDecode::parse(Job *job) {
+    const char *end = job->buffer + job->bufsize;
+
+    job->trees.resize(1);
+    job->trees[0].index = 0;
+    job->parsed = job->mapper->parse_message(job->buffer, end, 0, &job->trees[0], &job->message) == end;
+
+    return job->parsed;
+}
+
+void AsyncDecode::run(void *arg) {
+    Job *job = (Job *) arg;
+
+    parse(job);
+#ifdef GPD_WORKER_THREADS
+    char done = 1;
+
+    // the write/read pair also makes the parsed tree visible to the
+    // calling thread
+    while (write(job->fds[1], &done, 1) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+void AsyncDecode::wait() {
+    if (completed || !started)
+        return;
+#ifdef GPD_WORKER_THREADS
+    if (getpid() != pid) {
+        // in a child process the job is not running anymore, and the
+        // byte written to the pipe might be read by the parent
+        abandon_job();
+        parse(job);
+    } else {
+        char done;
+
+        while (read(job->fds[0], &done, 1) < 0 && errno == EINTR)
+            ;
+    }
+#endif
+    completed = true;
+}
+
+// the worker might have been modifying the parsed trees when the process
+// forked, so in the child they are left alone (and leaked) and replaced
+// by an empty job for the same input
+void AsyncDecode::abandon_job() {
+    Job *fresh = new Job();
+
+    fresh->mapper = job->mapper;
+    fresh->buffer = job->buffer;
+    fresh->bufsize = job->bufsize;
+    fresh->parsed = false;
+    fresh->fds[0] = job->fds[0];
+    fresh->fds[1] = job->fds[1];
+    job = fresh;
+}
+
+bool AsyncDecode::is_ready() {
+    if (completed || !started)
+        return true;
+#ifdef GPD_WORKER_THREADS
+    // result() parses the input on the calling thread
+    if (getpid() != pid)
+        return true;
+
+    struct pollfd fd = { job->fds[0], POLLIN, 0 };
+
+    return poll(&fd, 1, 0) == 1;
+#else
+    return true;
+#endif
+}
+
+SV *AsyncDecode::result() {
+    if (!decoded) {
+        wait();
+        if (job->parsed)
+            decoded = mapper->decode_parsed(job->trees, job->message, input, true);
+        else
+            // the upb decoder reports the error (or decodes the data
+            // the Perl-free parser can't handle)
+            decoded = mapper->decode(job->buffer, job->bufsize, input);
+        // the parsed tree is not needed anymore
+        job->parsed = false;
+        vector<Mapper::ParsedTree>().swap(job->trees);
+
+        if (!decoded)
+            croak("Deserialization failed: %s", mapper->last_error_message());
+    }
+
+    return SvREFCNT_inc(decoded);
+}
+
 MapperField::MapperField(pTHX_ const Mapper *_mapper, const Mapper::Field *_field) :
         field(_field),
         mapper(_mapper) {
@@ -1742,6 +4680,27 @@ MapperField::~MapperField() {
     mapper->unref();
 }
 
+#ifdef USE_ITHREADS
+
+MapperField *MapperField::clone(pTHX_ const MapperField *original, CLONE_PARAMS *params) {
+    MapperField *mapperfield = (MapperField *) ptr_table_fetch(PL_ptr_table, original);
+
+    if (mapperfield) {
+        mapperfield->ref();
+    } else {
+        Mapper *mapper = Mapper::clone(aTHX_ original->mapper, params);
+        int index = original->field - original->mapper->get_field(0);
+
+        mapperfield = new MapperField(aTHX_ mapper, mapper->get_field(index));
+        mapper->unref();
+        ptr_table_store(PL_ptr_table, original, mapperfield);
+    }
+
+    return mapperfield;
+}
+
+#endif
+
 MapperField *MapperField::find_extension(pTHX_ CV *cv, SV *extension) {
     const Mapper *mapper = (const Mapper *) CvXSUBANY(cv).any_ptr;
     STRLEN len;
@@ -1898,6 +4857,8 @@ SV *MapperField::get_scalar(HV *self, SV *target) {
     SV *value = get_read_field(self);
 
     if (value) {
+        if (field->lazy)
+            decode_lazy_message(aTHX_ value);
         return value;
     } else {
         copy_default(target);
@@ -2016,6 +4977,7 @@ void MapperField::copy_value(SV *target, SV *value) {
         STRLEN len;
         const char *str = SvPV(value, len);
 
+        unshare_bytes(aTHX_ target, false);
         sv_setpvn(target, str, len);
     }
         break;
@@ -2079,6 +5041,8 @@ SV *MapperField::get_item(HV *self, int index, SV *target) {
     SV **value = av_fetch(array, index, 0);
 
     if (value) {
+        if (field->lazy)
+            decode_lazy_message(aTHX_ *value);
         return *value;
     } else {
         copy_default(target);
@@ -2136,6 +5100,17 @@ int MapperField::list_size(HV *self) {
 SV *MapperField::get_list(HV *self) {
     SV *array_ref = get_read_array_ref(self);
 
+    if (array_ref && field->lazy) {
+        AV *array = (AV *) SvRV(array_ref);
+
+        for (int i = 0, max = av_top_index(array); i <= max; ++i) {
+            SV **value = av_fetch(array, i, 0);
+
+            if (value)
+                decode_lazy_message(aTHX_ *value);
+        }
+    }
+
     return array_ref ? array_ref : &PL_sv_undef;
 }
 
@@ -2192,6 +5167,23 @@ EnumMapper::~EnumMapper() {
     refcounted_mortalize(aTHX_ registry);
 }
 
+#ifdef USE_ITHREADS
+
+EnumMapper *EnumMapper::clone(pTHX_ const EnumMapper *original, CLONE_PARAMS *params) {
+    EnumMapper *mapper = (EnumMapper *) ptr_table_fetch(PL_ptr_table, original);
+
+    if (mapper) {
+        mapper->ref();
+    } else {
+        mapper = new EnumMapper(aTHX_ original->registry, original->enum_def);
+        ptr_table_store(PL_ptr_table, original, mapper);
+    }
+
+    return mapper;
+}
+
+#endif
+
 SV *EnumMapper::enum_descriptor() const {
     SV *ref = newSV(0);
 
@@ -2214,6 +5206,30 @@ ServiceMapper::~ServiceMapper() {
     refcounted_mortalize(aTHX_ registry);
 }
 
+#ifdef USE_ITHREADS
+
+ServiceMapper *ServiceMapper::clone(pTHX_ const ServiceMapper *original, CLONE_PARAMS *params) {
+    ServiceMapper *mapper = (ServiceMapper *) ptr_table_fetch(PL_ptr_table, original);
+
+    if (mapper) {
+        mapper->ref();
+    } else {
+        // the service definition is owned by the mapper
+        ServiceDef *service_def = new ServiceDef(original->service_def->full_name());
+        const vector<MethodDef> &methods = original->service_def->methods();
+
+        for (vector<MethodDef>::const_iterator it = methods.begin(), en = methods.end(); it != en; ++it)
+            service_def->add_method(MethodDef(it->name(), it->full_name(), service_def, it->input_type(), it->output_type(), it->client_streaming(), it->server_streaming()));
+
+        mapper = new ServiceMapper(aTHX_ original->registry, service_def);
+        ptr_table_store(PL_ptr_table, original, mapper);
+    }
+
+    return mapper;
+}
+
+#endif
+
 SV *ServiceMapper::service_descriptor() const {
     SV *ref = newSV(0);
 
@@ -2269,6 +5285,40 @@ MethodMapper::~MethodMapper() {
     refcounted_mortalize(aTHX_ registry);
 }
 
+#ifdef USE_ITHREADS
+
+MethodMapper::MethodMapper(pTHX_ const MethodMapper &original, CLONE_PARAMS *params) :
+        registry(original.registry),
+        input_def(original.input_def),
+        output_def(original.output_def) {
+    SET_THX_MEMBER;
+
+    registry->ref();
+
+    method_name_key_sv = sv_dup_inc(original.method_name_key_sv, params);
+    serialize_key_sv = sv_dup_inc(original.serialize_key_sv, params);
+    deserialize_key_sv = sv_dup_inc(original.deserialize_key_sv, params);
+    method_name_sv = sv_dup_inc(original.method_name_sv, params);
+    serialize_sv = sv_dup_inc(original.serialize_sv, params);
+    deserialize_sv = sv_dup_inc(original.deserialize_sv, params);
+    grpc_call_sv = (CV *) sv_dup_inc((SV *) original.grpc_call_sv, params);
+}
+
+MethodMapper *MethodMapper::clone(pTHX_ const MethodMapper *original, CLONE_PARAMS *params) {
+    MethodMapper *mapper = (MethodMapper *) ptr_table_fetch(PL_ptr_table, original);
+
+    if (mapper) {
+        mapper->ref();
+    } else {
+        mapper = new MethodMapper(aTHX_ *original, params);
+        ptr_table_store(PL_ptr_table, original, mapper);
+    }
+
+    return mapper;
+}
+
+#endif
+
 void MethodMapper::resolve_input_output() {
     const Mapper *request_mapper = registry->find_mapper(input_def);
     const Mapper *response_mapper = registry->find_mapper(output_def);
@@ -2292,16 +5342,89 @@ void MethodMapper::resolve_input_output() {
     deserialize_sv = newRV_inc(decode);
 }
 
-WarnContext::WarnContext(pTHX) : chained_handler(NULL) {
+WarnContext::WarnContext(pTHX) :
+        base(0),
+        depth(0),
+        scratch_depth(0),
+        chained_handler(NULL) {
     CV *handler = get_cv("Google::ProtocolBuffers::Dynamic::Mapper::handle_warning", 0);
 
     warn_handler = (SV*) handler;
 }
 
+#ifdef USE_ITHREADS
+
+WarnContext::WarnContext(pTHX_ const WarnContext &original, CLONE_PARAMS *params) :
+        base(0),
+        depth(0),
+        scratch_depth(0),
+        chained_handler(NULL) {
+    warn_handler = sv_dup(original.warn_handler, params);
+}
+
+WarnContext *WarnContext::clone(pTHX_ const WarnContext *original, CLONE_PARAMS *params) {
+    WarnContext *cxt = (WarnContext *) ptr_table_fetch(PL_ptr_table, original);
+
+    if (!cxt) {
+        cxt = new WarnContext(aTHX_ *original, params);
+        ptr_table_store(PL_ptr_table, original, cxt);
+    }
+
+    return cxt;
+}
+
+#endif
+
+namespace {
+    int free_warn_context(pTHX_ SV *sv, MAGIC *mg) {
+        delete (WarnContext *) mg->mg_ptr;
+
+        return 0;
+    }
+
+#ifdef USE_ITHREADS
+    int dup_warn_context(pTHX_ MAGIC *mg, CLONE_PARAMS *params) {
+        WarnContext *cxt = WarnContext::clone(aTHX_ (const WarnContext *) mg->mg_ptr, params);
+
+        // mg_obj is the handler CV the magic is attached to
+        mg->mg_ptr = (char *) cxt;
+        CvXSUBANY((CV *) mg->mg_obj).any_ptr = cxt;
+
+        return 0;
+    }
+#endif
+
+    // each interpreter has its own warning context, created when the
+    // handler is cloned
+    MGVTBL warn_context_vtbl = {
+        NULL, // get
+        NULL, // set
+        NULL, // len
+        NULL, // clear
+        free_warn_context,
+        NULL, // copy
+#ifdef USE_ITHREADS
+        dup_warn_context,
+#else
+        NULL, // dup
+#endif
+        NULL, // local
+    };
+}
+
 void WarnContext::setup(pTHX) {
     CV *handler = get_cv("Google::ProtocolBuffers::Dynamic::Mapper::handle_warning", 0);
-
-    CvXSUBANY(handler).any_ptr = new WarnContext(aTHX);
+    WarnContext *cxt = new WarnContext(aTHX);
+
+    CvXSUBANY(handler).any_ptr = cxt;
+    MAGIC *mg = sv_magicext((SV *) handler, (SV *) handler,
+                            PERL_MAGIC_ext, &warn_context_vtbl,
+                            (const char *) cxt, 0);
+#ifdef USE_ITHREADS
+    mg->mg_flags |= MGf_DUP;
+#else
+    PERL_UNUSED_VAR(mg);
+#endif
 }
 
 WarnContext *WarnContext::get(pTHX) {
@@ -2310,35 +5433,51 @@ WarnContext *WarnContext::get(pTHX) {
     return (WarnContext *) CvXSUBANY(handler).any_ptr;
 }
 
+// nested encode calls (for example from a warning handler) push their
+// levels and scratch buffers after the ones of the outer call, which are
+// restored when the current scope is left, also when encoding dies
+void WarnContext::localize_levels(pTHX) {
+    SAVEIV(base);
+    SAVEIV(depth);
+    SAVEIV(scratch_depth);
+    base = depth;
+}
+
 void WarnContext::localize_warning_handler(pTHX) {
+    SAVESPTR(chained_handler);
     chained_handler = PL_warnhook;
     SAVEGENERICSV(PL_warnhook);
     PL_warnhook = SvREFCNT_inc_simple_NN(warn_handler);
 }
 
 void WarnContext::warn_with_context(pTHX_ SV *warning) const {
-    SV *cxt = sv_2mortal(newSVpvs("While encoding field '"));
+    SV *cxt = warning;
 
-    for (Levels::const_iterator it = levels.begin(), en = levels.end(); it != en; ++it) {
-        switch (it->kind) {
-        case Array:
-            sv_catpvf(cxt, "[%d].", it->index);
-            break;
-        case Hash:
-            sv_catpvs(cxt, "{");
-            sv_catpvn(cxt, it->key, it->keylen);
-            sv_catpvs(cxt, "}.");
-            break;
-        case Message:
-            sv_catpvf(cxt, "%" SVf ".", it->field->name);
-            break;
+    // no levels when the innermost encode call does not track them
+    if (depth > base) {
+        cxt = sv_2mortal(newSVpvs("While encoding field '"));
+
+        for (Levels::const_iterator it = levels.begin() + base, en = levels.begin() + depth; it != en; ++it) {
+            switch (it->kind) {
+            case Array:
+                sv_catpvf(cxt, "[%d].", it->index);
+                break;
+            case Hash:
+                sv_catpvs(cxt, "{");
+                sv_catpvn(cxt, it->key, it->keylen);
+                sv_catpvs(cxt, "}.");
+                break;
+            case Message:
+                sv_catpvf(cxt, "%" SVf ".", it->field->name);
+                break;
+            }
         }
-    }
 
-    SvCUR_set(cxt, SvCUR(cxt) - 1); // chop last '.'
+        SvCUR_set(cxt, SvCUR(cxt) - 1); // chop last '.'
 
-    sv_catpvs(cxt, "': ");
-    sv_catsv(cxt, warning);
+        sv_catpvs(cxt, "': ");
+        sv_catsv(cxt, warning);
+    }
 
     if (chained_handler) {
         dSP;
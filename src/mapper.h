@@ -19,7 +19,9 @@
 
 #include "thx_member.h"
 
-#include <list>
+#include <deque>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace gpd {
@@ -29,11 +31,54 @@ class MappingOptions;
 class MapperField;
 class WarnContext;
 class ServiceDef;
+class SVOutputBuffer;
+
+// an upb::Environment whose initial arena block is kept across calls, so
+// encoding/decoding small messages does not allocate; blocks allocated
+// beyond it are freed by reset(), and the initial block grows, up to a
+// limit, to fit the allocations of previous calls
+class ReusableEnvironment {
+public:
+    ReusableEnvironment();
+    ~ReusableEnvironment();
+
+    upb::Environment *start(upb::Status *report_errors_to);
+    void reset();
+
+private:
+    ReusableEnvironment(const ReusableEnvironment &);
+    ReusableEnvironment &operator=(const ReusableEnvironment &);
+
+    // uninitialized storage when not started
+    upb::Environment *env;
+    char *block;
+    size_t block_size;
+    bool started;
+};
 
 class Mapper : public Refcounted {
 public:
+    // how a field value is encoded, depends on field type and mapping options
+    enum ValueEncoding {
+        EncodeFloat = 1,
+        EncodeDouble,
+        EncodeBool,
+        EncodeString,
+        EncodeBytes,
+        EncodeMessage,
+        EncodeEnum,
+        EncodeCheckedEnum,
+        EncodeInt32,
+        EncodeUInt32,
+        EncodeInt64,
+        EncodeUInt64,
+        EncodeBigInt64,
+        EncodeBigUInt64,
+    };
+
     struct Field {
         const upb::FieldDef *field_def;
+        ValueEncoding value_encoding;
         struct {
             upb_selector_t seq_start;
             upb_selector_t seq_end;
@@ -59,6 +104,12 @@ public:
         const Mapper *mapper; // for Message/Group fields
         STD_TR1::unordered_set<int32_t> enum_values;
         int oneof_index;
+        // wire format details, used by the native encoder
+        uint32_t field_number;
+        upb::FieldDef::DescriptorType descriptor_type;
+        bool packed;
+        // sub-message kept serialized until first accessed
+        bool lazy;
         union {
             struct {
                 size_t default_str_len;
@@ -77,65 +128,220 @@ public:
         const STD_TR1::unordered_set<int32_t> &map_enum_values() const;
     };
 
+    // serialized value of a lazy sub-message field
+    typedef std::pair<const char *, size_t> LazyValue;
+    // serialized unknown fields of a message
+    typedef std::string UnknownFields;
+
+    // Perl-free decoded form of protobuf data: it is filled by
+    // parse_message(), possibly on a worker thread, and turned into Perl
+    // values by DecoderHandlers::materialize() on the main thread
+    struct ParsedValue {
+        // -1 for unknown fields
+        int field_index;
+        // for parsed sub-messages, the tree holding them, -1 otherwise
+        int tree;
+        union {
+            int64_t iv;
+            uint64_t uv;
+            double nv;
+            float fv;
+            bool bv;
+            // strings, bytes, unknown fields, and lazy or not yet parsed
+            // sub-messages, pointing inside the input buffer
+            struct {
+                const char *buf;
+                size_t len;
+            };
+            // index in ParsedTree::messages
+            size_t message;
+        };
+    };
+
+    struct ParsedMessage {
+        // range of the values of the message in ParsedTree::values
+        size_t first, count;
+    };
+
+    struct ParsedTree {
+        int index;
+        std::vector<ParsedValue> values;
+        std::vector<ParsedMessage> messages;
+        // values of the messages being parsed, moved to values when the
+        // message is complete, so the values of a message are contiguous
+        std::vector<ParsedValue> stack;
+    };
+
     struct DecoderHandlers {
+        // where the value of a field is stored
+        enum TargetKind {
+            PlainTarget = 1,    // hash value
+            OneofTarget = 2,    // hash value, clearing other oneof members
+            RepeatedTarget = 3, // new array element
+            MapKeyTarget = 4,   // key of the current map entry
+            MapValueTarget = 5, // value of the current map entry
+        };
+
         DECL_THX_MEMBER;
         std::vector<SV *> items;
         std::vector<const Mapper *> mappers;
-        std::vector<std::vector<bool> > seen_fields;
-        std::vector<std::vector<int32_t> > seen_oneof;
+        // one level per message being decoded: a word holding the
+        // offset of the previous level, followed by the seen fields
+        // bitmap and by the field index + 1 of the seen member of each
+        // oneof; it is never shrunk, to avoid allocations
+        std::vector<uint64_t> seen_fields;
+        size_t seen_base, seen_top;
         std::string error;
         SV *string;
+        // input buffer and the (copy-on-write) copy of it referenced by
+        // zero-copy bytes values
+        SV *input, *shared_input;
+        const char *input_buffer;
+        STRLEN input_size;
+        bool private_input;
+        // values of lazy fields in the input, in wire order
+        std::vector<LazyValue> lazy_values;
+        size_t next_lazy_value;
+        // unknown fields of each message preserving them, in wire order
+        std::vector<UnknownFields> unknown_fields;
+        size_t next_unknown_fields;
+        // decode_into() with merge semantics: the target hash might
+        // already contain oneof members
+        bool merging;
+        // sub-message hashes taken from the target of decode_into(),
+        // reused for sub-messages of the same type
+        STD_TR1::unordered_map<const Mapper *, std::vector<HV *> > spare_hashes;
+        // element count of the last decoded value of repeated/map fields,
+        // used to pre-size the next one, up to max_size_hint (each element
+        // takes at least one byte of input)
+        STD_TR1::unordered_map<const Field *, IV> size_hints;
+        IV max_size_hint;
 
         DecoderHandlers(pTHX_ const Mapper *mapper);
 
-        void prepare(HV *target);
+        void prepare(HV *target, size_t bufsize);
+        void set_input(SV *input, bool is_private);
+        SV *get_shared_input();
         SV *get_target();
         void clear();
+        void take_unknown_fields(const Mapper *mapper, HV *target);
+        HV *new_message_hash(const Mapper *mapper);
+        void recycle_fields(const Mapper *mapper, HV *target);
+        void remove_stale_fields(const Mapper *mapper, HV *target);
+        void release_spare_hashes();
+        IV size_hint(const Field &field) const;
+        void set_size_hint(const Field &field, IV size);
 
         static bool on_end_message(DecoderHandlers *cxt, upb::Status *status);
+        template<bool track_seen, int kind>
         static DecoderHandlers *on_start_string(DecoderHandlers *cxt, const int *field_index, size_t size_hint);
         static size_t on_string(DecoderHandlers *cxt, const int *field_index, const char *buf, size_t len);
         static bool on_end_string(DecoderHandlers *cxt, const int *field_index);
+        static bool on_end_bytes(DecoderHandlers *cxt, const int *field_index);
+        template<bool track_seen, int kind>
+        static DecoderHandlers *on_start_shared_bytes(DecoderHandlers *cxt, const int *field_index, size_t size_hint);
+        static size_t on_shared_bytes(DecoderHandlers *cxt, const int *field_index, const char *buf, size_t len);
+        template<bool track_seen>
         static DecoderHandlers *on_start_sequence(DecoderHandlers *cxt, const int *field_index);
         static bool on_end_sequence(DecoderHandlers *cxt, const int *field_index);
+        template<bool track_seen>
         static DecoderHandlers *on_start_map(DecoderHandlers *cxt, const int *field_index);
         static bool on_end_map(DecoderHandlers *cxt, const int *field_index);
+        template<bool track_seen, int kind>
         static DecoderHandlers *on_start_sub_message(DecoderHandlers *cxt, const int *field_index);
         static bool on_end_sub_message(DecoderHandlers *cxt, const int *field_index);
+        template<bool track_seen, int kind>
+        static DecoderHandlers *on_start_lazy_sub_message(DecoderHandlers *cxt, const int *field_index);
         static bool on_end_map_entry(DecoderHandlers *cxt, const int *field_index);
 
-        template<class T>
+        template<class T, bool track_seen, int kind>
         static bool on_nv(DecoderHandlers *cxt, const int *field_index, T val);
 
-        template<class T>
+        template<class T, bool track_seen, int kind>
         static bool on_iv(DecoderHandlers *cxt, const int *field_index, T val);
 
-        template<class T>
+        template<class T, bool track_seen, int kind>
         static bool on_uv(DecoderHandlers *cxt, const int *field_index, T val);
 
+        template<bool track_seen, int kind>
         static bool on_enum(DecoderHandlers *cxt, const int *field_index, int32_t val);
+        template<bool track_seen, int kind>
         static bool on_bigiv(DecoderHandlers *cxt, const int *field_index, int64_t val);
+        template<bool track_seen, int kind>
         static bool on_biguv(DecoderHandlers *cxt, const int *field_index, uint64_t val);
 
+        template<bool track_seen, int kind>
         static bool on_bool(DecoderHandlers *cxt, const int *field_index, bool val);
 
         bool apply_defaults_and_check();
+        bool materialize(const std::vector<ParsedTree> &trees, int tree, size_t message);
         SV *get_target(const int *field_index);
+        template<int kind>
+        SV *get_target(const int *field_index);
+        template<bool track_seen>
         void mark_seen(const int *field_index);
+        bool is_seen(int field_index) const;
+        void push_seen(const Mapper *mapper);
+        void pop_seen();
+    };
+
+    // the state of a decode call; contexts are taken from a free list,
+    // so decoding is reentrant (for example when decoding from a tied
+    // accessor or a warning handler called during decoding)
+    struct DecoderContext {
+        DecoderHandlers callbacks;
+        upb::Sink sink, json_sink;
+        // errors reported by upb
+        upb::Status status;
+        // reset when the context is released
+        ReusableEnvironment environment;
+
+        DecoderContext(pTHX_ const Mapper *mapper);
+
+        void release_input();
+        const char *error_message() const;
+    };
+
+    // upb handlers and methods; they are not modified after mapping, and
+    // are shared by the copies of a mapper in all interpreters
+    struct SharedHandlers : public Refcounted {
+        upb::reffed_ptr<const upb::Handlers> pb_encoder_handlers, json_encoder_handlers;
+        upb::reffed_ptr<upb::Handlers> decoder_handlers;
+        // only created when lazy fields are reachable from this message, and
+        // used for protobuf decoding instead of decoder_handlers
+        upb::reffed_ptr<upb::Handlers> lazy_decoder_handlers;
+        std::vector<upb::reffed_ptr<upb::Handlers> > skip_handlers;
+        upb::reffed_ptr<const upb::pb::DecoderMethod> pb_decoder_method;
+        upb::reffed_ptr<const upb::json::ParserMethod> json_decoder_method;
     };
 
 public:
     Mapper(pTHX_ Dynamic *registry, const upb::MessageDef *message_def, HV *stash, const MappingOptions &options);
     ~Mapper();
 
+    static void setup(pTHX);
+#ifdef USE_ITHREADS
+    // returns the copy of the mapper for the interpreter being cloned
+    static Mapper *clone(pTHX_ const Mapper *original, CLONE_PARAMS *params);
+#endif
+
     const char *full_name() const;
     const char *package_name() const;
 
     void resolve_mappers();
+    bool resolve_scanned_fields();
     void create_encoder_decoder();
 
     SV *encode(SV *ref);
-    SV *decode(const char *buffer, STRLEN bufsize);
+    SV *encode_many(AV *values, bool delimited);
+    bool encode_into(SV *ref, SV *target, SV *offset, bool delimited, STRLEN *written);
+    bool encoded_size(SV *ref, STRLEN *size);
+    SV *decode(const char *buffer, STRLEN bufsize, SV *input = NULL);
+    SV *decode_many(AV *buffers);
+    SV *decode_stream(const char *buffer, STRLEN bufsize, SV *input = NULL);
+    SV *decode_partial(const char *buffer, STRLEN bufsize, AV *paths, SV *input = NULL);
+    bool decode_into(HV *target, const char *buffer, STRLEN bufsize, bool merge, SV *input = NULL);
+    SV *decode(DecoderContext *cxt, upb::pb::Decoder *pb_decoder, const char *buffer, STRLEN bufsize, SV *input = NULL, bool private_input = false);
     SV *encode_json(SV *ref);
     SV *decode_json(const char *buffer, STRLEN bufsize);
     bool check(SV *ref);
@@ -151,18 +357,71 @@ public:
     SV *make_object(SV *data) const;
     bool get_decode_blessed() const;
 
+    DecoderContext *acquire_decoder_context();
+    void release_decoder_context(DecoderContext *cxt);
+    upb::pb::Decoder *create_pb_decoder(upb::Environment *env, DecoderContext *cxt);
+
+    // does not use the Perl API, so it can run on worker threads
+    const char *parse_message(const char *buffer, const char *end, uint32_t group_number, ParsedTree *tree, size_t *message, bool defer_sub_messages = false) const;
+    // creates the Perl value of a message parsed by parse_message()
+    SV *decode_parsed(const std::vector<ParsedTree> &trees, size_t message, SV *input = NULL, bool private_input = false);
+
 private:
-    bool encode_value(upb::Sink *sink, upb::Status *status, SV *ref) const;
-    bool encode_field(upb::Sink *sink, upb::Status *status, const Field &fd, SV *ref) const;
-    bool encode_field_nodefaults(upb::Sink *sink, upb::Status *status, const Field &fd, SV *ref) const;
-    bool encode_key(upb::Sink *sink, upb::Status *status, const Field &fd, const char *key, I32 keylen) const;
-    bool encode_hash_kv(upb::Sink *sink, upb::Status *status, const char *key, STRLEN keylen, SV *value) const;
-    bool encode_from_perl_array(upb::Sink *sink, upb::Status *status, const Field &fd, SV *ref) const;
-    bool encode_from_perl_hash(upb::Sink *sink, upb::Status *status, const Field &fd, SV *ref) const;
-    bool encode_from_message_array(upb::Sink *sink, upb::Status *status, const Mapper::Field &fd, AV *source) const;
-
-    template<class G, class S>
-    bool encode_from_array(upb::Sink *sink, upb::Status *status, const Mapper::Field &fd, AV *source) const;
+#ifdef USE_ITHREADS
+    Mapper(pTHX_ const Mapper &original, CLONE_PARAMS *params);
+#endif
+
+    DecoderContext *localized_decoder_context();
+    upb::Environment *localized_environment(upb::Status *report_errors_to);
+    static void release_localized_environment(pTHX_ void *ptr);
+    void report_decoder_error(DecoderContext *cxt);
+    bool decode_parallel(DecoderContext *cxt, const char *buffer, STRLEN bufsize, SV *input, SV **result);
+    SV *materialize(DecoderContext *cxt, const std::vector<ParsedTree> &trees, size_t message, SV *input, bool private_input);
+
+    // reduced decoder used by decode_partial(), one per set of field paths
+    struct PartialDecoder {
+        // the first entry is for the top-level message
+        std::vector<upb::reffed_ptr<upb::Handlers> > handlers;
+        upb::reffed_ptr<const upb::pb::DecoderMethod> method;
+    };
+
+    bool bind_decoder_handlers(upb::Handlers *handlers, const Field &field, int index, bool lazy) const;
+    template<bool track_seen>
+    bool bind_decoder_handlers(upb::Handlers *handlers, const Field &field, int index, bool lazy) const;
+    template<bool track_seen, int kind>
+    bool bind_decoder_handlers(upb::Handlers *handlers, const Field &field, int index, bool lazy) const;
+    const upb::Handlers *pb_decoder_handlers() const;
+    const PartialDecoder *find_partial_decoder(AV *paths, std::string *error);
+    upb::Handlers *partial_decoder_handlers(const std::vector<std::string> &paths, std::vector<upb::reffed_ptr<upb::Handlers> > *handlers, std::string *error) const;
+    const char *scan_fields(const char *buffer, const char *end, uint32_t group_number, DecoderHandlers *cxt) const;
+
+    bool encode_to(SVOutputBuffer *output, SV *ref);
+    // W is either an upb::Sink wrapper or the native wire format writer
+    template<class W>
+    bool encode_value(W *sink, upb::Status *status, SV *ref) const;
+    template<class W>
+    bool encode_field(W *sink, upb::Status *status, const Field &fd, SV *ref) const;
+    template<class W>
+    bool encode_field_nodefaults(W *sink, upb::Status *status, const Field &fd, SV *ref) const;
+    template<class W>
+    bool encode_key(W *sink, upb::Status *status, const Field &fd, const char *key, I32 keylen) const;
+    template<class W>
+    bool encode_map_entry(W *sink, upb::Status *status, const Field &fd, const char *key, STRLEN keylen, SV *value) const;
+    template<class W>
+    bool encode_hash_kv(W *sink, upb::Status *status, const char *key, STRLEN keylen, SV *value) const;
+    template<class W>
+    bool encode_from_perl_array(W *sink, upb::Status *status, const Field &fd, SV *ref) const;
+    template<class W>
+    bool encode_from_perl_hash(W *sink, upb::Status *status, const Field &fd, SV *ref) const;
+    template<class W>
+    bool encode_from_message_array(W *sink, upb::Status *status, const Mapper::Field &fd, AV *source) const;
+    template<class W>
+    bool encode_lazy_message(W *sink, upb::Status *status, const Mapper::Field &fd, SV *value) const;
+
+    void compile_encode_program();
+
+    template<class G, class S, class W>
+    bool encode_from_array(W *sink, upb::Status *status, const Mapper::Field &fd, AV *source) const;
 
     bool check(upb::Status *status, SV *ref) const;
     bool check(upb::Status *status, const Field &fd, SV *ref) const;
@@ -174,27 +433,136 @@ private:
     Dynamic *registry;
     const upb::MessageDef *message_def;
     HV *stash;
-    upb::reffed_ptr<const upb::Handlers> pb_encoder_handlers, json_encoder_handlers;
-    upb::reffed_ptr<upb::Handlers> decoder_handlers;
-    upb::reffed_ptr<const upb::pb::DecoderMethod> pb_decoder_method;
-    upb::reffed_ptr<const upb::json::ParserMethod> json_decoder_method;
+    SharedHandlers *shared;
+    // keyed by the sorted, comma-separated field paths
+    STD_TR1::unordered_map<std::string, PartialDecoder> partial_decoders;
     std::vector<Field> fields;
+    // one instruction per field, precomputed in create_encoder_decoder()
+    struct EncodeInstruction {
+        enum Action {
+            EncodeSingle = 1,
+            EncodeSingleNoDefault,
+            EncodeRepeated,
+            EncodeMap,
+        };
+
+        Action action;
+        bool required;
+        int oneof_index;
+        const Field *field;
+
+        // field number order, for deterministic output
+        bool operator<(const EncodeInstruction &other) const {
+            return field->field_number < other.field->field_number;
+        }
+    };
+    std::vector<EncodeInstruction> encode_program;
+    // size of the seen fields bitmap, in 64-bit words
+    size_t seen_field_words;
+    // seen fields are only needed for explicit defaults and required fields
+    bool track_seen;
     std::vector<MapperField *> extension_mapper_fields;
     STD_TR1::unordered_map<std::string, Field *> field_map;
+    // used to find lazy and unknown fields in the serialized data
+    STD_TR1::unordered_map<uint32_t, const Field *> fields_by_number;
     upb::Status status;
-    DecoderHandlers decoder_callbacks;
-    upb::Sink encoder_sink, decoder_sink;
-    std::string output_buffer;
-    upb::StringSink string_sink;
-    bool check_required_fields, decode_explicit_defaults, encode_defaults, check_enum_values, decode_blessed, fail_ref_coercion;
+    // unused decoder contexts
+    std::vector<DecoderContext *> decoder_contexts;
+    // environments for encoder calls, the first environments_in_use are
+    // used by running calls
+    std::vector<ReusableEnvironment *> environments;
+    size_t environments_in_use;
+#ifdef USE_ITHREADS
+    perl_mutex decoder_contexts_mutex;
+#endif
+    upb::Sink encoder_sink;
+    // size of the last encoded value, used to pre-size the output buffer
+    size_t output_size_hint;
+    // number of threads parsing large inputs, 0 or 1 to disable
+    int decode_threads;
+    bool check_required_fields, decode_explicit_defaults, encode_defaults, check_enum_values, decode_blessed, fail_ref_coercion, zero_copy_bytes, native_encoder, use_bigints, preserve_unknown_fields, deterministic, warning_context;
+    // true if this message or any message reachable from it has lazy fields
+    bool has_lazy_fields;
+    // true if this message or any message reachable from it preserves
+    // unknown fields
+    bool has_unknown_fields;
     WarnContext *warn_context;
 };
 
+// incrementally decodes a stream of length-delimited messages
+class StreamDecoder : public Refcounted {
+public:
+    StreamDecoder(pTHX_ Mapper *mapper);
+    ~StreamDecoder();
+
+    // separate from the constructor because it can croak
+    void start();
+    void feed(SV *chunk);
+    IV feed_from(SV *fh, IV size);
+    SV *next_message();
+    IV pending_bytes() const;
+
+private:
+    SV *decode_message(const char *buffer, STRLEN bufsize, SV *input);
+    void stash_chunk();
+
+    DECL_THX_MEMBER;
+    Mapper *mapper;
+    upb::Environment env;
+    // owned for the whole life of the stream decoder
+    Mapper::DecoderContext *decoder_context;
+    upb::pb::Decoder *pb_decoder;
+    // holds a partial message when it spans multiple chunks, or data read
+    // by feed_from(); data before pending_offset has already been decoded
+    std::string pending;
+    size_t pending_offset;
+    // copy of the last chunk passed to feed()
+    SV *chunk;
+    STRLEN chunk_offset;
+};
+
+// decodes a message on a worker thread; completion is signalled by
+// making a pipe readable, so it can be watched by an event loop, and the
+// Perl values are created by result()
+class AsyncDecode : public Refcounted {
+public:
+    AsyncDecode(pTHX_ Mapper *mapper, SV *input);
+    ~AsyncDecode();
+
+    // separate from the constructor because it can croak
+    void start();
+    SV *fileno() const;
+    bool is_ready();
+    SV *result();
+
+private:
+    struct Job;
+
+    static bool parse(Job *job);
+    static void run(void *arg);
+    void wait();
+    void abandon_job();
+
+    DECL_THX_MEMBER;
+    Mapper *mapper;
+    // private copy of the input, whose buffer is read by the worker thread
+    SV *input;
+    Job *job;
+    // the process that started the job, worker threads do not survive fork()
+    Pid_t pid;
+    bool started, completed;
+    SV *decoded;
+};
+
 class MapperField : public Refcounted {
 public:
     MapperField(pTHX_ const Mapper *mapper, const Mapper::Field *field);
     ~MapperField();
 
+#ifdef USE_ITHREADS
+    static MapperField *clone(pTHX_ const MapperField *original, CLONE_PARAMS *params);
+#endif
+
     const char *name();
     bool is_repeated();
     bool is_extension();
@@ -249,6 +617,10 @@ public:
     EnumMapper(pTHX_ Dynamic *registry, const upb::EnumDef *enum_def);
     ~EnumMapper();
 
+#ifdef USE_ITHREADS
+    static EnumMapper *clone(pTHX_ const EnumMapper *original, CLONE_PARAMS *params);
+#endif
+
     SV *enum_descriptor() const;
 
 private:
@@ -263,6 +635,10 @@ public:
     ServiceMapper(pTHX_ Dynamic *registry, const gpd::ServiceDef *service_def);
     ~ServiceMapper();
 
+#ifdef USE_ITHREADS
+    static ServiceMapper *clone(pTHX_ const ServiceMapper *original, CLONE_PARAMS *params);
+#endif
+
     SV *service_descriptor() const;
 
 private:
@@ -276,6 +652,10 @@ public:
     MethodMapper(pTHX_ Dynamic *registry, const std::string &method, const upb::MessageDef *input_def, const upb::MessageDef *output_def, bool client_streaming, bool server_streaming);
     ~MethodMapper();
 
+#ifdef USE_ITHREADS
+    static MethodMapper *clone(pTHX_ const MethodMapper *original, CLONE_PARAMS *params);
+#endif
+
     SV *method_name_key() const { return method_name_key_sv; }
     SV *serialize_key() const { return serialize_key_sv; }
     SV *deserialize_key() const { return deserialize_key_sv; }
@@ -288,6 +668,10 @@ public:
     void resolve_input_output();
 
 private:
+#ifdef USE_ITHREADS
+    MethodMapper(pTHX_ const MethodMapper &original, CLONE_PARAMS *params);
+#endif
+
     DECL_THX_MEMBER;
     Dynamic *registry;
     const upb::MessageDef *input_def, *output_def;
@@ -318,27 +702,75 @@ public:
         Item(Kind _kind) : kind(_kind) { }
     };
 
+    // a map entry, sorted by key for deterministic output
+    struct MapEntry {
+        const char *key; // NULL while the key is at key_offset in map_keys
+        STRLEN keylen, key_offset;
+        SV *value;
+        IV ikey; // signed integer keys
+        UV ukey; // unsigned integer and boolean keys
+    };
+
+    // buffers used by the encoder for one nesting level, kept across
+    // calls so steady-state encoding does not allocate
+    struct Scratch {
+        // presence bits of messages with more than 64 oneofs
+        std::vector<uint64_t> oneof_words;
+        // map entries, when sorting them
+        std::vector<MapEntry> map_entries;
+        // UTF-8 copies of non-ASCII byte string map keys
+        std::string map_keys;
+    };
+
     static void setup(pTHX);
     static WarnContext *get(pTHX);
+#ifdef USE_ITHREADS
+    static WarnContext *clone(pTHX_ const WarnContext *original, CLONE_PARAMS *params);
+#endif
 
     void warn_with_context(pTHX_ SV *warning) const;
 
+    // levels are reused across calls, and references to them stay valid
+    // while deeper levels are pushed
     Item &push_level(Kind kind) {
-        levels.push_back(Item(kind));
+        if ((size_t) depth == levels.size())
+            levels.push_back(Item(kind));
+        Item &item = levels[depth++];
 
-        return levels.back();
+        item.kind = kind;
+        return item;
     }
 
-    void pop_level() { levels.pop_back(); }
-    void clear() { levels.clear(); }
+    void pop_level() { --depth; }
+
+    // like levels, but pushed regardless of the warning_context option
+    Scratch &push_scratch() {
+        if ((size_t) scratch_depth == scratch.size())
+            scratch.push_back(Scratch());
+
+        return scratch[scratch_depth++];
+    }
+
+    void pop_scratch() { --scratch_depth; }
+
+    void localize_levels(pTHX);
     void localize_warning_handler(pTHX);
 
 private:
-    typedef std::list<Item> Levels;
+    typedef std::deque<Item> Levels;
 
     WarnContext(pTHX);
+#ifdef USE_ITHREADS
+    WarnContext(pTHX_ const WarnContext &original, CLONE_PARAMS *params);
+#endif
 
     Levels levels;
+    // levels of the current encode call are from base to depth, IVs so
+    // they can be saved on the savestack
+    IV base, depth;
+    // never shrunk, like levels
+    std::deque<Scratch> scratch;
+    IV scratch_depth;
     SV *chained_handler;
     SV *warn_handler;
 };
@@ -19,16 +19,26 @@ private:
 inline Refcounted::Refcounted() : count(1) { }
 inline Refcounted::~Refcounted() { }
 
+// the registry and upb handlers are shared between interpreters when
+// running under ithreads, so the count must be updated atomically
 inline void Refcounted::ref() const {
     Refcounted *self = const_cast<Refcounted *>(this);
 
+#if defined(__GNUC__) || defined(__clang__)
+    __sync_add_and_fetch(&self->count, 1);
+#else
     ++self->count;
+#endif
 }
 
 inline void Refcounted::unref() const {
     Refcounted *self = const_cast<Refcounted *>(this);
 
+#if defined(__GNUC__) || defined(__clang__)
+    if (!__sync_sub_and_fetch(&self->count, 1))
+#else
     if (!--self->count)
+#endif
         delete self;
 }
 
@@ -59,7 +59,7 @@ namespace gpd {
         }
 
         const std::string &full_name() const { return _full_name; }
-        const std::vector<MethodDef> &methods() { return _methods; }
+        const std::vector<MethodDef> &methods() const { return _methods; }
 
     private:
         std::string _full_name;
@@ -0,0 +1,171 @@
+#include "workerpool.h"
+
+#ifdef GPD_WORKER_THREADS
+#include <pthread.h>
+#include <signal.h>
+
+#include <deque>
+#endif
+
+using namespace gpd;
+
+#ifdef GPD_WORKER_THREADS
+
+namespace {
+    // completion count of the jobs queued by a run_all() call
+    struct Group {
+        size_t pending;
+    };
+
+    struct Job {
+        WorkerPool::Function function;
+        void *arg;
+        // NULL for jobs queued by submit()
+        Group *group;
+    };
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    // signalled when jobs are queued
+    pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+    // broadcast when the last job of a group completes
+    pthread_cond_t group_done = PTHREAD_COND_INITIALIZER;
+    std::deque<Job> queue;
+    int thread_count = 0;
+    bool fork_handlers_installed = false;
+
+    void *worker_main(void *arg) {
+        pthread_mutex_lock(&mutex);
+        for (;;) {
+            while (queue.empty())
+                pthread_cond_wait(&job_queued, &mutex);
+            Job job = queue.front();
+
+            queue.pop_front();
+            pthread_mutex_unlock(&mutex);
+
+            job.function(job.arg);
+
+            pthread_mutex_lock(&mutex);
+            if (job.group && !--job.group->pending)
+                pthread_cond_broadcast(&group_done);
+        }
+
+        return NULL;
+    }
+
+    // takes a queued job of the group, if any, with the mutex held
+    bool take_job(Group *group, Job *job) {
+        for (std::deque<Job>::iterator it = queue.begin(), en = queue.end(); it != en; ++it) {
+            if (it->group == group) {
+                *job = *it;
+                queue.erase(it);
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // worker threads do not survive fork(), the child starts new ones
+    // when needed
+    void prepare_fork() {
+        pthread_mutex_lock(&mutex);
+    }
+
+    void parent_after_fork() {
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void child_after_fork() {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&job_queued, NULL);
+        pthread_cond_init(&group_done, NULL);
+        queue.clear();
+        thread_count = 0;
+    }
+}
+
+#endif
+
+WorkerPool::WorkerPool() {
+}
+
+WorkerPool *WorkerPool::instance(int threads) {
+    static WorkerPool pool;
+
+#ifdef GPD_WORKER_THREADS
+    pthread_mutex_lock(&mutex);
+    if (!fork_handlers_installed) {
+        pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+        fork_handlers_installed = true;
+    }
+    if (thread_count < threads) {
+        // Perl signal handlers must only run on interpreter threads, and
+        // new threads inherit the signal mask
+        sigset_t all, saved;
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        for (; thread_count < threads; ++thread_count) {
+            pthread_t thread;
+
+            // jobs also run on the calling thread, so it's not fatal
+            if (pthread_create(&thread, NULL, worker_main, NULL))
+                break;
+            pthread_detach(thread);
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    return &pool;
+}
+
+void WorkerPool::run_all(Function function, void **args, size_t count) {
+#ifdef GPD_WORKER_THREADS
+    Group group = { count };
+    Job job;
+
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < count; ++i) {
+        Job queued = { function, args[i], &group };
+
+        queue.push_back(queued);
+    }
+    pthread_cond_broadcast(&job_queued);
+
+    // the calling thread runs the jobs not yet taken by a worker
+    while (take_job(&group, &job)) {
+        pthread_mutex_unlock(&mutex);
+        job.function(job.arg);
+        pthread_mutex_lock(&mutex);
+        --group.pending;
+    }
+    while (group.pending)
+        pthread_cond_wait(&group_done, &mutex);
+    pthread_mutex_unlock(&mutex);
+#else
+    for (size_t i = 0; i < count; ++i)
+        function(args[i]);
+#endif
+}
+
+void WorkerPool::submit(Function function, void *arg) {
+#ifdef GPD_WORKER_THREADS
+    pthread_mutex_lock(&mutex);
+    if (thread_count) {
+        Job queued = { function, arg, NULL };
+
+        queue.push_back(queued);
+        pthread_cond_signal(&job_queued);
+        pthread_mutex_unlock(&mutex);
+
+        return;
+    }
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    function(arg);
+}
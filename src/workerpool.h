@@ -0,0 +1,36 @@
+#ifndef _GPD_XS_WORKERPOOL_INCLUDED
+#define _GPD_XS_WORKERPOOL_INCLUDED
+
+#include <cstddef>
+
+namespace gpd {
+
+// a process-wide set of native threads running Perl-free jobs; jobs
+// must not call any Perl API function
+//
+// without thread support (GPD_WORKER_THREADS not defined) jobs are run
+// on the calling thread
+class WorkerPool {
+public:
+    typedef void (*Function)(void *arg);
+
+    // starts worker threads on first use; the pool grows to the largest
+    // number of threads requested
+    static WorkerPool *instance(int threads);
+
+    // runs function(args[i]) for each argument, on the worker threads and
+    // on the calling thread, and returns when all calls have completed
+    void run_all(Function function, void **args, size_t count);
+
+    // runs function(arg) on a worker thread and returns immediately
+    void submit(Function function, void *arg);
+
+private:
+    WorkerPool();
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
+
+}
+
+#endif
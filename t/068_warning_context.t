@@ -0,0 +1,54 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->load_file("map.proto");
+$d->map({ package => 'test', prefix => 'Test1' });
+$d->map({ package => 'test', prefix => 'Test2', options => { warning_context => 0 } });
+$d->map({ package => 'test', prefix => 'Test3', options => { warning_context => 0, native_encoder => 1 } });
+
+my $uninit = "Use of uninitialized value in subroutine entry";
+my $persons = { persons => [{ id => 1, name => 'a' }, { name => undef, id => 3 }] };
+
+warning_like(
+    sub { Test1::PersonArray->encode($persons) },
+    qr/^While encoding field 'persons.\[1\].name': $uninit/,
+    'with warning context',
+);
+
+for my $prefix (qw(Test2 Test3)) {
+    warning_like(
+        sub { "${prefix}::PersonArray"->encode($persons) },
+        qr/^$uninit/,
+        "$prefix: encode without warning context",
+    );
+
+    warning_like(
+        sub { "${prefix}::Maps"->encode({ string_int32_map => { foo => undef } }) },
+        qr/^$uninit/,
+        "$prefix: map without warning context",
+    );
+
+    warning_like(
+        sub { "${prefix}::PersonArray"->encode_json($persons) },
+        qr/^$uninit/,
+        "$prefix: JSON without warning context",
+    );
+
+    {
+        my @warnings;
+        local $SIG{__WARN__} = sub { push @warnings, $_[0] };
+
+        "${prefix}::PersonArray"->encode($persons);
+        is(scalar @warnings, 1, "$prefix: handler is called once");
+    }
+}
+
+# the context is still reported after encoding without it
+warning_like(
+    sub { Test1::PersonArray->encode($persons) },
+    qr/^While encoding field 'persons.\[1\].name': $uninit/,
+    'warning context after encoding without it',
+);
+
+done_testing();
@@ -0,0 +1,71 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("scalar.proto");
+$d->load_file("message.proto");
+$d->load_file("map.proto");
+$d->load_file("person.proto");
+$d->map({ package => 'test', prefix => 'Test' });
+
+my $basic = Test::Basic->encode({ int32_f => 1, string_f => 'abc', bytes_f => 'def', double_f => 0.5 });
+eq_or_diff(Test::Basic->decode_partial($basic, ['int32_f']),
+           Test::Basic->new({ int32_f => 1 }), 'scalar field');
+eq_or_diff(Test::Basic->decode_partial($basic, ['string_f', 'double_f', 'string_f']),
+           Test::Basic->new({ string_f => 'abc', double_f => 0.5 }), 'multiple fields');
+eq_or_diff(Test::Basic->decode_partial($basic, []),
+           Test::Basic->new({}), 'no fields');
+
+my $outer = Test::OuterWithMessage->encode({
+    optional_inner => { value => 1, other => 2 },
+    repeated_inner => [{ value => 3, other => 4 }, { other => 5 }],
+});
+eq_or_diff(Test::OuterWithMessage->decode_partial($outer, ['optional_inner']),
+           Test::OuterWithMessage->new({ optional_inner => Test::Inner->new({ value => 1, other => 2 }) }),
+           'whole message field');
+eq_or_diff(Test::OuterWithMessage->decode_partial($outer, ['optional_inner.value', 'repeated_inner.other']),
+           Test::OuterWithMessage->new({
+               optional_inner => Test::Inner->new({ value => 1 }),
+               repeated_inner => [Test::Inner->new({ other => 4 }), Test::Inner->new({ other => 5 })],
+           }),
+           'sub-message fields');
+eq_or_diff(Test::OuterWithMessage->decode_partial($outer, ['optional_inner', 'optional_inner.value']),
+           Test::OuterWithMessage->new({ optional_inner => Test::Inner->new({ value => 1, other => 2 }) }),
+           'whole message field wins');
+
+my $maps = Test::Maps->encode({ string_int32_map => { a => 1, b => 2 } });
+eq_or_diff(Test::Maps->decode_partial($maps, ['string_int32_map']),
+           Test::Maps->new({ string_int32_map => { a => 1, b => 2 } }), 'map field');
+
+my $person = Test::Person->encode({ name => 'foo', id => 7 });
+eq_or_diff(Test::Person->decode_partial($person, ['id']),
+           Test::Person->new({ id => 7 }), 'required fields are not checked');
+
+# the cached decoder is used for the same set of paths
+for (1 .. 2) {
+    eq_or_diff(Test::Basic->decode_partial($basic, ['bytes_f', 'int32_f']),
+               Test::Basic->new({ int32_f => 1, bytes_f => 'def' }), 'cached decoder');
+}
+eq_or_diff(Test::Basic->decode($basic)->{string_f}, 'abc', 'full decoder still works');
+
+throws_ok(
+    sub { Test::Basic->decode_partial($basic, ['foo']) },
+    qr/Unknown field 'foo' in message 'test.Basic'/,
+);
+throws_ok(
+    sub { Test::Basic->decode_partial($basic, ['int32_f.value']) },
+    qr/Field 'test.Basic.int32_f' is not a message field/,
+);
+throws_ok(
+    sub { Test::Maps->decode_partial($maps, ['string_int32_map.key']) },
+    qr/Field 'test.Maps.string_int32_map' is not a message field/,
+);
+throws_ok(
+    sub { Test::Basic->decode_partial($basic, 'int32_f') },
+    qr/Usage: \$class->decode_partial/,
+);
+throws_ok(
+    sub { Test::Basic->decode_partial("\x0a", ['int32_f']) },
+    qr/Deserialization failed/,
+);
+
+done_testing();
@@ -0,0 +1,41 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->map_message("test.Person", "Person");
+$d->resolve_references();
+
+my @encoded = (
+    "\x0a\x03foo\x10\x1f",
+    "\x0a\x03bar\x10\x20\x1a\x0cbar\@test.com",
+    "\x0a\x00\x10\x00",
+);
+my @decoded = (
+    Person->new({ id => 31, name => 'foo' }),
+    Person->new({ id => 32, name => 'bar', email => 'bar@test.com' }),
+    Person->new({ id => 0, name => '' }),
+);
+
+eq_or_diff(Person->decode_many(\@encoded), \@decoded, 'decode_many');
+eq_or_diff(Person->decode_many([]), [], 'decode_many, empty list');
+
+eq_or_diff(Person->decode_stream(join '', map chr(length $_) . $_, @encoded),
+           \@decoded, 'decode_stream');
+eq_or_diff(Person->decode_stream(''), [], 'decode_stream, empty buffer');
+
+throws_ok(
+    sub { Person->decode_many([$encoded[0], "\x0a\x03foo"]) },
+    qr/Deserialization failed: Missing required field test.Person.id/,
+);
+
+throws_ok(
+    sub { Person->decode_stream("\x07\x0a\x03foo\x10\x1f\x07\x0a\x03") },
+    qr/Deserialization failed: Truncated length-delimited message at offset 8/,
+);
+
+throws_ok(
+    sub { Person->decode_many("\x0a\x03foo\x10\x1f") },
+    qr/Usage: \$class->decode_many/,
+);
+
+done_testing();
@@ -0,0 +1,47 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->map_message("test.Person", "Person");
+$d->resolve_references();
+
+my @encoded = (
+    "\x0a\x03foo\x10\x1f",
+    "\x0a\x03bar\x10\x20\x1a\x0cbar\@test.com",
+);
+my @objects = (
+    Person->new({ id => 31, name => 'foo' }),
+    { id => 32, name => 'bar', email => 'bar@test.com' },
+);
+
+eq_or_diff(Person->encode_many(\@objects), join('', @encoded),
+           'concatenated');
+eq_or_diff(Person->encode_many(\@objects, delimited => 1),
+           join('', map chr(length $_) . $_, @encoded),
+           'delimited');
+eq_or_diff(Person->encode_many([], delimited => 1), '',
+           'empty list');
+eq_or_diff(Person->decode_stream(Person->encode_many(\@objects, delimited => 1)),
+           [map Person->new($_), @objects],
+           'round trip');
+
+{
+    my $long = { id => 1, name => 'x' x 200 };
+    my $encoded = Person->encode($long);
+
+    eq_or_diff(Person->encode_many([$long, $long], delimited => 1),
+               ("\xcd\x01" . $encoded) x 2,
+               'multi-byte length prefix');
+}
+
+throws_ok(
+    sub { Person->encode_many([$objects[0], { name => 'foo' }]) },
+    qr/Serialization failed: Missing required field 'test.Person.id'/,
+);
+
+throws_ok(
+    sub { Person->encode_many(\@objects, invalid => 1) },
+    qr/Invalid option 'invalid' for encode_many/,
+);
+
+done_testing();
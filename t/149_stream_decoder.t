@@ -0,0 +1,147 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->map_message("test.Person", "Person");
+$d->resolve_references();
+
+my @encoded = (
+    "\x0a\x03foo\x10\x1f",
+    "\x0a\x03bar\x10\x20\x1a\x0cbar\@test.com",
+    "\x0a\x00\x10\x00",
+);
+my @decoded = (
+    Person->new({ id => 31, name => 'foo' }),
+    Person->new({ id => 32, name => 'bar', email => 'bar@test.com' }),
+    Person->new({ id => 0, name => '' }),
+);
+my $stream = join '', map chr(length $_) . $_, @encoded;
+
+sub drain {
+    my ($decoder) = @_;
+    my @messages;
+
+    while (my $message = $decoder->next) {
+        push @messages, $message;
+    }
+
+    return @messages;
+}
+
+{
+    my $decoder = Person->stream_decoder;
+
+    is($decoder->next, undef, 'no data');
+    $decoder->feed($stream);
+    eq_or_diff([drain($decoder)], \@decoded, 'single chunk');
+    is($decoder->pending_bytes, 0, 'all data consumed');
+}
+
+for my $size (1 .. 7) {
+    my $decoder = Person->stream_decoder;
+    my @messages;
+
+    for (my $offset = 0; $offset < length $stream; $offset += $size) {
+        $decoder->feed(substr $stream, $offset, $size);
+        push @messages, drain($decoder);
+    }
+
+    eq_or_diff(\@messages, \@decoded, "chunks of $size bytes");
+    is($decoder->pending_bytes, 0, "chunks of $size bytes, all data consumed");
+}
+
+{
+    open my $fh, '<', \$stream;
+    my $decoder = Person->stream_decoder;
+    my @messages;
+
+    while ($decoder->feed_from($fh, 5)) {
+        push @messages, drain($decoder);
+    }
+
+    eq_or_diff(\@messages, \@decoded, 'read from filehandle');
+}
+
+{
+    my $decoder = Person->stream_decoder;
+
+    $decoder->feed(substr $stream, 0, 10);
+    drain($decoder);
+    is($decoder->pending_bytes, 2, 'partial message pending');
+}
+
+{
+    my $decoder = Person->stream_decoder;
+
+    $decoder->feed("\x05\x0a\x03foo");
+    throws_ok(
+        sub { $decoder->next },
+        qr/Deserialization failed: Missing required field test.Person.id/,
+    );
+}
+
+{
+    my $decoder = Person->stream_decoder;
+    my $buffer = substr $stream, 0, 10;
+
+    $decoder->feed($buffer);
+    substr $buffer, 0, 10, "\0" x 10;
+    $decoder->feed(substr $stream, 10);
+    eq_or_diff([drain($decoder)], \@decoded, 'fed buffer is copied');
+}
+
+{
+    my $many = $stream x 200;
+    open my $fh, '<', \$many;
+    my $decoder = Person->stream_decoder;
+
+    $decoder->feed_from($fh, length $many);
+    eq_or_diff([drain($decoder)], [(@decoded) x 200], 'many messages in one read');
+    is($decoder->pending_bytes, 0, 'many messages, all data consumed');
+}
+
+{
+    my $decoder = Person->stream_decoder;
+
+    $decoder->feed("\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01");
+    throws_ok(
+        sub { $decoder->next },
+        qr/Deserialization failed: Invalid length prefix/,
+        'huge length prefix',
+    );
+
+    $decoder = Person->stream_decoder;
+    $decoder->feed("\xff\xff\xff");
+    is($decoder->next, undef, 'partial length prefix');
+    $decoder->feed("\xff\xff\xff\xff\xff\xff\x01\x0a");
+    throws_ok(
+        sub { $decoder->next },
+        qr/Deserialization failed: Invalid length prefix/,
+        'huge length prefix across chunks',
+    );
+}
+
+{
+    open my $fh, '<', \$stream;
+    my $decoder = Person->stream_decoder;
+
+    throws_ok(
+        sub { $decoder->feed_from($fh, -1) },
+        qr/Invalid negative size -1/,
+        'negative size',
+    );
+}
+
+{
+    my $unresolved = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $unresolved->load_file("person.proto");
+    $unresolved->map_message("test.Person", "UnresolvedPerson");
+
+    throws_ok(
+        sub { UnresolvedPerson->stream_decoder },
+        qr/It looks like resolve_references\(\) was not called/,
+        'unresolved references',
+    );
+}
+
+done_testing();
@@ -0,0 +1,75 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->map_message("test.Person", "Person");
+$d->resolve_references();
+
+my @encoded = (
+    "\x0a\x03foo\x10\x1f",
+    "\x0a\x03bar\x10\x20\x1a\x0cbar\@test.com",
+);
+my @objects = (
+    Person->new({ id => 31, name => 'foo' }),
+    { id => 32, name => 'bar', email => 'bar@test.com' },
+);
+
+{
+    my $buffer;
+
+    is(Person->encode_into($objects[0], $buffer), length $encoded[0], 'length');
+    eq_or_diff($buffer, $encoded[0], 'undefined buffer');
+    is(Person->encode_into($objects[1], $buffer), length $encoded[1], 'length');
+    eq_or_diff($buffer, $encoded[0] . $encoded[1], 'appended');
+    Person->encode_into($objects[1], $buffer, 0);
+    eq_or_diff($buffer, $encoded[1], 'offset 0 truncates');
+    Person->encode_into($objects[0], $buffer, 2);
+    eq_or_diff($buffer, substr($encoded[1], 0, 2) . $encoded[0], 'offset in the middle');
+}
+
+{
+    my $buffer = 'abc';
+
+    is(Person->encode_into($objects[1], $buffer, undef, delimited => 1),
+       length($encoded[1]) + 1, 'length');
+    eq_or_diff($buffer, 'abc' . chr(length $encoded[1]) . $encoded[1], 'delimited');
+    eq_or_diff(Person->decode_stream(substr $buffer, 3),
+               [Person->new($objects[1])],
+               'round trip');
+}
+
+{
+    my $buffer = '';
+    my $long = { id => 1, name => 'x' x 200 };
+    my $encoded = Person->encode($long);
+
+    Person->encode_into($long, $buffer, 0, delimited => 1) for 1 .. 2;
+    eq_or_diff($buffer, "\xcd\x01" . $encoded, 'multi-byte length prefix');
+}
+
+{
+    my $buffer = 'abc';
+
+    throws_ok(
+        sub { Person->encode_into({ name => 'foo' }, $buffer, 1) },
+        qr/Serialization failed: Missing required field 'test.Person.id'/,
+    );
+    eq_or_diff($buffer, 'a', 'truncated on error');
+
+    throws_ok(
+        sub { Person->encode_into($objects[0], $buffer, 2) },
+        qr/Offset 2 is outside the string/,
+    );
+
+    throws_ok(
+        sub { Person->encode_into($objects[0], $buffer, 0, invalid => 1) },
+        qr/Invalid option 'invalid' for encode_into/,
+    );
+
+    throws_ok(
+        sub { Person->encode_into($objects[0], $buffer, 0, 'delimited') },
+        qr/Usage: \$class->encode_into/,
+    );
+}
+
+done_testing();
@@ -0,0 +1,65 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->load_file("scalar.proto");
+$d->load_file("repeated.proto");
+$d->load_file("message.proto");
+$d->load_file("map.proto");
+$d->map({ package => 'test', prefix => 'Test' });
+
+my $long = 'x' x 300;
+my @tests = (
+    Basic => {},
+    Basic => {
+        double_f    => 0.125,
+        float_f     => 0.25,
+        int32_f     => -2,
+        uint32_f    => 4000000000,
+        string_f    => "\x{101}",
+        bytes_f     => $long,
+        sint32_f    => -7,
+        sint64_f    => -8,
+        fixed32_f   => 9,
+        sfixed64_f  => -12,
+    },
+    Repeated => {
+        int32_f     => [1, -1, 300],
+        string_f    => ['a', '', $long],
+    },
+    Packed => {
+        double_f    => [1.5, 2.5],
+        int32_f     => [1, -1, 300],
+        uint64_f    => [(1000) x 50],
+        bool_f      => [],
+    },
+    OuterWithMessage => {
+        optional_inner => { value => 1 },
+        repeated_inner => [({ value => 200, other => -1 }) x 20],
+    },
+    OuterWithGroup => {
+        inner => [{ value => 1 }, { value => 2 }],
+    },
+    Maps => {
+        string_int32_map => { a => 1, $long => 3 },
+    },
+);
+
+while (my ($message, $value) = splice @tests, 0, 2) {
+    is("Test::$message"->encoded_size($value),
+       length("Test::$message"->encode($value)),
+       "$message - size");
+}
+
+{
+    my $person = Test::Person->new({ id => 31, name => 'foo' });
+
+    is($person->encoded_size, length($person->encode), 'object method');
+}
+
+throws_ok(
+    sub { Test::Person->encoded_size({ name => 'foo' }) },
+    qr/Serialization failed: Missing required field 'test.Person.id'/,
+);
+
+done_testing();
@@ -0,0 +1,95 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("map_proto2.proto");
+$d->map_message("test.Maps", "Maps", { implicit_maps => 1 });
+$d->map_message("test.Item", "Item");
+$d->resolve_references();
+
+my $d1 = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d1->load_file("map_proto2.proto");
+$d1->map_message("test.Maps", "NoMaps", { implicit_maps => 0 });
+$d1->map_message("test.Item", "NoItem");
+$d1->resolve_references();
+
+my $incomplete = NoMaps->encode({
+    string_int32_map => [{ key => 'a' }, { key => 'b', value => 2 }],
+    int32_message_map => [{ key => 1, value => { one_value => 3 } }],
+});
+my $complete = Maps->encode({ string_int32_map => { c => 3 } });
+
+{
+    # the warning handler runs while the outer decode call is in progress
+    my @nested;
+    local $SIG{__WARN__} = sub {
+        push @nested, Maps->decode($complete);
+    };
+    my $decoded = Maps->decode($incomplete);
+
+    eq_or_diff($decoded, Maps->new({
+        string_int32_map  => { b => 2 },
+        int32_message_map => { 1 => Item->new({ one_value => 3 }) },
+    }), 'outer decode');
+    eq_or_diff(\@nested, [Maps->new({ string_int32_map => { c => 3 } })], 'nested decode');
+}
+
+{
+    my @nested;
+    local $SIG{__WARN__} = sub {
+        push @nested, eval { Maps->decode("\x0a") } ? 'decoded' : $@;
+    };
+    my $decoded = Maps->decode($incomplete);
+
+    is($decoded->{string_int32_map}{b}, 2, 'outer decode after nested failure');
+    like($nested[0], qr/Deserialization failed/, 'nested decode failure');
+}
+
+{
+    # the warning handler runs while the outer encode call is in progress
+    my @nested;
+    local $SIG{__WARN__} = sub {
+        push @nested, Maps->encode({ string_int32_map => { c => 3 } });
+    };
+    my $encoded = Maps->encode({ string_int32_map => { a => 'abc' } });
+
+    eq_or_diff(Maps->decode($encoded), Maps->new({ string_int32_map => { a => 0 } }), 'outer encode');
+    eq_or_diff(\@nested, [$complete], 'nested encode');
+}
+
+{
+    # warnings of a nested encode call, and of the outer call after it
+    my (@outer, @inner);
+    my $strip = sub { (my $warning = $_[0]) =~ s/ at \S+ line \d+\.\n\z//; $warning };
+    local $SIG{__WARN__} = sub {
+        push @outer, $strip->($_[0]);
+        local $SIG{__WARN__} = sub { push @inner, $strip->($_[0]) };
+        Maps->encode({ string_int32_map => { c => undef } });
+    };
+    Maps->encode({
+        string_int32_map => { a => undef },
+        int32_message_map => { 1 => { one_value => undef } },
+    });
+
+    my $uninit = "Use of uninitialized value in subroutine entry";
+    eq_or_diff(\@outer, [
+        "While encoding field 'string_int32_map.{a}': $uninit",
+        "While encoding field 'int32_message_map.{1}.one_value': $uninit",
+    ], 'outer encode warnings');
+    eq_or_diff(\@inner, [
+        ("While encoding field 'string_int32_map.{c}': $uninit") x 2,
+    ], 'nested encode warnings');
+}
+
+{
+    # the stream decoder keeps its decoding state across calls
+    my $decoder = Maps->stream_decoder;
+    $decoder->feed(join '', map { pack('w', length) . $_ } $complete, $complete);
+
+    my $first = $decoder->next;
+    my $other = Maps->decode($complete);
+    my $second = $decoder->next;
+
+    eq_or_diff([$first, $other, $second], [($other) x 3], 'stream decoder');
+}
+
+done_testing();
@@ -0,0 +1,107 @@
+use t::lib::Test;
+
+use POSIX ();
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->map_message("test.Person", "Person");
+$d->map_message("test.PersonArray", "PersonArray");
+$d->resolve_references();
+
+sub wait_readable {
+    my ($fd) = @_;
+    my $bits = '';
+
+    vec($bits, $fd, 1) = 1;
+    select($bits, undef, undef, 10);
+
+    return vec($bits, $fd, 1);
+}
+
+{
+    my $encoded = "\x0a\x03foo\x10\x1f\x1a\x0cfoo\@test.com";
+    my $pending = Person->decode_async($encoded);
+
+    substr $encoded, 2, 3, 'bar';
+    eq_or_diff($pending->result, Person->new({ id => 31, name => 'foo', email => 'foo@test.com' }), 'result');
+    ok($pending->ready, 'ready after result');
+    is($pending->result, $pending->result, 'same result');
+}
+
+{
+    my $persons = PersonArray->new({
+        persons => [map { { name => "Person $_", id => $_ } } 1 .. 1000],
+    });
+    my $pending = PersonArray->decode_async(PersonArray->encode($persons));
+
+    SKIP: {
+        my $fd = $pending->fileno;
+        skip 'no worker threads', 2 unless defined $fd;
+
+        ok(wait_readable($fd), 'file descriptor is readable');
+        ok($pending->ready, 'ready');
+    }
+    eq_or_diff($pending->result, $persons, 'large message');
+}
+
+{
+    my $pending = Person->decode_async("\x0a\x03foo");
+
+    throws_ok(
+        sub { $pending->result },
+        qr/Deserialization failed: Missing required field test.Person.id/,
+        'missing required field',
+    );
+    throws_ok(
+        sub { $pending->result },
+        qr/Deserialization failed: Missing required field test.Person.id/,
+        'error is reported again',
+    );
+}
+
+{
+    my $pending = Person->decode_async("\x0a\x03fo");
+
+    throws_ok(
+        sub { $pending->result },
+        qr/Deserialization failed: Unexpected EOF inside delimited string/,
+        'malformed input',
+    );
+}
+
+{
+    # destroyed while the decode is pending
+    my $pending = PersonArray->decode_async(PersonArray->encode({
+        persons => [map { { name => "Person $_", id => $_ } } 1 .. 1000],
+    }));
+    undef $pending;
+    pass('destroyed before completion');
+}
+
+SKIP: {
+    skip 'fork not available', 2 if $^O eq 'MSWin32';
+
+    my $persons = PersonArray->new({
+        persons => [map { { name => "Person $_", id => $_ } } 1 .. 20000],
+    });
+    my $pending = PersonArray->decode_async(PersonArray->encode($persons));
+    my $pending_destroyed = PersonArray->decode_async(PersonArray->encode($persons));
+
+    # forks while the background decode is (likely) running
+    my $pid = fork;
+    die "fork: $!" unless defined $pid;
+    if (!$pid) {
+        undef $pending_destroyed;
+        my $ok = eval {
+            my $result = $pending->result;
+
+            @{$result->{persons}} == 20000 && $result->{persons}[-1]{name} eq 'Person 20000';
+        };
+        POSIX::_exit($ok ? 0 : 1);
+    }
+    waitpid $pid, 0;
+    is($?, 0, 'result in a child process');
+    eq_or_diff($pending->result, $persons, 'result in the parent process');
+}
+
+done_testing();
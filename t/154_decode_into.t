@@ -0,0 +1,123 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("message.proto");
+$d->load_file("map.proto");
+$d->load_file("oneof.proto");
+$d->load_file("person.proto");
+$d->load_file("scalar.proto");
+$d->map({ package => 'test', prefix => 'Test' });
+$d->map({ package => 'test', prefix => 'TestZeroCopy', options => { zero_copy_bytes => 1 } });
+$d->map({ package => 'test', prefix => 'TestDefaults', options => { explicit_defaults => 1 } });
+
+{
+    my $first = { optional_inner => { value => 1 }, repeated_inner => [{ value => 2 }, { value => 3, other => 4 }] };
+    my $second = { repeated_inner => [{ other => 5 }] };
+    my $msg = Test::OuterWithMessage->new;
+
+    Test::OuterWithMessage->decode_into($msg, Test::OuterWithMessage->encode($first));
+    eq_or_diff($msg, Test::OuterWithMessage->new($first), 'decode into empty message');
+
+    my $inner = $msg->{repeated_inner}[0];
+    Test::OuterWithMessage->decode_into($msg, Test::OuterWithMessage->encode($second));
+    eq_or_diff($msg, Test::OuterWithMessage->new($second), 'fields are replaced');
+    is($msg->{repeated_inner}[0], $inner, 'sub-message hash is reused');
+    isa_ok($msg->{repeated_inner}[0], 'Test::Inner');
+
+    Test::OuterWithMessage->decode_into($msg, Test::OuterWithMessage->encode($first));
+    eq_or_diff($msg, Test::OuterWithMessage->new($first), 'fields are added back');
+
+    Test::OuterWithMessage->decode_into($msg, Test::OuterWithMessage->encode($second), merge => 1);
+    eq_or_diff($msg, Test::OuterWithMessage->new({
+        optional_inner => { value => 1 },
+        repeated_inner => [{ value => 2 }, { value => 3, other => 4 }, { other => 5 }],
+    }), 'merge');
+
+    my $plain = {};
+    Test::OuterWithMessage->decode_into($plain, Test::OuterWithMessage->encode($first));
+    eq_or_diff($plain, Test::OuterWithMessage->decode(Test::OuterWithMessage->encode($first)), 'plain hash');
+}
+
+{
+    my $msg = Test::Maps->new({ string_int32_map => { a => 1, b => 2 } });
+
+    Test::Maps->decode_into($msg, Test::Maps->encode({ string_int32_map => { c => 3 } }));
+    eq_or_diff($msg, Test::Maps->new({ string_int32_map => { c => 3 } }), 'map replaced');
+
+    Test::Maps->decode_into($msg, Test::Maps->encode({ string_int32_map => { a => 1, c => 4 } }), merge => 1);
+    eq_or_diff($msg, Test::Maps->new({ string_int32_map => { a => 1, c => 4 } }), 'map merged');
+
+    Test::Maps->decode_into($msg, Test::Maps->encode({}));
+    eq_or_diff($msg, Test::Maps->new({}), 'map removed');
+}
+
+{
+    my $msg = Test::OneOf1->new({ value1 => 1, value2 => 'abc' });
+
+    Test::OneOf1->decode_into($msg, Test::OneOf1->encode({ value3 => 7 }), merge => 1);
+    eq_or_diff($msg, Test::OneOf1->new({ value1 => 1, value3 => 7 }), 'merge replaces oneof member');
+
+    Test::OneOf1->decode_into($msg, Test::OneOf1->encode({ value4 => 8 }));
+    eq_or_diff($msg, Test::OneOf1->new({ value4 => 8 }), 'oneof replaced');
+}
+
+for my $prefix (qw(Test TestZeroCopy)) {
+    my $class = "${prefix}::Basic";
+    my $msg = $class->decode($class->encode({ string_f => "\x{1000}old", bytes_f => 'old bytes' }));
+
+    $class->decode_into($msg, $class->encode({ string_f => 'new', bytes_f => "\xffnew" }), merge => 1);
+    eq_or_diff($msg, $class->new({ string_f => 'new', bytes_f => "\xffnew" }), "$prefix - merge replaces strings and bytes");
+    ok(!utf8::is_utf8($msg->{bytes_f}), "$prefix - merged bytes value is not UTF-8");
+
+    $class->decode_into($msg, $class->encode({ int32_f => 3 }), merge => 1);
+    eq_or_diff($msg, $class->new({ string_f => 'new', bytes_f => "\xffnew", int32_f => 3 }), "$prefix - merge keeps strings and bytes");
+
+    $class->decode_into($msg, $class->encode({ string_f => '', bytes_f => '' }), merge => 1);
+    eq_or_diff($msg, $class->new({ string_f => '', bytes_f => '', int32_f => 3 }), "$prefix - merge empty strings and bytes");
+}
+
+{
+    my $msg = Test::Person->new({ id => 1, name => 'foo' });
+
+    Test::Person->decode_into($msg, "\x1a\x0ffoo\@example.com", merge => 1);
+    eq_or_diff($msg, Test::Person->new({ id => 1, name => 'foo', email => 'foo@example.com' }),
+               'merge with required fields already set');
+
+    my $outer = Test::PersonArray->new({ persons => [{ id => 1, name => 'foo' }] });
+    throws_ok(
+        sub { Test::PersonArray->decode_into($outer, "\x0a\x05\x0a\x03bar", merge => 1) },
+        qr/Deserialization failed: Missing required field test.Person.id/,
+        'merged repeated messages are checked',
+    );
+}
+
+{
+    my $msg = TestDefaults::Default->new({ int32_f => 42 });
+
+    TestDefaults::Default->decode_into($msg, TestDefaults::Default->encode({ string_f => 'abc' }), merge => 1);
+    is($msg->{int32_f}, 42, 'merge keeps values with defaults');
+    is($msg->{string_f}, 'abc', 'merged value');
+    is($msg->{uint32_f}, 5, 'default applied');
+}
+
+{
+    my $msg = Test::Person->new({ id => 1, name => 'foo', email => 'foo@example.com' });
+
+    throws_ok(
+        sub { Test::Person->decode_into($msg, "\x0a\x03bar") },
+        qr/Deserialization failed: Missing required field test.Person.id/,
+        'missing required field',
+    );
+    throws_ok(
+        sub { Test::Person->decode_into([], "") },
+        qr/Usage: \$class->decode_into/,
+        'not a hash',
+    );
+    throws_ok(
+        sub { Test::Person->decode_into($msg, "", foo => 1) },
+        qr/Invalid option 'foo' for decode_into/,
+        'invalid option',
+    );
+}
+
+done_testing();
@@ -0,0 +1,67 @@
+use t::lib::Test;
+
+my $oneofs = join "\n", map "    oneof o$_ { int32 v$_ = ${\ ($_ + 1)}; }", 0 .. 64;
+my $proto = <<"EOT";
+syntax = "proto3";
+
+package test;
+
+message ManyOneofs {
+$oneofs
+}
+
+message Tree {
+    map<string, Tree> children = 1;
+    map<string, int32> values = 2;
+    ManyOneofs oneofs = 3;
+}
+EOT
+
+my $d = Google::ProtocolBuffers::Dynamic->new;
+$d->load_string("allocations.proto", $proto);
+$d->map({ package => 'test', prefix => 'Test1', options => { deterministic => 1 } });
+$d->map({ package => 'test', prefix => 'Test2', options => { deterministic => 1, native_encoder => 1 } });
+$d->map({ package => 'test', prefix => 'Test3', options => { native_encoder => 1, warning_context => 1 } });
+
+# nested maps with byte string (non-UTF-8) keys
+my $tree = {
+    values   => { "\xe9t\xe9" => 1, "b" => 2, "\xe0" => 3 },
+    oneofs   => { v0 => 1, v64 => 2 },
+    children => {
+        "\xe8re" => {
+            values   => { "\xf9" => 4, "a" => 5 },
+            children => { "x" => { values => { "\xff" => 6 } } },
+        },
+        "ab" => { oneofs => { v63 => 3 } },
+    },
+};
+
+my $encoded = Test1::Tree->encode($tree);
+is(Test2::Tree->encode($tree), $encoded, 'same deterministic output');
+eq_or_diff(Test1::Tree->decode($encoded), Test1::Tree->new($tree), 'round trip');
+eq_or_diff(Test3::Tree->decode(Test3::Tree->encode($tree)), Test3::Tree->new($tree), 'round trip, not sorted');
+
+SKIP: {
+    skip 'Build with --count-allocations to count allocations', 3
+        unless defined &Google::ProtocolBuffers::Dynamic::Mapper::_allocation_count;
+
+    for my $prefix (qw(Test1 Test2 Test3)) {
+        my $buffer = '';
+        my $encode = sub {
+            "${prefix}::Tree"->encode_into($tree, $buffer, 0);
+            "${prefix}::Tree"->encode($tree);
+            "${prefix}::Tree"->encoded_size($tree);
+            "${prefix}::Tree"->encode_many([$tree, $tree], delimited => 1);
+        };
+
+        # the first calls size the reused buffers
+        $encode->() for 1 .. 2;
+        my $allocations = Google::ProtocolBuffers::Dynamic::Mapper::_allocation_count();
+        $encode->() for 1 .. 100;
+
+        is(Google::ProtocolBuffers::Dynamic::Mapper::_allocation_count(), $allocations,
+           "$prefix: no allocations in steady state");
+    }
+}
+
+done_testing();
@@ -0,0 +1,61 @@
+use t::lib::Test;
+
+use B;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->load_file("map.proto");
+$d->map({ package => 'test', prefix => 'Test' });
+
+sub persons {
+    my ($count) = @_;
+
+    return Test::PersonArray->new({
+        persons => [map { { name => "Person $_", id => $_ } } 1 .. $count],
+    });
+}
+
+sub maps {
+    my ($count) = @_;
+
+    return Test::Maps->new({
+        string_int32_map => { map { ("key $_" => $_) } 1 .. $count },
+    });
+}
+
+# sizes larger and smaller than the previous value, and over the cap
+for my $count (100, 1, 3, 2000, 2, 50) {
+    my $persons = persons($count);
+    my $decoded = Test::PersonArray->decode(Test::PersonArray->encode($persons));
+
+    eq_or_diff($decoded, $persons, "array of $count elements");
+    is(scalar @{$decoded->{persons}}, $count, "array of $count elements, size");
+
+    my $maps = maps($count);
+    eq_or_diff(Test::Maps->decode(Test::Maps->encode($maps)), $maps, "map of $count elements");
+}
+
+{
+    Test::PersonArray->decode(Test::PersonArray->encode(persons(100)));
+    my $decoded = Test::PersonArray->decode(Test::PersonArray->encode(persons(50)));
+
+    cmp_ok(B::svref_2object($decoded->{persons})->MAX, '>=', 99, 'array pre-extended from the last size');
+    push @{$decoded->{persons}}, Test::Person->new({ name => 'x', id => 2 });
+    is(scalar @{$decoded->{persons}}, 51, 'pre-extended array can grow');
+
+    Test::Maps->decode(Test::Maps->encode(maps(100)));
+    my $maps = Test::Maps->decode(Test::Maps->encode(maps(50)));
+
+    cmp_ok(B::svref_2object($maps->{string_int32_map})->MAX, '>=', 99, 'map hash pre-sized from the last size');
+}
+
+{
+    # the size of the input bounds the pre-sized size
+    Test::PersonArray->decode(Test::PersonArray->encode(persons(2000)));
+    my $encoded = Test::PersonArray->encode(persons(1));
+    my $decoded = Test::PersonArray->decode($encoded);
+
+    cmp_ok(B::svref_2object($decoded->{persons})->MAX, '<', length $encoded, 'array size bounded by the input');
+}
+
+done_testing();
@@ -0,0 +1,64 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("map_proto2.proto");
+$d->map_message("test.Maps", "Maps", { implicit_maps => 1, deterministic => 1 });
+$d->map_message("test.Item", "Item", { deterministic => 1 });
+$d->resolve_references();
+
+my $native = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$native->load_file("map_proto2.proto");
+$native->map_message("test.Maps", "NativeMaps", { implicit_maps => 1, deterministic => 1, native_encoder => 1 });
+$native->map_message("test.Item", "NativeItem", { deterministic => 1, native_encoder => 1 });
+$native->resolve_references();
+
+sub entry {
+    my ($field, $key, $value) = @_;
+    my $entry = $key . $value;
+
+    return chr($field << 3 | 2) . chr(length $entry) . $entry;
+}
+
+for my $class (qw(Maps NativeMaps)) {
+    is($class->encode({ string_int32_map => { b => 2, a => 1, ab => 3, "\x{e0}" => 4 } }),
+       join('',
+            entry(1, "\x0a\x01a", "\x10\x01"),
+            entry(1, "\x0a\x02ab", "\x10\x03"),
+            entry(1, "\x0a\x01b", "\x10\x02"),
+            entry(1, "\x0a\x02\xc3\xa0", "\x10\x04"),
+       ),
+       "$class - string keys");
+
+    is($class->encode({ int64_int32_map => { 10 => 1, -1 => 2, 9 => 3 } }),
+       join('',
+            entry(4, "\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", "\x10\x02"),
+            entry(4, "\x08\x09", "\x10\x03"),
+            entry(4, "\x08\x0a", "\x10\x01"),
+       ),
+       "$class - signed keys");
+
+    is($class->encode({ uint32_enum_map => { 10 => 1, 200 => 2, 9 => 3 } }),
+       join('',
+            entry(5, "\x08\x09", "\x10\x03"),
+            entry(5, "\x08\x0a", "\x10\x01"),
+            entry(5, "\x08\xc8\x01", "\x10\x02"),
+       ),
+       "$class - unsigned keys");
+
+    is($class->encode({ bool_int32_map => { 1 => 1, 0 => 2 } }),
+       join('',
+            entry(2, "\x08\x00", "\x10\x02"),
+            entry(2, "\x08\x01", "\x10\x01"),
+       ),
+       "$class - boolean keys");
+
+    # the same content always produces the same output, regardless of
+    # insertion order
+    my %first = map { ("key$_" => $_) } 1 .. 100;
+    my %second = map { ("key$_" => $_) } reverse 1 .. 100;
+    is($class->encode({ string_int32_map => \%first }),
+       $class->encode({ string_int32_map => \%second }),
+       "$class - same content, same output");
+}
+
+done_testing();
@@ -0,0 +1,82 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("scalar.proto");
+$d->load_file("repeated.proto");
+$d->map({ package => 'test', prefix => 'Test1', options => { zero_copy_bytes => 1 } });
+
+my $blob = join '', map chr($_ % 256), 0 .. 9999;
+
+{
+    my $encoded = Test1::Basic->encode({ bytes_f => $blob, string_f => 'abc' });
+    my $decoded = Test1::Basic->decode($encoded);
+
+    is($decoded->get_bytes_f, $blob, 'bytes value');
+    is($decoded->get_string_f, 'abc', 'string value');
+    ok(Internals::SvREADONLY($decoded->{bytes_f}), 'bytes value is read-only');
+    ok(!Internals::SvREADONLY($decoded->{string_f}), 'string value is not read-only');
+
+    substr $encoded, 10, 10, 'x' x 10;
+    is($decoded->get_bytes_f, $blob, 'modifying the input does not change the value');
+    undef $encoded;
+    is($decoded->get_bytes_f, $blob, 'value survives the input');
+
+    $decoded->set_bytes_f('abc');
+    is($decoded->get_bytes_f, 'abc', 'value can be replaced');
+    ok(!Internals::SvREADONLY($decoded->{bytes_f}), 'replaced value is not read-only');
+
+}
+
+{
+    my $decoded = Test1::Basic->decode(Test1::Basic->encode({ bytes_f => 'a' }));
+
+    throws_ok(
+        sub { $decoded->{bytes_f} .= 'x' },
+        qr/Modification of a read-only value/,
+    );
+}
+
+{
+    my $value = { bytes_f => ["a", $blob, ""] };
+    my $decoded = Test1::Repeated->decode(Test1::Repeated->encode($value));
+
+    eq_or_diff($decoded, Test1::Repeated->new($value), 'repeated bytes');
+    eq_or_diff(Test1::Repeated->decode(Test1::Repeated->encode($decoded)),
+               Test1::Repeated->new($value), 'round trip');
+}
+
+{
+    my @values = map Test1::Basic->new({ bytes_f => "$_$blob" }), 1 .. 3;
+    my $stream = Test1::Basic->encode_many(\@values, delimited => 1);
+
+    eq_or_diff(Test1::Basic->decode_stream($stream), \@values, 'decode_stream');
+
+    my $decoder = Test1::Basic->stream_decoder;
+    my @decoded;
+    for (my $offset = 0; $offset < length $stream; $offset += 3000) {
+        $decoder->feed(substr $stream, $offset, 3000);
+        while (my $message = $decoder->next) {
+            push @decoded, $message;
+        }
+    }
+
+    eq_or_diff(\@decoded, \@values, 'stream_decoder');
+}
+
+{
+    my $decoder = Test1::Basic->stream_decoder;
+    my $encoded = Test1::Basic->encode({ bytes_f => 'abc' });
+
+    # a bytes field followed by a truncated field
+    $decoder->feed(chr(length($encoded) + 2) . $encoded . "\x0a\x05");
+    throws_ok(
+        sub { $decoder->next },
+        qr/Deserialization failed/,
+        'stream_decoder error',
+    );
+
+    $decoder->feed(chr(length $encoded) . $encoded);
+    is($decoder->next->get_bytes_f, 'abc', 'stream_decoder after an error');
+}
+
+done_testing();
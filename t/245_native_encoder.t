@@ -0,0 +1,86 @@
+use t::lib::Test;
+
+my $upb = Google::ProtocolBuffers::Dynamic->new('t/proto');
+my $native = Google::ProtocolBuffers::Dynamic->new('t/proto');
+for my $d ($upb, $native) {
+    $d->load_file("scalar.proto");
+    $d->load_file("repeated.proto");
+    $d->load_file("message.proto");
+    $d->load_file("map.proto");
+}
+$upb->map({ package => 'test', prefix => 'Test1' });
+$native->map({ package => 'test', prefix => 'Test2', options => { native_encoder => 1 } });
+
+my $long = 'x' x 300;
+my @tests = (
+    Basic => {},
+    Basic => {
+        double_f    => 0.125,
+        float_f     => 0.25,
+        int32_f     => -2,
+        int64_f     => -3,
+        uint32_f    => 4000000000,
+        uint64_f    => 5,
+        bool_f      => 1,
+        string_f    => "\x{101}",
+        bytes_f     => $long,
+        enum_f      => 2,
+        sint32_f    => -7,
+        sint64_f    => -8,
+        fixed32_f   => 9,
+        sfixed32_f  => -10,
+        fixed64_f   => 11,
+        sfixed64_f  => -12,
+    },
+    Repeated => {
+        int32_f     => [1, -1, 300],
+        string_f    => ['a', '', $long],
+        enum_f      => [1, 3],
+    },
+    Packed => {
+        double_f    => [1.5, 2.5],
+        int32_f     => [1, -1, 300],
+        uint64_f    => [(1000) x 50],
+        bool_f      => [],
+        enum_f      => [1, 3],
+    },
+    OuterWithMessage => {
+        optional_inner => { value => 1 },
+        repeated_inner => [{ value => 2 }, {}, { other => 3 }],
+    },
+    OuterWithMessage => {
+        optional_inner => { value => 1 },
+        repeated_inner => [({ value => 200, other => -1 }) x 20],
+    },
+    OuterWithGroup => {
+        inner => [{ value => 1 }, { value => 2 }],
+    },
+    Maps => {
+        string_int32_map => { a => 1, b => 2, $long => 3 },
+    },
+);
+
+while (my ($message, $value) = splice @tests, 0, 2) {
+    my $upb_encoded = "Test1::$message"->encode($value);
+    my $native_encoded = "Test2::$message"->encode($value);
+
+    is($native_encoded, $upb_encoded, "$message - same as upb");
+    eq_or_diff("Test2::$message"->decode($native_encoded),
+               "Test2::$message"->decode($upb_encoded),
+               "$message - round trip");
+}
+
+{
+    my $values = [{ int32_f => 1 }, { string_f => $long }];
+
+    is(Test2::Basic->encode_many($values, delimited => 1),
+       Test1::Basic->encode_many($values, delimited => 1),
+       'encode_many - same as upb');
+}
+
+throws_ok(
+    sub { Test2::Basic->encode({ enum_f => 7 }) },
+    qr/Invalid enumeration value 7 for field 'test.Basic.enum_f'/,
+);
+
+done_testing();
@@ -0,0 +1,31 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("scalar.proto");
+$d->map_message("test.Basic", "Test::Basic");
+$d->resolve_references();
+
+my $native = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$native->load_file("scalar.proto");
+$native->map_message("test.Basic", "Test::NativeBasic", { native_encoder => 1 });
+$native->resolve_references();
+
+# the output buffer is sized using the previous encoded value, check
+# that both growing and shrinking produce the correct result
+for my $size (10, 100000, 10, 1000, 100000) {
+    my $bytes = 'x' x $size;
+
+    for my $class (qw(Test::Basic Test::NativeBasic)) {
+        my $encoded = $class->encode({ bytes_f => $bytes, int32_f => 1 });
+        my $other = $class->encode({ int32_f => 2 });
+
+        is(length($encoded), $size + 2 + length(pack 'w', $size) + 1, "$class - $size - length");
+        is($class->decode($encoded)->get_bytes_f, $bytes, "$class - $size - round trip");
+        is($class->decode($other)->get_int32_f, 2, "$class - $size - separate value");
+    }
+
+    my $json = Test::Basic->encode_json({ string_f => $bytes });
+    is($json, qq{{"stringF":"$bytes"}}, "$size - JSON");
+}
+
+done_testing();
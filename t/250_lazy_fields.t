@@ -0,0 +1,88 @@
+use t::lib::Test;
+
+my $upb = Google::ProtocolBuffers::Dynamic->new('t/proto');
+my $native = Google::ProtocolBuffers::Dynamic->new('t/proto');
+my $named = Google::ProtocolBuffers::Dynamic->new('t/proto');
+for my $d ($upb, $native, $named) {
+    $d->load_file("message.proto");
+}
+$upb->map({ package => 'test', prefix => 'Test1', options => { lazy_fields => 1 } });
+$native->map({ package => 'test', prefix => 'Test2', options => { lazy_fields => 1, native_encoder => 1 } });
+$named->map({ package => 'test', prefix => 'Test3', options => { lazy_fields => ['test.OuterWithMessage.repeated_inner'] } });
+
+my $value = {
+    optional_inner => { value => 1 },
+    repeated_inner => [{ value => 2 }, {}, { other => 3 }],
+};
+my $encoded = Test1::OuterWithMessage->encode($value);
+
+for my $prefix (qw(Test1 Test2)) {
+    my $decoded = "${prefix}::OuterWithMessage"->decode($encoded);
+
+    ok(!ref $decoded->{optional_inner}, "$prefix - not decoded before access");
+    ok(!ref $decoded->{repeated_inner}[0], "$prefix - list item not decoded before access");
+
+    # untouched values are copied back
+    is("${prefix}::OuterWithMessage"->encode($decoded), $encoded, "$prefix - encode untouched");
+    is("${prefix}::OuterWithMessage"->encoded_size($decoded), length($encoded), "$prefix - size untouched");
+    lives_ok(sub { "${prefix}::OuterWithMessage"->check($decoded) }, "$prefix - check untouched");
+
+    eq_or_diff($decoded->get_optional_inner, "${prefix}::Inner"->new({ value => 1 }), "$prefix - scalar accessor");
+    isa_ok($decoded->{optional_inner}, "${prefix}::Inner", "$prefix - decoded in place");
+    eq_or_diff($decoded->get_repeated_inner(2), "${prefix}::Inner"->new({ other => 3 }), "$prefix - item accessor");
+    ok(!ref $decoded->{repeated_inner}[1], "$prefix - other items not decoded");
+    eq_or_diff($decoded->get_repeated_inner_list, [
+        "${prefix}::Inner"->new({ value => 2 }),
+        "${prefix}::Inner"->new({}),
+        "${prefix}::Inner"->new({ other => 3 }),
+    ], "$prefix - list accessor");
+
+    $decoded->get_optional_inner->set_value(7);
+    is("${prefix}::OuterWithMessage"->decode("${prefix}::OuterWithMessage"->encode($decoded))->get_optional_inner->get_value,
+       7, "$prefix - modified value");
+
+    my $partial = "${prefix}::OuterWithMessage"->decode($encoded);
+    $partial->get_repeated_inner(0);
+    is("${prefix}::OuterWithMessage"->encode($partial), $encoded, "$prefix - encode partially decoded");
+}
+
+{
+    my $decoded = Test3::OuterWithMessage->decode($encoded);
+
+    isa_ok($decoded->{optional_inner}, 'Test3::Inner', 'field not listed is not lazy');
+    ok(!ref $decoded->{repeated_inner}[0], 'listed field is lazy');
+    eq_or_diff($decoded->get_repeated_inner(0), Test3::Inner->new({ value => 2 }));
+}
+
+{
+    my $json = Test1::OuterWithMessage->decode_json('{"optionalInner":{"value":1}}');
+
+    isa_ok($json->{optional_inner}, 'Test1::Inner', 'JSON decoding is not lazy');
+}
+
+{
+    my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+    $d->load_file("unknown.proto");
+    $d->map({ package => 'test', prefix => 'TestMap', options => { lazy_fields => 1 } });
+
+    my $map_encoded = TestMap::OldOuter->encode({ by_name => { a => { value => 1 }, b => { value => 2 } } });
+    my $decoded = TestMap::OldOuter->decode($map_encoded);
+
+    isa_ok($decoded->{by_name}{a}, 'TestMap::OldInner', 'map values are not lazy');
+    eq_or_diff($decoded->get_by_name('b'), TestMap::OldInner->new({ value => 2 }), 'map item accessor');
+    eq_or_diff($decoded->get_by_name_map, {
+        a => TestMap::OldInner->new({ value => 1 }),
+        b => TestMap::OldInner->new({ value => 2 }),
+    }, 'map accessor');
+}
+
+# truncated values inside an unknown group, skipped by the lazy field scan
+for my $truncated ("\x2b\x09\x01\x02", "\x2b\x0d\x01", "\x2b\x0a\x05ab", "\x2b\x08") {
+    throws_ok(
+        sub { Test1::OuterWithMessage->decode($truncated) },
+        qr/Deserialization failed/,
+        'truncated unknown group',
+    );
+}
+
+done_testing();
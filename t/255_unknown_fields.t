@@ -0,0 +1,61 @@
+use t::lib::Test;
+
+my $d1 = Google::ProtocolBuffers::Dynamic->new('t/proto');
+my $d2 = Google::ProtocolBuffers::Dynamic->new('t/proto');
+for my $d ($d1, $d2) {
+    $d->load_file("unknown.proto");
+}
+$d1->map({ package => 'test', prefix => 'Test1' });
+$d2->map({ package => 'test', prefix => 'Test2', options => { preserve_unknown_fields => 1 } });
+
+my $value = {
+    id      => 1,
+    inner   => { value => 2, extra => 'a' },
+    items   => [{ value => 3, extra => 'b' }, { extra => 'c' }, { value => 4 }],
+    by_name => { x => { value => 5, extra => 'd' } },
+    note    => 'some note',
+    numbers => [1, 2, 3],
+    extra   => { a => 6 },
+};
+my $encoded = Test1::NewOuter->encode($value);
+my $expected = Test1::NewOuter->decode($encoded);
+
+{
+    my $old = Test2::OldOuter->decode($encoded);
+
+    eq_or_diff($old, Test2::OldOuter->new({
+        id      => 1,
+        inner   => Test2::OldInner->new({ value => 2 }),
+        items   => [map Test2::OldInner->new($_), { value => 3 }, {}, { value => 4 }],
+        by_name => { x => Test2::OldInner->new({ value => 5 }) },
+    }), 'known fields decoded');
+
+    my $reencoded = Test2::OldOuter->encode($old);
+    eq_or_diff(Test1::NewOuter->decode($reencoded), $expected, 'unknown fields preserved');
+    is(length($reencoded), length($encoded), 'same length');
+    is(Test2::OldOuter->encoded_size($old), length($encoded), 'encoded size');
+
+    $old->set_id(7);
+    $old->get_items(0)->set_value(8);
+    my $modified = Test1::NewOuter->decode(Test2::OldOuter->encode($old));
+    is($modified->get_id, 7, 'modified known field');
+    is($modified->get_items(0)->get_value, 8, 'modified known sub-message field');
+    is($modified->get_items(0)->get_extra, 'b', 'unknown sub-message field');
+    is($modified->get_note, 'some note', 'unknown field');
+}
+
+{
+    my $old = Test1::OldOuter->decode($encoded);
+    my $reencoded = Test1::NewOuter->decode(Test1::OldOuter->encode($old));
+
+    is($reencoded->get_note, undef, 'unknown fields discarded by default');
+    is($reencoded->get_inner->get_extra, undef, 'unknown sub-message fields discarded by default');
+}
+
+{
+    my $old = Test2::OldOuter->decode_json('{"id":1}');
+
+    is(length(Test2::OldOuter->encode($old)), 2, 'no unknown fields for JSON');
+}
+
+done_testing();
@@ -0,0 +1,67 @@
+use t::lib::Test;
+use Config;
+
+BEGIN {
+    plan skip_all => 'Perl built without thread support'
+        unless $Config{useithreads};
+}
+
+use threads;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("scalar.proto");
+$d->load_file("message.proto");
+$d->load_file("person.proto");
+$d->map({ package => 'test', prefix => 'Test1' });
+$d->map({ package => 'test', prefix => 'Test2', options => { lazy_fields => 1, zero_copy_bytes => 1 } });
+
+my $basic = Test1::Basic->encode({ int32_f => 1, string_f => 'abc', bytes_f => 'def' });
+my $outer = Test1::OuterWithMessage->encode({
+    optional_inner => { value => 1 },
+    repeated_inner => [{ value => 2 }, { other => 3 }],
+});
+
+# values decoded before the thread is created are cloned with it
+my $lazy = Test2::OuterWithMessage->decode($outer);
+my $shared_bytes = Test2::Basic->decode($basic);
+
+my @results = map threads->create(sub {
+    my $warning;
+    local $SIG{__WARN__} = sub { $warning = $_[0] };
+
+    my $person = Test1::Person->encode({ name => undef, id => 3 });
+
+    return {
+        registry        => $d,
+        decode          => Test1::Basic->decode($basic)->get_string_f,
+        encode          => Test1::Basic->encode({ int32_f => 1, string_f => 'abc', bytes_f => 'def' }),
+        partial         => Test1::OuterWithMessage->decode_partial($outer, ['repeated_inner.other'])->get_repeated_inner(1)->get_other,
+        lazy            => $lazy->get_repeated_inner(0)->get_value,
+        lazy_encode     => Test2::OuterWithMessage->encode(Test2::OuterWithMessage->decode($outer)),
+        shared_bytes    => $shared_bytes->get_bytes_f,
+        warning         => $warning,
+    };
+}), 1 .. 3;
+$_ = $_->join for @results;
+
+for my $result (@results) {
+    is($result->{registry}, undef, 'the registry is not cloned');
+    is($result->{decode}, 'abc', 'decode');
+    is($result->{encode}, $basic, 'encode');
+    is($result->{partial}, 3, 'decode_partial');
+    is($result->{lazy}, 2, 'lazy field decoded in thread');
+    is($result->{lazy_encode}, $outer, 'lazy field encoded in thread');
+    is($result->{shared_bytes}, 'def', 'zero-copy bytes');
+    like($result->{warning}, qr/^While encoding field 'name': Use of uninitialized value/, 'warning context');
+}
+
+# the parent is not affected by the threads
+ok(!ref $lazy->{repeated_inner}[0], 'lazy field not decoded in parent');
+is($lazy->get_repeated_inner(0)->get_value, 2, 'lazy field decoded in parent');
+is($shared_bytes->get_bytes_f, 'def', 'zero-copy bytes in parent');
+is(Test1::Basic->decode($basic)->get_string_f, 'abc', 'decode in parent');
+
+$d->map({ package => 'test', prefix => 'Test3' });
+is(Test3::Basic->decode($basic)->get_string_f, 'abc', 'map after creating threads');
+
+done_testing();
@@ -0,0 +1,68 @@
+use t::lib::Test;
+
+my $d = Google::ProtocolBuffers::Dynamic->new('t/proto');
+$d->load_file("person.proto");
+$d->load_file("message.proto");
+$d->load_file("map.proto");
+$d->map({ package => 'test', prefix => 'Test1', options => { decode_threads => 4 } });
+$d->map({ package => 'test', prefix => 'Test2' });
+
+{
+    my $persons = {
+        persons => [map {
+            { name => "Person $_", id => $_, ($_ % 3 ? (email => "p$_\@example.com") : ()) }
+        } 1 .. 5000],
+    };
+    my $encoded = Test2::PersonArray->encode($persons);
+
+    ok(length $encoded > 64 * 1024, 'input is large enough');
+    eq_or_diff(Test1::PersonArray->decode($encoded), Test2::PersonArray->decode($encoded), 'repeated messages');
+    isa_ok(Test1::PersonArray->decode($encoded)->get_persons_list->[0], 'Test1::Person');
+}
+
+{
+    my $values = {
+        optional_inner => { value => 7 },
+        repeated_inner => [map { { value => $_, other => -$_ } } 1 .. 20000],
+    };
+    my $encoded = Test2::OuterWithMessage->encode($values);
+
+    eq_or_diff(Test1::OuterWithMessage->decode($encoded), Test2::OuterWithMessage->decode($encoded), 'messages');
+}
+
+{
+    my $values = { inner => [map { { value => $_ } } 1 .. 30000] };
+    my $encoded = Test2::OuterWithGroup->encode($values);
+
+    eq_or_diff(Test1::OuterWithGroup->decode($encoded), Test2::OuterWithGroup->decode($encoded), 'groups');
+}
+
+{
+    my $values = { string_int32_map => { map { ("key $_" => $_) } 1 .. 10000 } };
+    my $encoded = Test2::Maps->encode($values);
+
+    eq_or_diff(Test1::Maps->decode($encoded), Test2::Maps->decode($encoded), 'maps');
+}
+
+{
+    my $encoded = Test2::PersonArray->encode({
+        persons => [map { { name => "Person $_", id => $_ } } 1 .. 5000],
+    });
+    # a last person with only the name field
+    $encoded .= "\x0a\x05\x0a\x03foo";
+
+    throws_ok(
+        sub { Test1::PersonArray->decode($encoded) },
+        qr/Deserialization failed: Missing required field test.Person.id/,
+        'missing required field',
+    );
+
+    substr $encoded, -10, 10, '';
+    throws_ok(
+        sub { Test1::PersonArray->decode($encoded) },
+        qr/Deserialization failed/,
+        'truncated input',
+    );
+}
+
+done_testing();